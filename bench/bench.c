@@ -0,0 +1,369 @@
+// Benchmark driver for the msf filesystem.
+//
+// Links in the filesystem from res/baseCommands.c and times createfs,
+// openfs, savefs, insert, retrieve, read_bytes, list and df on images
+// filled to several levels, using synthetic files from a few bytes up
+// to FILLER_SIZE. File contents come from a fixed seed so every run
+// works on the same bytes.
+//
+// Results go to stdout as one JSON object per line:
+//   {"op":"insert","fill":50,"size":65536,"count":16,"total_us":...,
+//    "mean_us":...,"min_us":...,"max_us":...,"mb_per_s":...}
+// size is 0 for operations that do not work on a single file.
+//
+// Usage: msf_bench [-r repetitions] [-d work_dir]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../res/baseCommands.h"
+
+
+#define FILLER_SIZE 1048576 // largest synthetic file, and the size of the filler
+
+// more filler names than a default image can ever hold
+#define MAX_FILLERS (DEFAULT_NUM_BLOCKS / (FILLER_SIZE / DEFAULT_BLOCK_SIZE))
+
+// Sizes of the synthetic files and how many of each every fill level gets
+static const uint32_t bench_sizes[] = { 64, 4096, 65536, FILLER_SIZE };
+static const int bench_counts[] = { 32, 32, 16, 4 };
+
+#define NUM_SIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+// How full, in percent of the data region, the image is before timing
+static const int bench_fill_levels[] = { 0, 25, 50, 75, 90 };
+
+#define NUM_FILL_LEVELS (sizeof(bench_fill_levels) / sizeof(bench_fill_levels[0]))
+
+// Results are written here, stdout itself goes to /dev/null while
+// we time commands so their output does not get in the way
+static FILE* results;
+
+
+struct timing
+{
+  uint32_t count;
+  double   total_us;
+  double   min_us;
+  double   max_us;
+  uint64_t bytes;
+};
+
+
+static double now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+static void record(struct timing* t, double start, uint64_t bytes)
+{
+  double us = now_us() - start;
+
+  if(t->count == 0 || us < t->min_us)
+  {
+    t->min_us = us;
+  }
+  if(us > t->max_us)
+  {
+    t->max_us = us;
+  }
+
+  t->count++;
+  t->total_us += us;
+  t->bytes += bytes;
+}
+
+
+static void report(const char* op, int fill, uint32_t size, struct timing* t)
+{
+  if(t->count == 0)
+  {
+    return;
+  }
+
+  double mb_per_s = t->total_us > 0 ? (t->bytes / 1048576.0) / (t->total_us / 1e6) : 0;
+
+  fprintf(results, "{\"op\":\"%s\",\"fill\":%d,\"size\":%u,\"count\":%u,"
+          "\"total_us\":%.1f,\"mean_us\":%.2f,\"min_us\":%.2f,\"max_us\":%.2f,"
+          "\"mb_per_s\":%.1f}\n",
+          op, fill, size, t->count, t->total_us, t->total_us / t->count,
+          t->min_us, t->max_us, mb_per_s);
+
+  memset(t, 0, sizeof(struct timing));
+}
+
+
+// xorshift64, good enough to keep the files from being trivially compressible
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+
+// Write a file of size bytes: half random, half repeating text,
+// so it looks roughly like the mixed payloads we store
+static void make_file(const char* name, uint32_t size)
+{
+  static const char text[] = "{\"id\": 1234, \"name\": \"sample record\", \"tags\": [\"a\", \"b\"]}\n";
+  uint8_t* buf = (uint8_t*) malloc(size ? size : 1);
+
+  uint32_t i;
+  for(i = 0; i < size; i++)
+  {
+    if((i / 512) % 2)
+    {
+      buf[i] = text[i % (sizeof(text) - 1)];
+    }
+    else
+    {
+      buf[i] = (uint8_t) next_random();
+    }
+  }
+
+  FILE* f = fopen(name, "w");
+  fwrite(buf, 1, size, f);
+  fclose(f);
+  free(buf);
+}
+
+
+// Run one fill level: build an image, fill it with FILLER_SIZE filler
+// files up to fill percent, then time every command on top of it
+static void run_level(struct msf_volume* vol, int fill, int reps)
+{
+  struct timing t;
+  memset(&t, 0, sizeof(t));
+
+  char name[64];
+  uint32_t s;
+  int i;
+  int r;
+
+  for(r = 0; r < reps; r++)
+  {
+    double start = now_us();
+    createfs(vol, "bench.img", DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_FILES, 0);
+    record(&t, start, 0);
+  }
+  report("createfs", fill, 0, &t);
+
+
+  // the filler files are symlinks to one file so their names differ
+  uint64_t fill_bytes = (uint64_t) vol->num_data_blocks * vol->block_size * fill / 100;
+  int fillers = fill_bytes / FILLER_SIZE;
+
+  for(i = 0; i < fillers; i++)
+  {
+    snprintf(name, sizeof(name), "fill%03d", i);
+    insert(vol, name);
+  }
+
+  savefs(vol);
+
+
+  // the synthetic files
+  for(s = 0; s < NUM_SIZES; s++)
+  {
+    for(i = 0; i < bench_counts[s]; i++)
+    {
+      snprintf(name, sizeof(name), "f%u_%02d", bench_sizes[s], i);
+
+      double start = now_us();
+      insert(vol, name);
+      record(&t, start, bench_sizes[s]);
+    }
+    report("insert", fill, bench_sizes[s], &t);
+  }
+
+
+  double start = now_us();
+  savefs(vol);
+  record(&t, start, 0);
+  report("savefs", fill, 0, &t);
+
+
+  for(r = 0; r < reps; r++)
+  {
+    start = now_us();
+    openfs(vol, "bench.img", 0);
+    record(&t, start, vol->image_size);
+  }
+  report("openfs", fill, 0, &t);
+
+
+  for(r = 0; r < reps; r++)
+  {
+    start = now_us();
+    openfs(vol, "bench.img", 1);
+    record(&t, start, 0);
+  }
+  report("openfs_mmap", fill, 0, &t);
+  openfs(vol, "bench.img", 0);
+
+
+  for(r = 0; r < reps; r++)
+  {
+    start = now_us();
+    list(vol);
+    record(&t, start, 0);
+  }
+  report("list", fill, 0, &t);
+
+
+  for(r = 0; r < reps; r++)
+  {
+    start = now_us();
+    df(vol);
+    record(&t, start, 0);
+  }
+  report("df", fill, 0, &t);
+
+
+  for(s = 0; s < NUM_SIZES; s++)
+  {
+    for(r = 0; r < reps; r++)
+    {
+      for(i = 0; i < bench_counts[s]; i++)
+      {
+        snprintf(name, sizeof(name), "f%u_%02d", bench_sizes[s], i);
+
+        start = now_us();
+        retrieve(vol, name, "out.tmp");
+        record(&t, start, bench_sizes[s]);
+      }
+    }
+    report("retrieve", fill, bench_sizes[s], &t);
+
+    for(r = 0; r < reps; r++)
+    {
+      for(i = 0; i < bench_counts[s]; i++)
+      {
+        snprintf(name, sizeof(name), "f%u_%02d", bench_sizes[s], i);
+
+        start = now_us();
+        read_bytes(vol, name, 0, bench_sizes[s]);
+        fflush(stdout);
+        record(&t, start, bench_sizes[s]);
+      }
+    }
+    report("read_bytes", fill, bench_sizes[s], &t);
+  }
+
+  unlink("out.tmp");
+}
+
+
+int main(int argc, char* argv[])
+{
+  int reps = 5;
+  char* dir = NULL;
+
+  int opt;
+  while((opt = getopt(argc, argv, "r:d:")) != -1)
+  {
+    if(opt == 'r')
+    {
+      reps = atoi(optarg);
+    }
+    else if(opt == 'd')
+    {
+      dir = optarg;
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [-r repetitions] [-d work_dir]\n", argv[0]);
+      return 2;
+    }
+  }
+
+
+  // work in a scratch directory so the inserted names stay short
+  char template[] = "/tmp/msf_bench.XXXXXX";
+  if(dir == NULL)
+  {
+    dir = mkdtemp(template);
+  }
+
+  if(dir == NULL || chdir(dir) == -1)
+  {
+    fprintf(stderr, "msf_bench: could not use work directory\n");
+    return 1;
+  }
+
+
+  results = fdopen(dup(STDOUT_FILENO), "w");
+  setvbuf(results, NULL, _IOLBF, 0);
+  freopen("/dev/null", "w", stdout);
+
+  struct msf_volume* vol = allocVolume();
+
+
+  uint32_t s;
+  int i;
+  char name[64];
+
+  make_file("filler", FILLER_SIZE);
+  for(i = 0; i < MAX_FILLERS; i++)
+  {
+    snprintf(name, sizeof(name), "fill%03d", i);
+    symlink("filler", name);
+  }
+
+  for(s = 0; s < NUM_SIZES; s++)
+  {
+    for(i = 0; i < bench_counts[s]; i++)
+    {
+      snprintf(name, sizeof(name), "f%u_%02d", bench_sizes[s], i);
+      make_file(name, bench_sizes[s]);
+    }
+  }
+
+
+  uint32_t l;
+  for(l = 0; l < NUM_FILL_LEVELS; l++)
+  {
+    run_level(vol, bench_fill_levels[l], reps);
+  }
+
+
+  releaseVolume(vol);
+
+  // clean up the scratch files
+  for(i = 0; i < MAX_FILLERS; i++)
+  {
+    snprintf(name, sizeof(name), "fill%03d", i);
+    unlink(name);
+  }
+
+  for(s = 0; s < NUM_SIZES; s++)
+  {
+    for(i = 0; i < bench_counts[s]; i++)
+    {
+      snprintf(name, sizeof(name), "f%u_%02d", bench_sizes[s], i);
+      unlink(name);
+    }
+  }
+
+  unlink("filler");
+  unlink("bench.img");
+
+  if(dir == template)
+  {
+    rmdir(dir);
+  }
+
+  return 0;
+}
@@ -2,885 +2,611 @@
 
 #include <stdio.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
-#include <signal.h>
 #include <stdint.h>
-#include <sys/stat.h>
-
-#define BLOCK_SIZE 1024 //Bytes
-#define NUM_BLOCKS 66370
-#define NUM_BLOCKS_FOR_FILE_DATA 65258
-#define BLOCKS_PER_FILE 1024 // = a file that is 1MB or 1,048,576 Bytes
-#define NUM_FILES 256
-#define FIRST_DATA_BLOCK 1112 // block our data begins at. if we start at 1,112 and add
-                              // the required number of blocks that should be available
-                              // to files (65,258), we get to a new NUM_BLOCKS of 66370
-
-#define MAX_FILE_SIZE 1048576 //Bytes
-
-uint8_t data[NUM_BLOCKS][BLOCK_SIZE];
-
-// 64 blocks needed for free_blocks
-uint8_t * free_blocks;
-
-// 1 block needed for free_inodes
-uint8_t * free_inodes;
-
-
-// directory
-struct directoryEntry
-{
-  char    filename[64];
-  short   in_use;
-  int32_t inode; //max inode
-};
-
-struct directoryEntry* directory;
-
-// inode
-struct inode
-{
-  int32_t  blocks[BLOCKS_PER_FILE];
-  short    in_use;
-  uint8_t  attribute;
-  uint32_t file_size;
-};
-
-struct inode* inodes;
-FILE* fp;
-char image_name[64];
-uint8_t image_open;
-
-
-
+#include <getopt.h>
 
+#include "res/baseCommands.h"
 
 #define WHITESPACE " \t\n"      // We want to split our command line up into tokens
                                 // so we need to define what delimits our tokens.
                                 // In this case  white space
                                 // will separate the tokens on our command line
 
-#define MAX_COMMAND_SIZE 255    // The maximum command-line size
-#define MAX_NUM_ARGUMENTS 15
+#define MAX_COMMAND_SIZE 4096   // The maximum command-line size
+#define MAX_NUM_ARGUMENTS 256   // tokens a command may have, the command itself included
 
 
 
 
-// "free_blocks" points to block number 1047
-// each index number directly corresponds to
-// a block that is allocated for file data
-// need to add 1,112 to the result to get the appropriate
-// location of where data actually starts
-int32_t findFreeBlock()
+// Index of a command in op_names, or -1 if it is not timed
+int findOp(const char* name)
 {
-  int i;
-  for( i = 0; i < NUM_BLOCKS_FOR_FILE_DATA; i++)
+  for(int i = 0; i < NUM_OPS; i++)
   {
-    if(free_blocks[i])
+    if(!strcmp(op_names[i], name))
     {
-      // Mark free block as in use in the free_blocks map
-      free_blocks[i] = 0;
-      return i + 1112;
+      return i;
     }
   }
-
   return -1;
 }
 
 
-// we will index block 19 moving 1 byte at a time
-// to find a free inode. Only moving 256 times
-// because we have 1 inode per file
-int32_t findFreeInode()
-{
-  int i;
-  for(i = 0; i < NUM_FILES; i++)
-  {
-    if(free_inodes[i])
-    {
-      // Mark free inode as in use in the free_inode map
-      free_inodes[i] = 0;
-      return i;
-    }
-  }
-
-  return -1;
-}
+#define MSF_QUIT 1 // runCommand result for the quit command
 
 
-// Looking for a free block within our
-// inode we found to be free
-int32_t findFreeInodeBlock(int32_t inode)
+// **process the filesystem commands**
+// Run one tokenized command. Returns 0 if it worked, -1 if it
+// failed and MSF_QUIT when the shell should stop
+int runCommand(struct msf_volume* vol, char** token)
 {
-  int i;
-  for(i = 0; i < BLOCKS_PER_FILE; i++)
+  //createfs, "createfs <image> [-b block size] [-n blocks] [-i inodes] [-t] [-z] [-d]"
+  //-t packs the short last block of a file into its inode, -z compresses
+  //files and -d stores identical blocks once
+  if(!strcmp("createfs", token[0]))
   {
-    if(inodes[inode].blocks[i] == -1)
+    if(token[1] == NULL)
     {
-      return i;
+      printf("ERROR: No filename specified\n");
+      return -1;
     }
-  }
-
-  return -1;
-}
 
+    uint32_t size = DEFAULT_BLOCK_SIZE;
+    uint32_t blocks = DEFAULT_NUM_BLOCKS;
+    uint32_t files = DEFAULT_NUM_FILES;
+    uint32_t features = 0;
 
+    int i;
+    for(i = 2; token[i] != NULL; i += 2)
+    {
+      // -t, -z and -d take no value
+      if(!strcmp("-t", token[i]))
+      {
+        features |= FEATURE_TAIL_PACK;
+        i--;
+        continue;
+      }
 
-void init()
-{
-  // directory pointer will point to the beginning of our directory (blocks 0-18)
-  // we can fit 256 directory entries in 18 blocks
-  directory = (struct directoryEntry*) &data[0][0];
+      if(!strcmp("-z", token[i]))
+      {
+        features |= FEATURE_COMPRESS;
+        i--;
+        continue;
+      }
 
+      if(!strcmp("-d", token[i]))
+      {
+        features |= FEATURE_DEDUP;
+        i--;
+        continue;
+      }
 
-  // inodes will point to beginning of our inodes treated
-  // as inode structs from (blocks 20-1046)
-  // enough for 256 inode structs
-  inodes = (struct inode*) &data[20][0];
-  
+      if(token[i + 1] == NULL)
+      {
+        printf("ERROR: Usage: createfs <filename> [-b block size] [-n blocks] [-i inodes] [-t] [-z] [-d]\n");
+        return -1;
+      }
 
-  // (blocks 1,047 - 1,111) can store enough 1 byte ints to reference
-  // 65,258 blocks of file data.
-  free_blocks = (uint8_t*) &data[1047][0];
+      uint32_t value = (uint32_t) strtoul(token[i + 1], NULL, 0);
 
+      if(!strcmp("-b", token[i]))
+      {
+        size = value;
+      }
+      else if(!strcmp("-n", token[i]))
+      {
+        blocks = value;
+      }
+      else if(!strcmp("-i", token[i]))
+      {
+        files = value;
+      }
+      else
+      {
+        printf("ERROR: Usage: createfs <filename> [-b block size] [-n blocks] [-i inodes] [-t] [-z] [-d]\n");
+        return -1;
+      }
+    }
 
-  // we have enough space in one block to keep track of 256 inodes
-  // using a 1 or 0 to represent free or not
-  free_inodes = (uint8_t*) &data[19][0];
+    // compressed clusters are not block aligned, so they can not share blocks
+    if((features & FEATURE_COMPRESS) && (features & FEATURE_DEDUP))
+    {
+      printf("ERROR: Compression and dedup can not be used together\n");
+      return -1;
+    }
 
-  // zero out the image name and set it as not open
-  memset(image_name, 0, 64);
-  image_open = 0;
+    return createfs(vol, token[1], size, blocks, files, features);
+  }
 
 
-  int i;
-  for(i = 0; i < NUM_FILES; i++)
+  //savefs
+  if(!strcmp("savefs", token[0]))
   {
-    // setting the directory entries to available
-    directory[i].in_use = 0;
-
-    // setting each directory entry's inode to -1
-    directory[i].inode = -1;
-    
-    // indexing block 19 where our free_inode map is kept
-    // for 256 files and setting them as available
-    free_inodes[i] = 1;
+    return savefs(vol);
+  }
 
-    memset(directory[i].filename, 0, 64);
 
+  //open, "open -m <image>" memory maps the image instead of reading it
+  if(!strcmp("open", token[0]))
+  {
+    int use_mmap = token[1] != NULL && !strcmp("-m", token[1]);
 
-    // initialize our block indexes stored in
-    // our inode structs to not in use.
-    int j;
-    for(j = 0; j < BLOCKS_PER_FILE; j++)
+    if(token[1 + use_mmap] == NULL )
     {
-      inodes[i].blocks[j] = -1;
+      printf("ERROR: no filename specified\n");
+      return -1;
     }
 
-    // Initialize the rest of the data kept
-    inodes[i].in_use = 0;
-    inodes[i].attribute = 0;
-    inodes[i].file_size = 0;
+    return openfs(vol, token[1 + use_mmap], use_mmap);
   }
 
-  
-  // initialize our free block map stored at blocks 1047 - 1111.
-  // Start at 0 run to NUM_BLOCKS_FOR_FILE_DATA
-  int j;
-  for(j = 0; j < NUM_BLOCKS_FOR_FILE_DATA; j++)
+
+  //close
+  if(!strcmp("close", token[0]))
   {
-    free_blocks[j] = 1;
+    return closefs(vol);
   }
 
-}
 
-
-uint32_t df()
-{
-  int j;
-  int count = 0;
-
-  // Use our free block map location (not where the actual data is stored)
-  // and run from 0 to NUM_BLOCKS_FOR_FILE_DATA
-  // checking if they are in use
-  for(j = 0; j < NUM_BLOCKS_FOR_FILE_DATA; j++)
+  //list
+  if(!strcmp("list", token[0]))
   {
-    if(free_blocks[j])
+    if(!vol->image_open)
     {
-      count++;
+      printf("ERROR: Disk image is not opened\n");
+      return -1;
     }
-  }
 
-  // return the numb of inuse blocks
-  // multiplied by the # bytes stored in 
-  // each block
-  return count * BLOCK_SIZE;
-}
-
-
-//creating a filesystem image and zeroing out all memory
-void createfs(char* filename)
-{
-  fp = fopen(filename, "w");
-  
-  // copy new filesystem filename to image_name
-  strncpy(image_name, filename, strlen(filename));
-
-  memset(data, 0, NUM_BLOCKS * BLOCK_SIZE);
+    return list(vol);
+  }
 
-  image_open = 1;
 
-  int i;
-  for(i = 0; i < NUM_FILES; i++)
+  //disk free space
+  if(!strcmp("df", token[0]))
   {
-    directory[i].in_use = 0;
-    directory[i].inode = -1;
-    free_inodes[i] = 1;
+    if(!vol->image_open)
+    {
+      printf("ERROR: Disk image is not open\n");
+      return -1;
+    }
 
-    memset(directory[i].filename, 0, 64);
+    printf("%llu bytes free\n", (unsigned long long) df(vol));
 
-    int j;
-    for(j = 0; j < BLOCKS_PER_FILE; j++)
+    if(vol->superblock->features & FEATURE_DEDUP)
     {
-      inodes[i].blocks[j] = -1;
+      printf("%llu bytes saved by shared blocks\n",
+             (unsigned long long) vol->used_count->shared * vol->block_size);
     }
-
-    // Initialize the rest of the data kept
-    inodes[i].in_use = 0;
-    inodes[i].attribute = 0;
-    inodes[i].file_size = 0;
+    return 0;
   }
 
-  int j;
-  for(j = 0; j < NUM_BLOCKS_FOR_FILE_DATA; j++)
+
+  //quit
+  if(!strcmp("quit", token[0]))
   {
-    free_blocks[j] = 1;
+    return MSF_QUIT;
   }
 
-  fclose(fp);
-}
-
 
-//saving the filesystem image to disk and clearing out the imagename.
-void savefs()
-{
-    if(image_open == 0)
+  //insert
+  if(!strcmp("insert", token[0]))
+  {
+    if(!vol->image_open)
     {
-        printf("ERROR: Disk image is not open\n");
-        return;
+      printf("ERROR: Disk image is not open\n");
+      return -1;
     }
 
-    fp = fopen(image_name, "w");
-
-    //writing to fp, from data
-    fwrite(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
-
-    //zero it back out, arent using it anymore
-    memset(image_name, 0, 64);
-
-    fclose(fp);
-}
-
-
-//open the filesytem image and parse all of our data
-void openfs(char* filename)
-{
-  //open image to read from
-  fp = fopen(filename, "r");
-
-  strncpy(image_name, filename, strlen(filename));
-
-  //reading from the fp and storing to data
-  fread(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
-
-  image_open = 1;
-
-  fclose(fp);
-}
+    if(token[1] == NULL)
+    {
+      printf("ERROR: No filename specified\n");
+      return -1;
+    }
 
+    // one plain name goes straight in, anything else is
+    // expanded and spread over the worker pool
+    if(token[2] == NULL && strpbrk(token[1], "*?[") == NULL)
+    {
+      return insert(vol, token[1]);
+    }
 
-//close our filesytem image
-void closefs()
-{
-  if(image_open == 0)
-  {
-    printf("ERROR: Disk image is not open\n");
-    return;
+    return insertMany(vol, &token[1]);
   }
 
-  fclose(fp);
-
-  image_open = 0;
-  memset(image_name, 0, 64);
-}
-
-
-//list files in our filesystem image
-void list()
-{
-
-  int i;
-  int not_found = 1;
 
-  for(i = 0; i < NUM_FILES; i++)
+  //retrieve
+  if(!strcmp("retrieve", token[0]))
   {
-    //\TODO Add a check to not list if the file is hidden
-    if(directory[i].in_use == 1)
+    if(!vol->image_open)
     {
-      not_found = 0;
-
-      char filename[65];
-      memset(filename, 0, 65);
-      strncpy(filename, directory[i].filename, strlen(directory[i].filename));
-
-      printf("%s\n",filename);
+      printf("ERROR: Disk image is not open\n");
+      return -1;
     }
-  }
 
-  if(not_found)
-  {
-    printf("list: No files found.\n");
-  }
-}
+    if(token[1] == NULL)
+    {
+      printf("ERROR: No filename specified\n");
+      return -1;
+    }
 
+    // "retrieve <file> [new name]" as always. More than two names,
+    // or any glob pattern, retrieves every match under its own name
+    if(token[3] == NULL && strpbrk(token[1], "*?[") == NULL &&
+       (token[2] == NULL || strpbrk(token[2], "*?[") == NULL))
+    {
+      return retrieve(vol, token[1], token[2]);
+    }
 
-// insert a file into system
-void insert(char* filename)
-{
-  // verify filename is not NULL
-  if(filename == NULL)
-  {
-    printf("ERROR: Filename is Null\n");
+    return retrieveMany(vol, &token[1]);
   }
 
 
-  // verify the file exists
-  struct stat buf;
-  int ret = stat(filename, &buf);
-  if(ret == -1)
+  //read
+  if(!strcmp("read", token[0]))
   {
-    printf("ERROR: File does not exist\n");
-    return;
-  }
+    if(!vol->image_open)
+    {
+      printf("ERROR: Disk image is not open\n");
+      return -1;
+    }
 
+    if(token[1] == NULL || token[2] == NULL || token[3] == NULL)
+    {
+      printf("ERROR: Usage: read <filename> <starting byte> <number of bytes>\n");
+      return -1;
+    }
 
-  //verify the file is not too big
-  if(buf.st_size > MAX_FILE_SIZE)
-  {
-    printf("ERROR: File is too large\n");
-    return;
+    return read_bytes(vol, token[1], strtoull(token[2], NULL, 10), strtoull(token[3], NULL, 10));
   }
 
 
-  //verify there is enough space
-  if(buf.st_size > df())
+  //write, "write <filename> <offset> <source file>" writes the source over
+  //the file from offset on, growing it if need be
+  if(!strcmp("write", token[0]) || !strcmp("append", token[0]))
   {
-    printf("ERROR: Not enough free disk space\n");
-    return;
-  }
+    int append = token[0][0] == 'a';
 
+    if(!vol->image_open)
+    {
+      printf("ERROR: Disk image is not open\n");
+      return -1;
+    }
 
-  //find an empty directory
-  int i;
-  int directory_entry = -1;
-  for( i = 0; i < NUM_FILES; i++)
-  {
-    if(directory[i].in_use == 0)
+    if(token[1] == NULL || token[2] == NULL || (!append && token[3] == NULL))
     {
-      directory_entry = i;
-      break;
+      printf("ERROR: Usage: write <filename> <offset> <source file>, append <filename> <source file>\n");
+      return -1;
     }
 
-  }
+    if(append)
+    {
+      return write_bytes(vol, token[1], 0, token[2], 1);
+    }
 
-  if(directory_entry == -1)
-  {
-    printf("ERROR: Could not find a free directory entry\n");
-    return;
+    return write_bytes(vol, token[1], strtoull(token[2], NULL, 10), token[3], 0);
   }
 
 
-  // Open the input file read-only
-  FILE* ifp = fopen(filename, "r");
-  printf("Reading %d bytes from %s\n", (int) buf.st_size, filename);
-
-
-  // Save off the size of the input file since we'll use it in a couple of places and
-  // also initialize our index variables to zero
-  int32_t copy_size = buf.st_size;
-
-
-  // We want to copy and write in chunks of BLOCK_SIZE. So to do this
-  // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-  // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-  int32_t offset = 0;
-
-
-  // Initializing to -1 we will then look for freeblocks we can store our
-  // data to  
-  int32_t block_index = -1;
-
-
-  // find a free inode from our inode map
-  int32_t inode_index = findFreeInode();
-  if(inode_index == -1)
+  //truncate, "truncate <filename> <size>" cuts the file short or pads it with zeros
+  if(!strcmp("truncate", token[0]))
   {
-    printf("ERROR: Can not find a free inode\n");
-    return;
-  }
-
-
-  // place the file info in the directory
-  directory[directory_entry].in_use = 1;
-  directory[directory_entry].inode = inode_index;
-  strncpy(directory[directory_entry].filename, filename, strlen(filename));
+    if(!vol->image_open)
+    {
+      printf("ERROR: Disk image is not open\n");
+      return -1;
+    }
 
+    if(token[1] == NULL || token[2] == NULL)
+    {
+      printf("ERROR: Usage: truncate <filename> <size>\n");
+      return -1;
+    }
 
-  // Take our found free indoe and set file size and set unavailable
-  inodes[inode_index].file_size = buf.st_size;
-  inodes[inode_index].in_use = 1;
+    return truncate_file(vol, token[1], strtoull(token[2], NULL, 10));
+  }
 
 
-  // copy_size is initialized to the size of the input file so each loop iteration we
-  // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-  // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-  // we have copied all the data from the input file
-  while(copy_size > 0)
+  //del, "del <filename>..." deletes each file named
+  if(!strcmp("del", token[0]))
   {
-
-    // Index into the input file by offset number of bytes. Initially offset is set to
-    // zero so we copy BLOCK_SIZE number of bytes from the front of the file. We
-    // then increase the offset by BLOCK_SIZE and continue the process. This will
-    // make us copy from offset 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-    fseek(ifp, offset, SEEK_SET);
-
-
-    // find a free block
-    block_index = findFreeBlock();
-    if(block_index == -1)
+    if(!vol->image_open)
     {
-      printf("ERROR: Can not find a free block\n");
-      return;
+      printf("ERROR: Disk image is not open\n");
+      return -1;
     }
 
-    
-    // Reading our data from file into our data array
-    int32_t bytes = fread(data[block_index], BLOCK_SIZE, 1, ifp);
-
-
-    // With our freely found inode, locate a free block with
-    // the inode blocks array and record the block_index into 
-    // our blocks array in the inode
-    int32_t free_inode_block = findFreeInodeBlock(inode_index);
-    inodes[inode_index].blocks[free_inode_block] = block_index;
-
-
-    // If bytes == 0 and we haven't reached the end of the file then something is
-    // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-    // It means we've reached the end of our input file.
-    if( bytes == 0 && !feof(ifp))
+    if(token[1] == NULL)
     {
-      printf("ERROR: An error occured reading from the input file\n");
-      return;
+      printf("ERROR: No filename specified\n");
+      return -1;
     }
 
-    // Clear the EOF file flag
-    clearerr(ifp);
-
-    // Reduce copy_size by the BLOCK_SIZE bytes
-    copy_size -= BLOCK_SIZE;
-
-    // Increase the offset into our input file by BLOCK_SIZE. This will allow
-    // the fseek at the top of the loop to position us to the correct spot.
-    offset += BLOCK_SIZE;
-  } 
-
-  // We are done copying from the input file so close it out
-  fclose(ifp);
-}
-
-
-// retrieve a file and place it into CWD
-void retrieve(char* filename, char* new_filename)
-{
-  int i;
-  int directory_location = -1;
-  for(i = 0; i < NUM_FILES; i++)
-  {
-    if(!strcmp(directory[i].filename, filename))
+    int result = 0;
+    int i;
+    for(i = 1; token[i] != NULL; i++)
     {
-      directory_location = i;
-      break;
+      if(del(vol, token[i]) == -1)
+      {
+        result = -1;
+      }
     }
-  }
 
-
-  if(directory_location == -1)
-  {
-    printf("ERROR: File not found\n");
-    return;
+    return result;
   }
 
 
-  int file_inode = directory[directory_location].inode;
-  
-
-  if(new_filename == NULL)
-  {
-    fp = fopen(filename, "w");
-  }
-  else
+  //scrub, also fsck, checks checksums and metadata
+  if(!strcmp("scrub", token[0]) || !strcmp("fsck", token[0]))
   {
-    fp = fopen(new_filename, "w");
+    return scrub(vol);
   }
 
-  
-  // Record the file size to know how many bytes to copy,
-  // initialize offset and current_block
-  int32_t offset = 0;
-  int32_t current_block = 0;
-  int32_t copy_size = inodes[file_inode].file_size;
 
-
-  while(inodes[file_inode].blocks[current_block] != (int32_t) -1)
+  //stats, "stats json" prints one JSON object, "stats reset" zeroes them
+  if(!strcmp("stats", token[0]))
   {
-    int32_t bytes;
-
-    // Save off the current block within our inode that has our data
-    int32_t block_index = inodes[file_inode].blocks[current_block];
-
-    fseek(fp, offset, SEEK_SET);
-
-    if(copy_size < BLOCK_SIZE)
-    {
-      bytes = fwrite(data[block_index], (int) copy_size, 1, fp);
-    }
-    else
+    if(token[1] != NULL && !strcmp("reset", token[1]))
     {
-      bytes = fwrite(data[block_index], BLOCK_SIZE, 1, fp);
+      memset(&stats, 0, sizeof(stats));
+      return 0;
     }
 
-
-    if( (bytes == 0) && (inodes[file_inode].blocks[current_block] != -1) )
+    if(token[1] != NULL && strcmp("json", token[1]))
     {
-      printf("ERROR: An error occurred writing to the specified file\n");
-      return;
+      printf("ERROR: Usage: stats [json|reset]\n");
+      return -1;
     }
 
-    offset += BLOCK_SIZE;
-    copy_size -= BLOCK_SIZE;
-    current_block ++;
+    return printStats(vol, token[1] != NULL);
   }
 
 
-
-  fclose(fp);
-
+  printf("ERROR: Unknown command %s\n", token[0]);
+  return -1;
 }
 
 
-// Read a specified number of bytes and print their hex value
-void read_bytes(char* filename, uint32_t start_byte, uint32_t req_num_bytes)
+// Split a command line into tokens and run it
+int executeLine(struct msf_volume* vol, char* command_string)
 {
-  int file_location = -1;
-  int i;
-  for(i = 0; i < NUM_FILES; i++)
-  {
-    if(!strcmp(directory[i].filename, filename))
-    {
-      file_location = i;
-      break;
-    }
-  }
-
+  /* Parse input */
+  // one more slot than there can be tokens, so runCommand always
+  // finds a NULL after the last one
+  char *token[MAX_NUM_ARGUMENTS + 1];
 
-  if(file_location == -1)
+  for( int i = 0; i <= MAX_NUM_ARGUMENTS; i++ )
   {
-    printf("ERROR: File not found\n");
-    return;
+    token[i] = NULL;
   }
 
+  int   token_count = 0;                                 
+                                                         
+  // Pointer to point to the token
+  // parsed by strsep
+  char *argument_ptr = NULL;                                         
+                                                         
+  char *working_string  = strdup( command_string );                
 
-  if(req_num_bytes == 0)
-  {
-    printf("ERROR: No bytes to read\n");
-    return;
-  }
+  // we are going to move the working_string pointer so
+  // keep track of its original value so we can deallocate
+  // the correct amount at the end
+  char *head_ptr = working_string;
 
-  
-  int32_t file_inode = directory[file_location].inode;
-  if(req_num_bytes > inodes[file_inode].file_size)
+  // Tokenize the input strings with whitespace used as the delimiter.
+  // A line with more arguments than fit is not run at all
+  int too_many = 0;
+  while ( (argument_ptr = strsep(&working_string, WHITESPACE ) ) != NULL )
   {
-    printf("ERROR: Request exceeds file size\n");
-    return;
-  }
-
+    if( token_count == MAX_NUM_ARGUMENTS )
+    {
+      too_many = too_many || strlen( argument_ptr ) > 0;
+      continue;
+    }
 
-  uint32_t file_size = inodes[file_inode].file_size;
-  if( (start_byte + req_num_bytes) > file_size)
-  {
-    printf("ERROR: Specifications of request exceed file size\n");
-    return;
+    token[token_count] = strndup( argument_ptr, MAX_COMMAND_SIZE );
+    if( strlen( token[token_count] ) == 0 )
+    {
+      free( token[token_count] );
+      token[token_count] = NULL;
+    }
+      token_count++;
   }
 
-  
-  uint32_t start_block_index = 0;
-  uint32_t temp_start_byte = start_byte;
-  uint32_t req_bytes_temp = req_num_bytes;
-  uint32_t num_blocks_to_read = 1;
 
-  // Find out how many blocks we need to read
-  while(req_bytes_temp > (uint32_t)BLOCK_SIZE)
+  //handle blank line input
+  int status = 0;
+  if(too_many)
   {
-    num_blocks_to_read++;
-    req_bytes_temp -= BLOCK_SIZE;
+    printf("ERROR: Too many arguments, a command takes at most %d\n", MAX_NUM_ARGUMENTS - 1);
+    status = -1;
   }
-  
-  
-  // Find out the first index of our block array within inode
-  // we should start looking at
-  // We are also able to then record the byte we should start
-  // reading at within the start block
-  while(temp_start_byte > (uint32_t)BLOCK_SIZE)
+  else if(token[0] != NULL)
   {
-    start_block_index++;
-    temp_start_byte -= (uint32_t)BLOCK_SIZE;
-  }
-       
+    int op = findOp(token[0]);
+    uint64_t start = nowNs();
 
-  int32_t remaining_bytes = req_num_bytes;
-  int32_t data_block_location = inodes[file_inode].blocks[start_block_index];
-  int32_t curr_block_index = start_block_index;
+    status = runCommand(vol, token);
 
-  while(remaining_bytes != 0)
-  {
-    if(temp_start_byte == 1023)
+    if(op != -1)
     {
-      temp_start_byte = 0;
-      data_block_location = inodes[file_inode].blocks[curr_block_index];
+      uint64_t elapsed = nowNs() - start;
+      struct opStats* stat = &stats.ops[op];
+
+      stat->count++;
+      stat->errors += status == -1;
+      stat->total_ns += elapsed;
+      stat->buckets[statBucket(elapsed / 1000)]++;
+      if(elapsed > stat->max_ns)
+      {
+        stat->max_ns = elapsed;
+      }
     }
+  }
 
-    printf("%x", data[data_block_location][temp_start_byte]);
 
-    temp_start_byte++;
-    remaining_bytes--;
+  // Cleanup allocated memory
+  for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ )
+  {
+    if( token[i] != NULL )
+    {
+      free( token[i] );
+    }
   }
-  printf("\n");
 
-  return;
+  free( head_ptr );
+
+  return status;
 }
 
 
-int main()
+// Batch mode: run commands without prompts, with stdout fully buffered,
+// stopping at the first one that fails. source names where the commands
+// came from for the error message. Returns the exit status for main
+int runBatch(struct msf_volume* vol, FILE* in, const char* source, char* command_string)
 {
-  char * command_string = (char*) malloc( MAX_COMMAND_SIZE );
-
-  fp = NULL;
-
-  init();
+  int line = 0;
 
-  while( 1 )
+  while( fgets (command_string, MAX_COMMAND_SIZE, in) )
   {
-    // Print out the msh prompt
-    printf ("msf> ");
-
-    // Read the command from the commandline.  The
-    // maximum command that will be read is MAX_COMMAND_SIZE
-    // This while command will wait here until the user
-    // inputs something since fgets returns NULL when there
-    // is no input
-    while( !fgets (command_string, MAX_COMMAND_SIZE, stdin) );
-
-   
-    /* Parse input */
-    char *token[MAX_NUM_ARGUMENTS];
+    line++;
 
-    for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ )
+    int status = executeLine(vol, command_string);
+    if(status == MSF_QUIT)
     {
-      token[i] = NULL;
+      break;
     }
 
-    int   token_count = 0;                                 
-                                                           
-    // Pointer to point to the token
-    // parsed by strsep
-    char *argument_ptr = NULL;                                         
-                                                           
-    char *working_string  = strdup( command_string );                
-
-    // we are going to move the working_string pointer so
-    // keep track of its original value so we can deallocate
-    // the correct amount at the end
-    char *head_ptr = working_string;
-
-    // Tokenize the input strings with whitespace used as the delimiter
-    while ( ( (argument_ptr = strsep(&working_string, WHITESPACE ) ) != NULL) && 
-              (token_count<MAX_NUM_ARGUMENTS))
+    if(status == -1)
     {
-      token[token_count] = strndup( argument_ptr, MAX_COMMAND_SIZE );
-      if( strlen( token[token_count] ) == 0 )
-      {
-        token[token_count] = NULL;
-      }
-        token_count++;
+      fflush(stdout);
+      fprintf(stderr, "msf: %s:%d: command failed: %s", source, line, command_string);
+      return 1;
     }
+  }
 
+  return 0;
+}
 
 
+// Usage:
+//   msf                  interactive shell
+//   msf -c "<command>"   run each -c command in order (repeatable)
+//   msf -f <file>        run the commands in file, - for stdin
+//   msf -M <megabytes>   file data to keep in memory, 0 reads whole
+//                        images in as they are opened
+// The -c commands run first. In batch mode there is no prompt and the
+// exit status is 1 if a command failed, 0 otherwise
+int main(int argc, char* argv[])
+{
+  char * command_string = (char*) malloc( MAX_COMMAND_SIZE );
 
-    //handle blank line input
-    if(token[0] == NULL)
-    {
-      free(head_ptr);
-      continue;
-    }
-
+  struct msf_volume* vol = allocVolume();
+  if(command_string == NULL || vol == NULL)
+  {
+    fprintf(stderr, "msf: out of memory\n");
+    return 1;
+  }
 
-    // **process the filesystem commands**
+  char** commands = (char**) calloc(argc, sizeof(char*));
+  int num_commands = 0;
+  char* script = NULL;
 
-    //createfs
-    if(!strcmp("createfs", token[0]))
+  int opt;
+  while((opt = getopt(argc, argv, "c:f:j:M:")) != -1)
+  {
+    if(opt == 'c')
     {
-      if(token[1] == NULL)
-      {
-        printf("ERROR: No filename specified\n");
-        continue;
-      }
-
-      createfs(token[1]);
+      commands[num_commands++] = optarg;
     }
-
-
-    //savefs
-    if(!strcmp("savefs", token[0]))
+    else if(opt == 'f')
     {
-      savefs();
+      script = optarg;
     }
-
-
-    //open
-    if(!strcmp("open", token[0]))
+    else if(opt == 'j')
     {
-      if(token[1] == NULL )
-      {
-        printf("ERROR: no filename specified\n");
-        continue;
-      }
-
-      openfs(token[1]);
+      vol->num_workers = atoi(optarg);
     }
-
-
-    //close
-    if(!strcmp("close", token[0]))
+    else if(opt == 'M')
     {
-      closefs();
+      vol->cache_budget = (size_t) atoi(optarg) << 20;
     }
-
-
-    //list
-    if(!strcmp("list", token[0]))
+    else
     {
-      if(!image_open)
-      {
-        printf("ERROR: Disk image is not opened\n");
-        continue;
-      }
-
-      list();
+      fprintf(stderr, "Usage: %s [-j threads] [-M megabytes] [-c command]... [-f file]\n", argv[0]);
+      return 2;
     }
+  }
 
 
-    //disk free space
-    if(!strcmp("df", token[0]))
-    {
-      if(!image_open)
-      {
-        printf("ERROR: Disk image is not open\n");
-        continue;
-      }
-
-      printf("%d bytes free\n", df());
-    }
-
+  if(num_commands > 0 || script != NULL)
+  {
+    // nobody is watching the output as it happens, so
+    // write it out in large blocks instead of line by line
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
 
-    //quit
-    if(!strcmp("quit", token[0]))
+    int i;
+    for(i = 0; i < num_commands; i++)
     {
-      exit(0);
-    }
+      snprintf(command_string, MAX_COMMAND_SIZE, "%s\n", commands[i]);
 
-
-    //insert
-    if(!strcmp("insert", token[0]))
-    {
-      if(!image_open)
+      int status = executeLine(vol, command_string);
+      if(status == MSF_QUIT)
       {
-        printf("ERROR: Disk image is not open\n");
-        continue;
+        return 0;
       }
 
-      if(token[1] == NULL)
+      if(status == -1)
       {
-        printf("ERROR: No filename specified\n");
-        continue;
+        fflush(stdout);
+        fprintf(stderr, "msf: -c: command failed: %s\n", commands[i]);
+        return 1;
       }
-
-      insert(token[1]);
     }
 
-
-    //retrieve
-    if(!strcmp("retrieve", token[0]))
+    int status = 0;
+    if(script != NULL)
     {
-      if(!image_open)
+      FILE* in = strcmp(script, "-") ? fopen(script, "r") : stdin;
+      if(in == NULL)
       {
-        printf("ERROR: Disk image is not open");
-        continue;
+        fprintf(stderr, "msf: could not open %s\n", script);
+        return 1;
       }
 
-      if(token[1] == NULL)
-      {
-        printf("ERROR: No filename specified\n");
-        continue;
-      }
-
-      retrieve(token[1], token[2]);
+      status = runBatch(vol, in, script, command_string);
     }
 
+    fflush(stdout);
+    return status;
+  }
 
-    //read
-    if(!strcmp("read", token[0]))
-    {
-      if(!image_open)
-      {
-        printf("ERROR: Disk image is not open\n");
-        continue;
-      }
-
-      read_bytes(token[1], (uint32_t) atoi(token[2]), (uint32_t) atoi(token[3]) );
-    }
 
-   
+  while( 1 )
+  {
+    // Print out the msh prompt
+    printf ("msf> ");
 
-    // Cleanup allocated memory
-    for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ )
+    // Read the command from the commandline.  The
+    // maximum command that will be read is MAX_COMMAND_SIZE
+    // fgets returns NULL at the end of the input, which
+    // ends the shell the same as quit
+    if( !fgets (command_string, MAX_COMMAND_SIZE, stdin) )
     {
-      if( token[i] != NULL )
-      {
-        free( token[i] );
-      }
+      printf("\n");
+      break;
     }
 
-    free( head_ptr );
-
+    if(executeLine(vol, command_string) == MSF_QUIT)
+    {
+      break;
+    }
   }
 
   free( command_string );
 
   return 0;
   // e2520ca2-76f3-90d6-0242ac120003
-}
\ No newline at end of file
+}
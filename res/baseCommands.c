@@ -0,0 +1,5897 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "crc32c.h"
+#include "lz.h"
+#include "baseCommands.h"
+
+const char* op_names[NUM_OPS] =
+{
+  "createfs", "savefs", "open", "close", "list", "df", "insert", "retrieve", "read", "scrub",
+  "write", "append", "truncate", "del"
+};
+
+struct fsStats stats;
+
+void cacheWriteBack(struct msf_volume* vol, uint32_t start, uint32_t count);
+void checksumBlocks(struct msf_volume* vol, uint32_t start, uint32_t count);
+int blockCommitted(struct msf_volume* vol, uint32_t b);
+
+// Set count bits of a map starting at bit start, a word at a time
+void setBits(uint64_t* map, uint32_t start, uint32_t count)
+{
+  while(count > 0)
+  {
+    uint32_t shift = start % BITS_PER_WORD;
+    uint32_t take = BITS_PER_WORD - shift;
+    if(take > count)
+    {
+      take = count;
+    }
+
+    uint64_t mask = (take == BITS_PER_WORD) ? ~0ULL : ((1ULL << take) - 1);
+    map[start / BITS_PER_WORD] |= mask << shift;
+
+    start += take;
+    count -= take;
+  }
+}
+
+
+// Clear count bits of a map starting at bit start
+void clearBits(uint64_t* map, uint32_t start, uint32_t count)
+{
+  while(count > 0)
+  {
+    uint32_t shift = start % BITS_PER_WORD;
+    uint32_t take = BITS_PER_WORD - shift;
+    if(take > count)
+    {
+      take = count;
+    }
+
+    uint64_t mask = (take == BITS_PER_WORD) ? ~0ULL : ((1ULL << take) - 1);
+    map[start / BITS_PER_WORD] &= ~(mask << shift);
+
+    start += take;
+    count -= take;
+  }
+}
+
+
+// Find the next run of set bits at or after bit from. Returns the first
+// bit of the run and stores its length in *length, -1 if there is none
+int32_t findSetRun(const uint64_t* map, uint32_t nbits, uint32_t from, uint32_t* length)
+{
+  uint32_t num_words = (nbits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  uint32_t w = from / BITS_PER_WORD;
+
+  if(from >= nbits)
+  {
+    return -1;
+  }
+
+  uint64_t word = map[w] & (~0ULL << (from % BITS_PER_WORD));
+  while(word == 0)
+  {
+    w++;
+    if(w == num_words)
+    {
+      return -1;
+    }
+    word = map[w];
+  }
+
+  uint32_t first = w * BITS_PER_WORD + __builtin_ctzll(word);
+  uint32_t end = first;
+
+  // the run carries on while the bits stay set, one word at a time
+  while(end < nbits)
+  {
+    uint64_t rest = map[end / BITS_PER_WORD] >> (end % BITS_PER_WORD);
+    uint32_t ones = (~rest == 0) ? BITS_PER_WORD : __builtin_ctzll(~rest);
+    uint32_t left = BITS_PER_WORD - end % BITS_PER_WORD;
+
+    if(ones >= left)
+    {
+      end += left;
+    }
+    else
+    {
+      end += ones;
+      break;
+    }
+  }
+
+  if(end > nbits)
+  {
+    end = nbits;
+  }
+
+  *length = end - first;
+  return first;
+}
+
+
+// Mark count blocks starting at block as changed since the last savefs
+void markDirty(struct msf_volume* vol, uint32_t block, uint32_t count)
+{
+  setBits(vol->dirty_blocks, block, count);
+}
+
+
+// Mark the blocks that hold len bytes at ptr, somewhere inside data, as
+// changed. Extent blocks live among the data blocks, so a change to one
+// of those gets its checksum worked out again
+void markDirtyRange(struct msf_volume* vol, const void* ptr, size_t len)
+{
+  size_t offset = (const uint8_t*) ptr - vol->data;
+  uint32_t first = offset / vol->block_size;
+  uint32_t count = (offset + len - 1) / vol->block_size - first + 1;
+
+  markDirty(vol, first, count);
+  if(first >= vol->first_data_block)
+  {
+    checksumBlocks(vol, first, count);
+  }
+}
+
+
+// Power of two bucket for a value, 0 for 0
+uint32_t statBucket(uint64_t value)
+{
+  uint32_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+  return bucket < STAT_BUCKETS ? bucket : STAT_BUCKETS - 1;
+}
+
+
+uint64_t nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Count one allocator search that looked at probes words
+void statAllocProbes(uint64_t probes)
+{
+  stats.alloc_calls++;
+  stats.alloc_probes += probes;
+  stats.alloc_probe_buckets[statBucket(probes)]++;
+
+  if(probes > stats.alloc_probe_max)
+  {
+    stats.alloc_probe_max = probes;
+  }
+}
+
+
+// Free bits of word w of a map of nbits bits, as set bits. The bits
+// past nbits in the last word are never free, and neither are the ones
+// set in held, if there is one
+uint64_t freeBits(const uint64_t* map, const uint64_t* held, uint32_t nbits, uint32_t w)
+{
+  uint64_t word = ~map[w] & (held != NULL ? ~held[w] : ~0ULL);
+
+  if((w + 1) * BITS_PER_WORD > nbits)
+  {
+    word &= (1ULL << (nbits % BITS_PER_WORD)) - 1;
+  }
+  return word;
+}
+
+
+// Find the first clear bit in a map of nbits bits, starting at *hint and
+// wrapping around. We look at 64 blocks per word and use count trailing
+// zeros to pick the bit out, so a full default map costs 1,020 word loads instead
+// of 65,258 byte loads. The bit found is set (marked in use) and
+// *hint is moved past it for the next call. Bits set in held, if it is
+// not NULL, are passed over as if they were in use
+int32_t findFreeBit(struct msf_volume* vol, uint64_t* map, const uint64_t* held, uint32_t nbits, uint32_t* hint)
+{
+  uint32_t num_words = (nbits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  uint32_t start = *hint < nbits ? *hint : 0;
+  uint32_t w = start / BITS_PER_WORD;
+
+  // mask off the bits below the hint in the first word, they
+  // get looked at again once we wrap back around to this word
+  uint64_t word = freeBits(map, held, nbits, w) & (~0ULL << (start % BITS_PER_WORD));
+
+  uint32_t i;
+  for(i = 0; i <= num_words; i++)
+  {
+    if(word)
+    {
+      uint32_t bit = w * BITS_PER_WORD + __builtin_ctzll(word);
+
+      map[w] |= 1ULL << (bit % BITS_PER_WORD);
+      markDirtyRange(vol, &map[w], sizeof(uint64_t));
+      *hint = bit + 1;
+      statAllocProbes(i + 1);
+      return bit;
+    }
+
+    w++;
+    if(w == num_words)
+    {
+      w = 0;
+    }
+    word = freeBits(map, held, nbits, w);
+  }
+
+  statAllocProbes(i);
+  return -1;
+}
+
+
+// "used_blocks" points to block_map_block
+// each bit directly corresponds to
+// a block that is allocated for file data
+// need to add first_data_block to the result to get the appropriate
+// location of where data actually starts. Blocks the image file still
+// has in use are only taken when there is nothing else
+int32_t findFreeBlock(struct msf_volume* vol)
+{
+  int32_t i = findFreeBit(vol, vol->used_blocks, vol->committed_blocks, vol->num_data_blocks, &vol->block_hint);
+  if(i == -1)
+  {
+    i = findFreeBit(vol, vol->used_blocks, NULL, vol->num_data_blocks, &vol->block_hint);
+  }
+  if(i == -1)
+  {
+    return -1;
+  }
+
+  vol->used_count->blocks++;
+  markDirtyRange(vol, vol->used_count, sizeof(struct usedCount));
+  stats.blocks_allocated++;
+
+  if(vol->refcounts != NULL)
+  {
+    vol->refcounts[i] = 1;
+    markDirtyRange(vol, &vol->refcounts[i], sizeof(uint16_t));
+  }
+  return i + vol->first_data_block;
+}
+
+
+// we will index the inode map moving 64 inodes at a time
+// to find a free inode. 256 inodes fit in 4 words
+// because we have 1 inode per file. Inode numbers start at 1
+int32_t findFreeInode(struct msf_volume* vol)
+{
+  int32_t i = findFreeBit(vol, vol->used_inodes, NULL, vol->num_files, &vol->inode_hint);
+  if(i == -1)
+  {
+    return -1;
+  }
+
+  vol->used_count->inodes++;
+  markDirtyRange(vol, vol->used_count, sizeof(struct usedCount));
+  return i + 1;
+}
+
+
+// Allocate a run of up to want contiguous free blocks. The first free
+// block is found with findFreeBit and the run is then grown a word at a
+// time for as long as the following bits are free. Like findFreeBlock
+// it keeps off blocks the image file still has in use while it can.
+// Returns the absolute block number the run starts at and stores its
+// length in *length
+int32_t findFreeRun(struct msf_volume* vol, uint32_t want, int32_t* length)
+{
+  const uint64_t* held = vol->committed_blocks;
+  int32_t first = findFreeBit(vol, vol->used_blocks, held, vol->num_data_blocks, &vol->block_hint);
+  if(first == -1)
+  {
+    held = NULL;
+    first = findFreeBit(vol, vol->used_blocks, held, vol->num_data_blocks, &vol->block_hint);
+  }
+  if(first == -1)
+  {
+    return -1;
+  }
+
+  uint32_t len = 1;
+  uint32_t bit = first + 1;
+
+  while(len < want && bit < vol->num_data_blocks)
+  {
+    uint32_t w = bit / BITS_PER_WORD;
+    uint32_t shift = bit % BITS_PER_WORD;
+    uint64_t word = freeBits(vol->used_blocks, held, vol->num_data_blocks, w) >> shift;
+    stats.alloc_probes++;
+
+    // number of free bits in a row starting at bit, within this word
+    uint32_t ones = (~word == 0) ? BITS_PER_WORD : __builtin_ctzll(~word);
+    if(ones > BITS_PER_WORD - shift)
+    {
+      ones = BITS_PER_WORD - shift;
+    }
+
+    uint32_t take = ones < want - len ? ones : want - len;
+    if(take == 0)
+    {
+      break;
+    }
+
+    uint64_t mask = (take == BITS_PER_WORD) ? ~0ULL : ((1ULL << take) - 1);
+    vol->used_blocks[w] |= mask << shift;
+    markDirtyRange(vol, &vol->used_blocks[w], sizeof(uint64_t));
+
+    len += take;
+    bit += take;
+
+    // the run stopped before the end of the word
+    if(take < BITS_PER_WORD - shift)
+    {
+      break;
+    }
+  }
+
+  vol->block_hint = bit;
+  vol->used_count->blocks += len;
+  markDirtyRange(vol, vol->used_count, sizeof(struct usedCount));
+  stats.blocks_allocated += len;
+
+  if(vol->refcounts != NULL)
+  {
+    uint32_t i;
+    for(i = first; i < first + len; i++)
+    {
+      vol->refcounts[i] = 1;
+    }
+    markDirtyRange(vol, &vol->refcounts[first], len * sizeof(uint16_t));
+  }
+
+  *length = len;
+  return first + vol->first_data_block;
+}
+
+
+// Clear a run of blocks in the free block map
+void freeBlockRun(struct msf_volume* vol, int32_t start, int32_t length)
+{
+  uint32_t first = start - vol->first_data_block;
+
+  clearBits(vol->used_blocks, first, length);
+  setBits(vol->punch_blocks, start, length);
+  markDirtyRange(vol, &vol->used_blocks[first / BITS_PER_WORD],
+                 ((first + length - 1) / BITS_PER_WORD - first / BITS_PER_WORD + 1) * sizeof(uint64_t));
+
+  vol->used_count->blocks -= length;
+  markDirtyRange(vol, vol->used_count, sizeof(struct usedCount));
+  stats.blocks_freed += length;
+}
+
+
+// Look for a data block already holding the block_size bytes at buf,
+// whose CRC32C is crc. Returns it, or -1 if there is none or the one
+// there can not take another reference. An entry left behind for a
+// block that has since been freed is never a match
+int32_t findFingerprint(struct msf_volume* vol, uint32_t crc, const uint8_t* buf)
+{
+  uint32_t slot = crc % vol->fingerprint_slots;
+  uint32_t probes;
+
+  for(probes = 0; probes < vol->fingerprint_slots; probes++)
+  {
+    struct fingerprint* fp = &vol->fingerprints[slot];
+
+    if(fp->block == FINGERPRINT_EMPTY)
+    {
+      break;
+    }
+
+    if(fp->block != FINGERPRINT_DELETED && fp->crc == crc &&
+       vol->refcounts[fp->block - vol->first_data_block] > 0 &&
+       vol->refcounts[fp->block - vol->first_data_block] < REFCOUNT_MAX &&
+       memcmp(BLOCK(vol, fp->block), buf, vol->block_size) == 0)
+    {
+      return fp->block;
+    }
+
+    slot = (slot + 1) % vol->fingerprint_slots;
+  }
+
+  return -1;
+}
+
+
+// Index a data block under the CRC32C of its contents
+void addFingerprint(struct msf_volume* vol, uint32_t crc, int32_t block)
+{
+  uint32_t slot = crc % vol->fingerprint_slots;
+
+  while(vol->fingerprints[slot].block != FINGERPRINT_EMPTY &&
+        vol->fingerprints[slot].block != FINGERPRINT_DELETED)
+  {
+    slot = (slot + 1) % vol->fingerprint_slots;
+  }
+
+  vol->fingerprints[slot].crc = crc;
+  vol->fingerprints[slot].block = block;
+  markDirtyRange(vol, &vol->fingerprints[slot], sizeof(struct fingerprint));
+}
+
+
+// Drop a data block that is being freed or changed from the fingerprint
+// index. It was indexed under the checksum it was stored with, which
+// still finds the slot when its bytes no longer match it. Blocks that
+// were never indexed, like extent blocks, are simply not found
+void removeFingerprint(struct msf_volume* vol, int32_t block)
+{
+  uint32_t crc = vol->checksums[block - vol->first_data_block];
+  uint32_t slot = crc % vol->fingerprint_slots;
+  uint32_t probes;
+
+  for(probes = 0; probes < vol->fingerprint_slots; probes++)
+  {
+    struct fingerprint* fp = &vol->fingerprints[slot];
+
+    if(fp->block == FINGERPRINT_EMPTY)
+    {
+      return;
+    }
+
+    if(fp->block == (uint32_t) block)
+    {
+      fp->block = FINGERPRINT_DELETED;
+      markDirtyRange(vol, fp, sizeof(struct fingerprint));
+      return;
+    }
+
+    slot = (slot + 1) % vol->fingerprint_slots;
+  }
+}
+
+
+// Return a run of blocks to the free block map. With dedup a block
+// only becomes free when the last file sharing it lets go of it
+void releaseBlocks(struct msf_volume* vol, int32_t start, int32_t length)
+{
+  if(vol->refcounts == NULL)
+  {
+    freeBlockRun(vol, start, length);
+    return;
+  }
+
+  int32_t b;
+  for(b = start; b < start + length; b++)
+  {
+    uint16_t* count = &vol->refcounts[b - vol->first_data_block];
+    markDirtyRange(vol, count, sizeof(uint16_t));
+
+    if(*count > 1)
+    {
+      (*count)--;
+      vol->used_count->shared--;
+      markDirtyRange(vol, vol->used_count, sizeof(struct usedCount));
+      continue;
+    }
+
+    *count = 0;
+    removeFingerprint(vol, b);
+    freeBlockRun(vol, b, 1);
+  }
+}
+
+
+// Allocate exactly want contiguous free blocks, passing over free runs
+// that are too short. Returns the first block, or -1 once the search
+// comes back round to the first short run without finding one
+int32_t findContiguousRun(struct msf_volume* vol, uint32_t want)
+{
+  int32_t first_short = -1;
+
+  for(;;)
+  {
+    int32_t length;
+    int32_t start = findFreeRun(vol, want, &length);
+
+    if(start == -1 || (uint32_t) length == want)
+    {
+      return start;
+    }
+
+    // the hint has moved past this run, so the next search starts beyond it
+    releaseBlocks(vol, start, length);
+    if(start == first_short)
+    {
+      return -1;
+    }
+
+    if(first_short == -1)
+    {
+      first_short = start;
+    }
+  }
+}
+
+
+// Return an inode to the free inode map
+void releaseInode(struct msf_volume* vol, int32_t inode)
+{
+  uint32_t bit = inode - 1;
+
+  vol->used_inodes[bit / BITS_PER_WORD] &= ~(1ULL << (bit % BITS_PER_WORD));
+  markDirtyRange(vol, &vol->used_inodes[bit / BITS_PER_WORD], sizeof(uint64_t));
+
+  vol->used_count->inodes--;
+  markDirtyRange(vol, vol->used_count, sizeof(struct usedCount));
+}
+
+
+// Extent number k of an inode, counting the direct ones first
+struct extent* extentAt(struct msf_volume* vol, int32_t inode, uint32_t k)
+{
+  struct inode* node = &vol->inodes[inode];
+
+  if(k < NUM_EXTENTS)
+  {
+    return &node->extents[k];
+  }
+  k -= NUM_EXTENTS;
+
+  if(k < EXTENTS_PER_BLOCK(vol))
+  {
+    return (struct extent*) BLOCK(vol, node->indirect) + k;
+  }
+  k -= EXTENTS_PER_BLOCK(vol);
+
+  uint32_t* extent_blocks = (uint32_t*) BLOCK(vol, node->double_indirect);
+  return (struct extent*) BLOCK(vol, extent_blocks[k / EXTENTS_PER_BLOCK(vol)]) + k % EXTENTS_PER_BLOCK(vol);
+}
+
+
+// Binary search the extents of an inode for the one holding block
+// file_block of the file. Returns its number, or -1 past the end
+int32_t findExtent(struct msf_volume* vol, int32_t inode, uint32_t file_block)
+{
+  // every cluster of a compressed file has exactly one extent
+  if(vol->inodes[inode].flags & INODE_COMPRESSED)
+  {
+    uint32_t k = file_block / CLUSTER_BLOCKS(vol);
+    return k < vol->inodes[inode].num_extents ? (int32_t) k : -1;
+  }
+
+  int32_t low = 0;
+  int32_t high = (int32_t) vol->inodes[inode].num_extents - 1;
+
+  // find the last extent starting at or before file_block
+  while(low < high)
+  {
+    int32_t mid = low + (high - low + 1) / 2;
+
+    if(extentAt(vol, inode, mid)->logical <= file_block)
+    {
+      low = mid;
+    }
+    else
+    {
+      high = mid - 1;
+    }
+  }
+
+  if(high < 0)
+  {
+    return -1;
+  }
+
+  struct extent* ext = extentAt(vol, inode, low);
+  if(file_block - ext->logical >= (uint32_t) ext->length)
+  {
+    return -1;
+  }
+
+  return low;
+}
+
+
+// Map a block number within a file to the data block holding it.
+// Returns -1 past the end of the file
+int32_t fileBlock(struct msf_volume* vol, int32_t inode, uint32_t file_block)
+{
+  int32_t k = findExtent(vol, inode, file_block);
+  if(k == -1)
+  {
+    return -1;
+  }
+
+  struct extent* ext = extentAt(vol, inode, k);
+  return ext->start + (file_block - ext->logical);
+}
+
+
+// Take a free block to hold extents or extent block numbers. Blocks
+// are not zeroed when they are freed, so it is cleared here
+int32_t allocExtentBlock(struct msf_volume* vol)
+{
+  int32_t block = findFreeBlock(vol);
+  if(block == -1)
+  {
+    return -1;
+  }
+
+  memset(BLOCK(vol, block), 0, vol->block_size);
+  markDirty(vol, block, 1);
+  checksumBlocks(vol, block, 1);
+  return block;
+}
+
+
+// Add an extent to the end of a file, taking an indirect, double
+// indirect or extent block when it is the first to need one.
+// Returns -1 when there is no room for another extent
+int appendExtent(struct msf_volume* vol, int32_t inode, uint32_t logical, int32_t start, int32_t length)
+{
+  struct inode* node = &vol->inodes[inode];
+  uint32_t k = node->num_extents;
+
+  if(k >= MAX_EXTENTS(vol))
+  {
+    return -1;
+  }
+
+  if(k == NUM_EXTENTS)
+  {
+    int32_t block = allocExtentBlock(vol);
+    if(block == -1)
+    {
+      return -1;
+    }
+
+    node->indirect = block;
+  }
+  else if(k >= NUM_EXTENTS + EXTENTS_PER_BLOCK(vol))
+  {
+    uint32_t j = k - NUM_EXTENTS - EXTENTS_PER_BLOCK(vol);
+
+    if(j == 0)
+    {
+      int32_t block = allocExtentBlock(vol);
+      if(block == -1)
+      {
+        return -1;
+      }
+
+      node->double_indirect = block;
+    }
+
+    if(j % EXTENTS_PER_BLOCK(vol) == 0)
+    {
+      int32_t block = allocExtentBlock(vol);
+      if(block == -1)
+      {
+        return -1;
+      }
+
+      uint32_t* extent_blocks = (uint32_t*) BLOCK(vol, node->double_indirect);
+      extent_blocks[j / EXTENTS_PER_BLOCK(vol)] = block;
+      markDirtyRange(vol, &extent_blocks[j / EXTENTS_PER_BLOCK(vol)], sizeof(uint32_t));
+    }
+  }
+
+  struct extent* ext = extentAt(vol, inode, k);
+  ext->logical = logical;
+  ext->start = start;
+  ext->length = length;
+  markDirtyRange(vol, ext, sizeof(struct extent));
+
+  node->num_extents++;
+  markDirtyRange(vol, node, sizeof(struct inode));
+  return 0;
+}
+
+
+// Bumped whenever blocks leave a file of any volume, or an image is
+// opened or closed, so a cached cluster is never mistaken for whatever
+// is stored in its blocks next
+uint64_t cluster_generation;
+
+
+// Give the extents of an inode from number keep on back to the free
+// block map, along with the extent blocks only they were listed in
+void dropExtents(struct msf_volume* vol, int32_t inode, uint32_t keep)
+{
+  struct inode* node = &vol->inodes[inode];
+  uint32_t base = NUM_EXTENTS + EXTENTS_PER_BLOCK(vol); // extents before the double indirect ones
+
+  uint32_t k;
+  for(k = keep; k < node->num_extents; k++)
+  {
+    struct extent* ext = extentAt(vol, inode, k);
+    releaseBlocks(vol, ext->start, ext->length);
+  }
+
+  if(node->double_indirect)
+  {
+    uint32_t* extent_blocks = (uint32_t*) BLOCK(vol, node->double_indirect);
+    uint32_t used = node->num_extents > base ? node->num_extents - base : 0;
+    uint32_t kept = keep > base ? keep - base : 0;
+
+    for(k = (kept + EXTENTS_PER_BLOCK(vol) - 1) / EXTENTS_PER_BLOCK(vol);
+        k < (used + EXTENTS_PER_BLOCK(vol) - 1) / EXTENTS_PER_BLOCK(vol); k++)
+    {
+      releaseBlocks(vol, extent_blocks[k], 1);
+      extent_blocks[k] = 0;
+      markDirtyRange(vol, &extent_blocks[k], sizeof(uint32_t));
+    }
+
+    if(kept == 0)
+    {
+      releaseBlocks(vol, node->double_indirect, 1);
+      node->double_indirect = 0;
+    }
+  }
+
+  if(node->indirect && keep <= NUM_EXTENTS)
+  {
+    releaseBlocks(vol, node->indirect, 1);
+    node->indirect = 0;
+  }
+
+  for(k = keep; k < node->num_extents && k < NUM_EXTENTS; k++)
+  {
+    memset(&node->extents[k], 0, sizeof(struct extent));
+  }
+
+  node->num_extents = keep;
+  markDirtyRange(vol, node, sizeof(struct inode));
+
+  // the blocks may soon hold another file's clusters
+  STAT_ADD(cluster_generation, 1);
+}
+
+
+// Give every extent of an inode, and the blocks listing them,
+// back to the free block map
+void releaseExtents(struct msf_volume* vol, int32_t inode)
+{
+  struct inode* node = &vol->inodes[inode];
+
+  dropExtents(vol, inode, 0);
+
+  memset(node->extents, 0, sizeof(node->extents));
+  memset(node->tail, 0, sizeof(node->tail));
+  node->flags = 0;
+  markDirtyRange(vol, node, sizeof(struct inode));
+}
+
+
+// The bytes of a file kept in its inode rather than in data blocks, all
+// of an inline file or the packed tail, and the file offset they start at
+uint8_t* inodeData(struct msf_volume* vol, int32_t inode, uint64_t* offset)
+{
+  struct inode* node = &vol->inodes[inode];
+
+  if(node->flags & INODE_INLINE)
+  {
+    *offset = 0;
+    return (uint8_t*) node->extents;
+  }
+
+  *offset = node->file_size - node->file_size % vol->block_size;
+  return node->tail;
+}
+
+
+// Reserve blocks_needed blocks for an inode, asking the allocator for
+// the longest runs it can give us so the file ends up in as few extents
+// as possible. Returns -1, with nothing left reserved, when the free
+// space is too small or too fragmented to hold the file
+int reserveExtents(struct msf_volume* vol, int32_t inode, uint32_t blocks_needed)
+{
+  uint32_t logical = 0;
+
+  while(blocks_needed > 0)
+  {
+    int32_t length;
+    int32_t block_index = findFreeRun(vol, blocks_needed, &length);
+
+    if(block_index == -1)
+    {
+      releaseExtents(vol, inode);
+      return -1;
+    }
+
+    if(appendExtent(vol, inode, logical, block_index, length) == -1)
+    {
+      releaseBlocks(vol, block_index, length);
+      releaseExtents(vol, inode);
+      return -1;
+    }
+
+    markDirty(vol, block_index, length);
+
+    logical += length;
+    blocks_needed -= length;
+  }
+
+  return 0;
+}
+
+
+// preadv count iovecs from fd at offset, picking up where a short read
+// left off. Returns -1 on an error or if the file ends first
+int readFullv(int fd, struct iovec* v, int count, off_t offset)
+{
+  while(count > 0)
+  {
+    ssize_t got = preadv(fd, v, count, offset);
+    if(got == -1 && errno == EINTR)
+    {
+      continue;
+    }
+
+    STAT_ADD(stats.host_reads, 1);
+    if(got > 0)
+    {
+      STAT_ADD(stats.host_bytes_read, got);
+    }
+
+    // an error, or the file got shorter since we looked at its size
+    if(got <= 0)
+    {
+      return -1;
+    }
+
+    offset += got;
+
+    while(count > 0 && (size_t) got >= v->iov_len)
+    {
+      got -= v->iov_len;
+      v++;
+      count--;
+    }
+
+    if(count > 0)
+    {
+      v->iov_base = (uint8_t*) v->iov_base + got;
+      v->iov_len -= got;
+    }
+  }
+
+  return 0;
+}
+
+
+// Write out a list of iovecs completely, carrying on after short writes
+int writeFullv(int fd, struct iovec* iov, int count)
+{
+  while(count > 0)
+  {
+    ssize_t written = writev(fd, iov, count);
+    if(written == -1)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+
+    STAT_ADD(stats.host_writes, 1);
+    STAT_ADD(stats.host_bytes_written, written);
+
+    while(count > 0 && (size_t) written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if(count > 0)
+    {
+      iov->iov_base = (uint8_t*) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return 0;
+}
+
+
+#define PIPE_CHUNK (1 << 20) // least a pipeline moves per buffer
+
+// A background thread moving a host file through two buffers, so that
+// reading ahead of the caller, or writing behind it, overlaps with
+// whatever the caller does with the other buffer. The caller works
+// through a buffer a step at a time and the two sides hand buffers
+// back and forth in turn. A file that fits in one buffer has nothing
+// to overlap, so it is moved by the caller with no thread
+struct ioPipe
+{
+  int fd;
+  int writing;     // buffers go out to fd rather than coming in from it
+  int threaded;
+  off_t offset;    // where the next buffer is read from
+  uint64_t end;    // reading stops here
+  size_t chunk;    // bytes in a buffer, a whole number of steps
+  size_t step;
+  uint8_t* buf[2];
+  size_t len[2];
+  int full[2];     // holds bytes the other side has not taken yet
+  int turn;        // buffer the caller works on next
+  int held;        // the caller has buffer turn
+  size_t pos;      // how far through it the caller is
+  int failed;
+  int closing;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t thread;
+};
+
+
+// Fill buffer i with the next bytes of the file. Returns -1 on an error
+int pipeRead(struct ioPipe* pipe, int i)
+{
+  struct iovec iov;
+  iov.iov_base = pipe->buf[i];
+  iov.iov_len = pipe->end - pipe->offset < pipe->chunk ? pipe->end - pipe->offset : pipe->chunk;
+
+  pipe->len[i] = iov.iov_len;
+  if(readFullv(pipe->fd, &iov, 1, pipe->offset) == -1)
+  {
+    return -1;
+  }
+
+  pipe->offset += pipe->len[i];
+  return 0;
+}
+
+
+// Write out what the caller put in buffer i. Returns -1 on an error
+int pipeWrite(struct ioPipe* pipe, int i)
+{
+  struct iovec iov;
+  iov.iov_base = pipe->buf[i];
+  iov.iov_len = pipe->len[i];
+  return writeFullv(pipe->fd, &iov, 1);
+}
+
+
+void* pipeMain(void* arg)
+{
+  struct ioPipe* pipe = (struct ioPipe*) arg;
+  int i = 0;
+
+  pthread_mutex_lock(&pipe->lock);
+  while(!pipe->failed)
+  {
+    // reading waits for the caller to give a buffer back, writing
+    // for it to hand one over, and both stop when it closes the pipe
+    if(pipe->full[i] != pipe->writing)
+    {
+      if(pipe->closing)
+      {
+        break;
+      }
+      pthread_cond_wait(&pipe->changed, &pipe->lock);
+      continue;
+    }
+
+    if(!pipe->writing && (uint64_t) pipe->offset >= pipe->end)
+    {
+      break;
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+    int status = pipe->writing ? pipeWrite(pipe, i) : pipeRead(pipe, i);
+    pthread_mutex_lock(&pipe->lock);
+
+    if(status == -1)
+    {
+      pipe->failed = 1;
+      break;
+    }
+
+    pipe->full[i] = !pipe->writing;
+    pthread_cond_broadcast(&pipe->changed);
+    i ^= 1;
+  }
+
+  // a failed pipe wakes a caller that is still waiting on it
+  pthread_cond_broadcast(&pipe->changed);
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
+}
+
+
+// Start moving size bytes between fd and a pipe the caller works
+// through step bytes at a time. Reading starts at offset 0 of fd,
+// writing appends to it. Returns -1 if there is not enough memory
+int pipeOpen(struct ioPipe* pipe, int fd, int writing, uint64_t size, size_t step)
+{
+  memset(pipe, 0, sizeof(struct ioPipe));
+  pipe->fd = fd;
+  pipe->writing = writing;
+  pipe->end = size;
+  pipe->step = step;
+
+  // a small file gets a buffer just big enough for it
+  pipe->chunk = ((PIPE_CHUNK + step - 1) / step) * step;
+  if(size < pipe->chunk)
+  {
+    pipe->chunk = size > 0 ? ((size + step - 1) / step) * step : step;
+  }
+
+  pipe->buf[0] = (uint8_t*) malloc(pipe->chunk);
+  pipe->buf[1] = size > pipe->chunk ? (uint8_t*) malloc(pipe->chunk) : NULL;
+
+  if(pipe->buf[0] == NULL || (size > pipe->chunk && pipe->buf[1] == NULL))
+  {
+    free(pipe->buf[0]);
+    free(pipe->buf[1]);
+    return -1;
+  }
+
+  if(size > pipe->chunk)
+  {
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->changed, NULL);
+    pipe->threaded = pthread_create(&pipe->thread, NULL, pipeMain, pipe) == 0;
+
+    if(!pipe->threaded)
+    {
+      pthread_mutex_destroy(&pipe->lock);
+      pthread_cond_destroy(&pipe->changed);
+    }
+  }
+
+  return 0;
+}
+
+
+// Take the next buffer for the caller, waiting for the thread if it
+// is still reading it in or writing it out. Without a thread the
+// caller reads it in itself. Returns -1 once the pipe has failed
+int pipeTake(struct ioPipe* pipe)
+{
+  int i = pipe->turn;
+
+  if(!pipe->threaded)
+  {
+    if(pipe->failed || (!pipe->writing && pipeRead(pipe, i) == -1))
+    {
+      pipe->failed = 1;
+      return -1;
+    }
+  }
+  else
+  {
+    pthread_mutex_lock(&pipe->lock);
+    while(pipe->full[i] == pipe->writing && !pipe->failed)
+    {
+      pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+
+    // a buffer read before a failure is still good, but
+    // nothing more can be written after one
+    int ready = pipe->full[i] != pipe->writing && !(pipe->writing && pipe->failed);
+    pthread_mutex_unlock(&pipe->lock);
+
+    if(!ready)
+    {
+      return -1;
+    }
+  }
+
+  pipe->held = 1;
+  pipe->pos = 0;
+  return 0;
+}
+
+
+// Hand the caller's buffer to the thread, or without one read or
+// write it there and then, and move on to the other buffer
+void pipeGive(struct ioPipe* pipe)
+{
+  int i = pipe->turn;
+
+  if(pipe->writing)
+  {
+    pipe->len[i] = pipe->pos;
+  }
+  pipe->held = 0;
+
+  if(!pipe->threaded)
+  {
+    if(pipe->writing && pipeWrite(pipe, i) == -1)
+    {
+      pipe->failed = 1;
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&pipe->lock);
+  pipe->full[i] = pipe->writing;
+  pipe->turn ^= 1;
+  pthread_cond_broadcast(&pipe->changed);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+
+// The caller's next step. Reading, it holds the next *len bytes of the
+// file, step bytes until the end. Writing, it is room for *len bytes.
+// NULL once the pipe has failed
+uint8_t* pipeGet(struct ioPipe* pipe, size_t* len)
+{
+  if(!pipe->held && pipeTake(pipe) == -1)
+  {
+    return NULL;
+  }
+
+  int i = pipe->turn;
+  if(pipe->writing)
+  {
+    *len = pipe->step;
+  }
+  else
+  {
+    *len = pipe->len[i] - pipe->pos < pipe->step ? pipe->len[i] - pipe->pos : pipe->step;
+  }
+
+  return pipe->buf[i] + pipe->pos;
+}
+
+
+// Finish with the step pipeGet handed out. Writing, len bytes of it
+// are to go out
+void pipePut(struct ioPipe* pipe, size_t len)
+{
+  int i = pipe->turn;
+
+  if(pipe->writing)
+  {
+    pipe->pos += len;
+    if(pipe->chunk - pipe->pos < pipe->step)
+    {
+      pipeGive(pipe);
+    }
+    return;
+  }
+
+  pipe->pos += pipe->len[i] - pipe->pos < pipe->step ? pipe->len[i] - pipe->pos : pipe->step;
+  if(pipe->pos == pipe->len[i])
+  {
+    pipeGive(pipe);
+  }
+}
+
+
+// Write out what is left and let the pipe go. Returns -1 if any read
+// or write failed
+int pipeClose(struct ioPipe* pipe)
+{
+  if(pipe->writing && pipe->held && pipe->pos > 0)
+  {
+    pipeGive(pipe);
+  }
+
+  if(pipe->threaded)
+  {
+    pthread_mutex_lock(&pipe->lock);
+    pipe->closing = 1;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+
+    pthread_join(pipe->thread, NULL);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->changed);
+  }
+
+  free(pipe->buf[0]);
+  free(pipe->buf[1]);
+  return pipe->failed ? -1 : 0;
+}
+
+
+// Work out the checksums of count data blocks from start, once they
+// hold what was stored in them. Only touches their own checksums, so
+// insert workers call it without fs_lock and mark them dirty after
+void computeChecksums(struct msf_volume* vol, uint32_t start, uint32_t count)
+{
+  uint32_t b;
+  for(b = start; b < start + count; b++)
+  {
+    vol->checksums[b - vol->first_data_block] = crc32c(0, BLOCK(vol, b), vol->block_size);
+  }
+}
+
+
+// computeChecksums, and mark the checksums as changed. Checksums are
+// kept up to date as blocks are stored, so scrub can check blocks that
+// have not been saved yet
+void checksumBlocks(struct msf_volume* vol, uint32_t start, uint32_t count)
+{
+  computeChecksums(vol, start, count);
+  markDirtyRange(vol, &vol->checksums[start - vol->first_data_block], (size_t) count * sizeof(uint32_t));
+}
+
+
+// Mark the checksums of count data blocks from start as changed, for
+// workers that worked them out without holding fs_lock
+void markChecksums(struct msf_volume* vol, uint32_t start, uint32_t count)
+{
+  pthread_mutex_lock(&vol->fs_lock);
+  markDirtyRange(vol, &vol->checksums[start - vol->first_data_block], (size_t) count * sizeof(uint32_t));
+  pthread_mutex_unlock(&vol->fs_lock);
+}
+
+
+#define IOV_BATCH 64 // extents moved per preadv or writev
+
+// readExtents for a file bigger than a pipe buffer when there is a block
+// cache. The pipe reads the file ahead while each buffer is copied into
+// the file's blocks and handed to the cache, so reading overlaps the
+// cache writing blocks back
+int readExtentsPiped(struct msf_volume* vol, int fd, int32_t inode, uint64_t size)
+{
+  struct ioPipe pipe;
+  if(pipeOpen(&pipe, fd, 0, size, PIPE_CHUNK) == -1)
+  {
+    return -1;
+  }
+
+  uint64_t offset = 0;
+  uint64_t within = 0; // bytes of extent k filled so far
+  uint32_t k = 0;
+
+  while(offset < size)
+  {
+    size_t len;
+    uint8_t* buf = pipeGet(&pipe, &len);
+    if(buf == NULL)
+    {
+      break;
+    }
+
+    // buffers and extents are both whole blocks until the end of the file
+    size_t used = 0;
+    while(used < len)
+    {
+      struct extent* ext = extentAt(vol, inode, k);
+      uint32_t first = ext->start + within / vol->block_size;
+      size_t n = (uint64_t) ext->length * vol->block_size - within;
+
+      if(n > len - used)
+      {
+        n = len - used;
+      }
+
+      memcpy(BLOCK(vol, first), buf + used, n);
+      cacheTouch(vol, first, (n + vol->block_size - 1) / vol->block_size);
+      computeChecksums(vol, first, (n + vol->block_size - 1) / vol->block_size);
+      markChecksums(vol, first, (n + vol->block_size - 1) / vol->block_size);
+      cacheWriteBack(vol, first, (n + vol->block_size - 1) / vol->block_size);
+
+      used += n;
+      within += n;
+      if(within == (uint64_t) ext->length * vol->block_size)
+      {
+        k++;
+        within = 0;
+      }
+    }
+
+    pipePut(&pipe, 0);
+    offset += len;
+  }
+
+  return pipeClose(&pipe) == -1 || offset < size ? -1 : 0;
+}
+
+
+// Read size bytes of fd straight into the reserved blocks of an inode.
+// Every extent is contiguous in data so it is a single iovec, and up to
+// IOV_BATCH extents come in with one preadv. Short reads just pick
+// up where they left off. Blocks go to the block cache as their batch
+// comes in, or through readExtentsPiped for a big file. Nothing outside
+// the file's own blocks is touched, so insert workers run this without
+// holding fs_lock
+int readExtents(struct msf_volume* vol, int fd, int32_t inode, uint64_t size)
+{
+  // Zero whatever is left of the last block so no stale data
+  // from an earlier file trails the end of this one. It is done
+  // first so the block is whole when the cache gets it
+  if(size % vol->block_size)
+  {
+    int32_t last = fileBlock(vol, inode, size / vol->block_size);
+    memset((BLOCK(vol, last) + size % vol->block_size), 0, vol->block_size - size % vol->block_size);
+  }
+
+  if(vol->cache_state != NULL && size > PIPE_CHUNK)
+  {
+    return readExtentsPiped(vol, fd, inode, size);
+  }
+
+  uint64_t offset = 0;
+  uint32_t k = 0;
+
+  while(offset < size)
+  {
+    struct iovec iov[IOV_BATCH];
+    uint32_t spans[IOV_BATCH];
+    int32_t starts[IOV_BATCH];
+    int count = 0;
+    uint64_t batch = 0;
+
+    for(; count < IOV_BATCH && offset + batch < size; k++)
+    {
+      struct extent* ext = extentAt(vol, inode, k);
+      uint64_t len = (uint64_t) ext->length * vol->block_size;
+
+      if(len > size - offset - batch)
+      {
+        len = size - offset - batch;
+      }
+
+      starts[count] = ext->start;
+      spans[count] = (len + vol->block_size - 1) / vol->block_size;
+      iov[count].iov_base = BLOCK(vol, ext->start);
+      iov[count].iov_len = len;
+      count++;
+
+      batch += len;
+    }
+
+    if(readFullv(fd, iov, count, offset) == -1)
+    {
+      return -1;
+    }
+
+    int i;
+    for(i = 0; i < count; i++)
+    {
+      cacheTouch(vol, starts[i], spans[i]);
+      computeChecksums(vol, starts[i], spans[i]);
+      markChecksums(vol, starts[i], spans[i]);
+      cacheWriteBack(vol, starts[i], spans[i]);
+    }
+
+    offset += batch;
+  }
+
+  return 0;
+}
+
+
+// Check count data blocks from start against their checksums, skipping
+// any checked since the image was opened. Returns -1 at the first one
+// whose contents do not match. Retrieve workers share verified_blocks,
+// so its bits are set atomically
+int verifyBlocks(struct msf_volume* vol, int32_t start, uint32_t count)
+{
+  uint32_t b;
+  for(b = start; b < (uint32_t) start + count; b++)
+  {
+    uint32_t w = b / BITS_PER_WORD;
+    uint64_t bit = 1ULL << (b % BITS_PER_WORD);
+
+    if(__atomic_load_n(&vol->verified_blocks[w], __ATOMIC_RELAXED) & bit)
+    {
+      continue;
+    }
+
+    if(crc32c(0, BLOCK(vol, b), vol->block_size) != vol->checksums[b - vol->first_data_block])
+    {
+      printf("ERROR: Block %u failed its checksum\n", b);
+      STAT_ADD(stats.checksum_errors, 1);
+      return -1;
+    }
+
+    __atomic_fetch_or(&vol->verified_blocks[w], bit, __ATOMIC_RELAXED);
+    STAT_ADD(stats.blocks_verified, 1);
+  }
+
+  return 0;
+}
+
+
+// Bytes of file data in cluster k of a compressed file of size bytes
+uint64_t clusterBytes(struct msf_volume* vol, uint64_t size, uint32_t k)
+{
+  uint64_t cluster_bytes = (uint64_t) CLUSTER_BLOCKS(vol) * vol->block_size;
+  uint64_t offset = (uint64_t) k * cluster_bytes;
+
+  return size - offset < cluster_bytes ? size - offset : cluster_bytes;
+}
+
+
+// Compress the len bytes of a cluster at raw into packed, behind its
+// uint32_t length. Returns the bytes to store, which are raw itself when
+// compressing would not save a whole block, and their length in *stored
+uint8_t* packCluster(struct msf_volume* vol, uint8_t* raw, size_t len, uint8_t* packed, size_t* stored)
+{
+  uint32_t span = (len + vol->block_size - 1) / vol->block_size;
+  size_t packed_len = 0;
+
+  // compressed, the cluster and its length have to fit in one block
+  // less than it takes raw
+  if(span > 1)
+  {
+    packed_len = lzCompress(raw, len, packed + sizeof(uint32_t),
+                            (size_t)(span - 1) * vol->block_size - sizeof(uint32_t));
+  }
+
+  STAT_ADD(stats.compress_in, len);
+
+  if(packed_len == 0)
+  {
+    STAT_ADD(stats.clusters_raw, 1);
+    STAT_ADD(stats.compress_out, len);
+    *stored = len;
+    return raw;
+  }
+
+  uint32_t header = packed_len;
+  memcpy(packed, &header, sizeof(header));
+
+  STAT_ADD(stats.compress_out, packed_len + sizeof(header));
+  *stored = packed_len + sizeof(header);
+  return packed;
+}
+
+
+// Read size bytes of fd into an inode a cluster at a time. Each cluster
+// is compressed and takes as few blocks as that needs, or is stored as it
+// is when compressing would not save a whole block. The blocks a cluster
+// needs are only known once it is compressed, so they are taken under
+// fs_lock one cluster at a time while reading and compressing run
+// without it, the next cluster read ahead through a pipe while this one
+// is compressed. Returns -1 on a read error or when space runs out
+int readClusters(struct msf_volume* vol, int fd, int32_t inode, uint64_t size)
+{
+  uint64_t cluster_bytes = (uint64_t) CLUSTER_BLOCKS(vol) * vol->block_size;
+  uint8_t* packed = (uint8_t*) malloc(cluster_bytes);
+  struct ioPipe pipe;
+  int failed = 0;
+
+  if(packed == NULL || pipeOpen(&pipe, fd, 0, size, cluster_bytes) == -1)
+  {
+    printf("ERROR: Not enough memory to compress the file\n");
+    free(packed);
+    return -1;
+  }
+
+  uint32_t k;
+  for(k = 0; !failed && (uint64_t) k * cluster_bytes < size; k++)
+  {
+    size_t len;
+    uint8_t* raw = pipeGet(&pipe, &len);
+
+    if(raw == NULL)
+    {
+      printf("ERROR: An error occured reading from the input file\n");
+      failed = 1;
+      break;
+    }
+
+    size_t src_len;
+    uint8_t* src = packCluster(vol, raw, len, packed, &src_len);
+    uint32_t blocks = (src_len + vol->block_size - 1) / vol->block_size;
+
+    pthread_mutex_lock(&vol->fs_lock);
+    int32_t start = findContiguousRun(vol, blocks);
+    if(start != -1 && appendExtent(vol, inode, k * CLUSTER_BLOCKS(vol), start, blocks) == -1)
+    {
+      releaseBlocks(vol, start, blocks);
+      start = -1;
+    }
+
+    if(start != -1)
+    {
+      markDirty(vol, start, blocks);
+    }
+    pthread_mutex_unlock(&vol->fs_lock);
+
+    if(start == -1)
+    {
+      printf("ERROR: Not enough contiguous free space for the file\n");
+      failed = 1;
+      break;
+    }
+
+    // the blocks are ours now, so filling them needs no lock
+    memcpy(BLOCK(vol, start), src, src_len);
+    memset(BLOCK(vol, start) + src_len, 0, (size_t) blocks * vol->block_size - src_len);
+
+    pipePut(&pipe, 0);
+
+    cacheTouch(vol, start, blocks);
+    computeChecksums(vol, start, blocks);
+    markChecksums(vol, start, blocks);
+    cacheWriteBack(vol, start, blocks);
+  }
+
+  pipeClose(&pipe);
+  free(packed);
+  return failed ? -1 : 0;
+}
+
+
+// Add data block block to the end of a file as its block number logical,
+// growing the last extent when the block follows straight on from it
+int appendFileBlock(struct msf_volume* vol, int32_t inode, uint32_t logical, int32_t block)
+{
+  uint32_t k = vol->inodes[inode].num_extents;
+
+  if(k > 0)
+  {
+    struct extent* ext = extentAt(vol, inode, k - 1);
+    if(ext->start + ext->length == block && ext->logical + ext->length == logical)
+    {
+      ext->length++;
+      markDirtyRange(vol, ext, sizeof(struct extent));
+      return 0;
+    }
+  }
+
+  return appendExtent(vol, inode, logical, block, 1);
+}
+
+
+#define DEDUP_BATCH 64 // blocks read and looked up at a time
+
+// Read size bytes of fd into an inode, storing each block only if no
+// data block already holds the same bytes. A batch of blocks is read
+// and fingerprinted without fs_lock, then placed under it, new blocks
+// copied in before they are indexed so nobody matches a half written
+// one. The next batch is read ahead through a pipe meanwhile. Returns
+// -1 on a read error or when space runs out
+int readDeduped(struct msf_volume* vol, int fd, int32_t inode, uint64_t size)
+{
+  struct ioPipe pipe;
+  uint32_t crcs[DEDUP_BATCH];
+  int32_t stored[DEDUP_BATCH]; // blocks this batch wrote, for the cache
+  uint32_t logical = 0;
+  int failed = 0;
+
+  if(pipeOpen(&pipe, fd, 0, size, (size_t) DEDUP_BATCH * vol->block_size) == -1)
+  {
+    printf("ERROR: Not enough memory to read the file\n");
+    return -1;
+  }
+
+  uint64_t offset;
+  for(offset = 0; offset < size && !failed; offset += (uint64_t) DEDUP_BATCH * vol->block_size)
+  {
+    size_t len;
+    uint8_t* buf = pipeGet(&pipe, &len);
+    if(buf == NULL)
+    {
+      printf("ERROR: An error occured reading from the input file\n");
+      failed = 1;
+      break;
+    }
+
+    // the last block is compared and stored with a zeroed tail
+    uint32_t count = (len + vol->block_size - 1) / vol->block_size;
+    memset(buf + len, 0, (size_t) count * vol->block_size - len);
+
+    uint32_t i;
+    for(i = 0; i < count; i++)
+    {
+      crcs[i] = crc32c(0, buf + (size_t) i * vol->block_size, vol->block_size);
+    }
+
+    uint32_t num_stored = 0;
+
+    pthread_mutex_lock(&vol->fs_lock);
+    for(i = 0; i < count && !failed; i++)
+    {
+      uint8_t* bytes = buf + (size_t) i * vol->block_size;
+      int32_t block = findFingerprint(vol, crcs[i], bytes);
+
+      if(block != -1)
+      {
+        vol->refcounts[block - vol->first_data_block]++;
+        markDirtyRange(vol, &vol->refcounts[block - vol->first_data_block], sizeof(uint16_t));
+        vol->used_count->shared++;
+        markDirtyRange(vol, vol->used_count, sizeof(struct usedCount));
+      }
+      else
+      {
+        block = findFreeBlock(vol);
+        if(block == -1)
+        {
+          printf("ERROR: Not enough free disk space\n");
+          failed = 1;
+          break;
+        }
+
+        memcpy(BLOCK(vol, block), bytes, vol->block_size);
+        markDirty(vol, block, 1);
+        vol->checksums[block - vol->first_data_block] = crcs[i];
+        markDirtyRange(vol, &vol->checksums[block - vol->first_data_block], sizeof(uint32_t));
+        addFingerprint(vol, crcs[i], block);
+        stored[num_stored++] = block;
+      }
+
+      if(appendFileBlock(vol, inode, logical, block) == -1)
+      {
+        printf("ERROR: Not enough free disk space\n");
+        releaseBlocks(vol, block, 1);
+        failed = 1;
+        break;
+      }
+
+      logical++;
+    }
+    pthread_mutex_unlock(&vol->fs_lock);
+
+    // new blocks mostly come out of the allocator one after another
+    uint32_t run;
+    for(i = 0; i < num_stored; i += run)
+    {
+      for(run = 1; i + run < num_stored && stored[i + run] == stored[i] + (int32_t) run; run++)
+      {
+      }
+      cacheWriteBack(vol, stored[i], run);
+    }
+
+    pipePut(&pipe, 0);
+  }
+
+  pipeClose(&pipe);
+  return failed ? -1 : 0;
+}
+
+
+// The cluster a thread expanded last, kept for its next clusterSpan
+// call. Each thread gets its own through cluster_key, whose destructor
+// frees it when the thread exits
+struct clusterBuffer
+{
+  uint8_t* bytes;
+  size_t size;
+  struct msf_volume* vol; // volume the cluster came from
+  int32_t start;          // data block the cluster came from, -1 for none
+  uint64_t generation;
+};
+
+pthread_key_t cluster_key;
+pthread_once_t cluster_key_once = PTHREAD_ONCE_INIT;
+
+void freeClusterBuffer(void* arg)
+{
+  struct clusterBuffer* buf = (struct clusterBuffer*) arg;
+  free(buf->bytes);
+  free(buf);
+}
+
+void makeClusterKey()
+{
+  pthread_key_create(&cluster_key, freeClusterBuffer);
+}
+
+// The calling thread's cluster buffer, big enough for a cluster of the
+// current block size. NULL when out of memory
+struct clusterBuffer* clusterBuffer(struct msf_volume* vol)
+{
+  pthread_once(&cluster_key_once, makeClusterKey);
+
+  struct clusterBuffer* buf = (struct clusterBuffer*) pthread_getspecific(cluster_key);
+  if(buf == NULL)
+  {
+    buf = (struct clusterBuffer*) calloc(1, sizeof(struct clusterBuffer));
+    if(buf == NULL || pthread_setspecific(cluster_key, buf) != 0)
+    {
+      free(buf);
+      return NULL;
+    }
+    buf->start = -1;
+  }
+
+  size_t size = (size_t) CLUSTER_BLOCKS(vol) * vol->block_size;
+  if(buf->size < size)
+  {
+    uint8_t* bytes = (uint8_t*) realloc(buf->bytes, size);
+    if(bytes == NULL)
+    {
+      return NULL;
+    }
+    buf->bytes = bytes;
+    buf->size = size;
+  }
+
+  return buf;
+}
+
+
+// Find the contiguous bytes of cluster k of a compressed file from
+// within bytes into it. A raw cluster is used where it is, and a
+// compressed one is expanded into the calling thread's cluster buffer,
+// which holds the last cluster it expanded. Returns 0 if the cluster is
+// corrupt or fails its checksums
+size_t clusterSpan(struct msf_volume* vol, int32_t inode, uint32_t k, uint64_t within, uint8_t** ptr)
+{
+  struct clusterBuffer* cache = clusterBuffer(vol);
+  if(cache == NULL)
+  {
+    return 0;
+  }
+
+  struct extent* ext = extentAt(vol, inode, k);
+  size_t len = clusterBytes(vol, vol->inodes[inode].file_size, k);
+  uint64_t generation = __atomic_load_n(&cluster_generation, __ATOMIC_RELAXED);
+  int cached = cache->vol == vol && cache->start == ext->start && cache->generation == generation;
+
+  cacheTouch(vol, ext->start, ext->length);
+
+  if(!cached && verifyBlocks(vol, ext->start, ext->length) == -1)
+  {
+    return 0;
+  }
+
+  if((uint32_t) ext->length == (len + vol->block_size - 1) / vol->block_size)
+  {
+    *ptr = BLOCK(vol, ext->start) + within;
+    return len - within;
+  }
+
+  if(!cached)
+  {
+    uint32_t packed_len;
+    memcpy(&packed_len, BLOCK(vol, ext->start), sizeof(packed_len));
+
+    cache->start = -1;
+    if(packed_len > (size_t) ext->length * vol->block_size - sizeof(packed_len) ||
+       lzDecompress(BLOCK(vol, ext->start) + sizeof(packed_len), packed_len, cache->bytes, len) == -1)
+    {
+      return 0;
+    }
+
+    cache->vol = vol;
+    cache->start = ext->start;
+    cache->generation = generation;
+  }
+
+  *ptr = cache->bytes + within;
+  return len - within;
+}
+
+
+#define VERIFY_SPAN 64 // most blocks fileSpan checks and hands out at once
+
+// Find the contiguous bytes of a file starting at byte offset. The
+// extent holding offset is found with a binary search, and the span
+// runs to the end of that extent since its blocks are adjacent in data.
+// Bytes kept in the inode run to the end of the file, and a compressed
+// file's span is the rest of its cluster.
+// Stores a pointer to the bytes in *ptr and returns how many there are,
+// 0 past the last extent or for blocks that fail their checksums
+size_t fileSpan(struct msf_volume* vol, int32_t inode, uint64_t offset, uint8_t** ptr)
+{
+  if(vol->inodes[inode].flags & (INODE_INLINE | INODE_TAIL))
+  {
+    uint64_t start;
+    uint8_t* bytes = inodeData(vol, inode, &start);
+
+    if(offset >= start)
+    {
+      if(offset >= vol->inodes[inode].file_size)
+      {
+        return 0;
+      }
+
+      *ptr = bytes + (offset - start);
+      return vol->inodes[inode].file_size - offset;
+    }
+  }
+
+  if(vol->inodes[inode].flags & INODE_COMPRESSED)
+  {
+    uint64_t cluster_bytes = (uint64_t) CLUSTER_BLOCKS(vol) * vol->block_size;
+    if(offset >= vol->inodes[inode].file_size)
+    {
+      return 0;
+    }
+
+    return clusterSpan(vol, inode, offset / cluster_bytes, offset % cluster_bytes, ptr);
+  }
+
+  int32_t k = findExtent(vol, inode, offset / vol->block_size);
+  if(k == -1)
+  {
+    return 0;
+  }
+
+  struct extent* ext = extentAt(vol, inode, k);
+  uint64_t within = offset - (uint64_t) ext->logical * vol->block_size;
+
+  // only the blocks handed out are checked, so a short read of a long
+  // extent does not pay for checking all of it
+  uint32_t first = within / vol->block_size;
+  uint32_t count = ext->length - first;
+  if(count > VERIFY_SPAN)
+  {
+    count = VERIFY_SPAN;
+  }
+
+  if(verifyBlocks(vol, ext->start + first, count) == -1)
+  {
+    return 0;
+  }
+
+  cacheTouch(vol, ext->start + first, count);
+
+  *ptr = BLOCK(vol, ext->start) + within;
+  return (uint64_t)(first + count) * vol->block_size - within;
+}
+
+
+// Copy length bytes of a file starting at byte offset into buf, one
+// memcpy per extent the range touches. Returns the number of bytes
+// copied, which is short only if the range runs past the file
+size_t readFileRange(struct msf_volume* vol, int32_t inode, uint8_t* buf, uint64_t offset, size_t length)
+{
+  uint64_t file_size = vol->inodes[inode].file_size;
+  size_t copied = 0;
+
+  if(offset >= file_size)
+  {
+    return 0;
+  }
+
+  if(length > file_size - offset)
+  {
+    length = file_size - offset;
+  }
+
+  while(copied < length)
+  {
+    uint8_t* span;
+    size_t span_len = fileSpan(vol, inode, offset + copied, &span);
+    if(span_len == 0)
+    {
+      break;
+    }
+
+    if(span_len > length - copied)
+    {
+      span_len = length - copied;
+    }
+
+    memcpy(buf + copied, span, span_len);
+    copied += span_len;
+  }
+
+  return copied;
+}
+
+
+// Point count blocks of a file from logical at the data blocks from
+// block, splitting the extent that held them into up to three. They
+// all have to lie in that one extent. The extents after it move along
+// to make room. Returns -1, with the file as it was, when it can not
+// take the extra extents or the blocks to list them in
+int setFileBlocks(struct msf_volume* vol, int32_t inode, uint32_t logical, int32_t block, uint32_t count)
+{
+  int32_t k = findExtent(vol, inode, logical);
+  struct extent old = *extentAt(vol, inode, k);
+  uint32_t n = vol->inodes[inode].num_extents;
+
+  uint32_t before = logical - old.logical;
+  uint32_t after = old.logical + old.length - logical - count;
+  uint32_t extra = (before > 0) + (after > 0);
+
+  // a run carrying straight on from the extent before, as when one
+  // write after another moves a file's blocks, grows that extent
+  // instead of splitting this one
+  if(before == 0 && after > 0 && k > 0)
+  {
+    struct extent* prev = extentAt(vol, inode, k - 1);
+
+    if(prev->logical + prev->length == logical && prev->start + prev->length == block)
+    {
+      prev->length += count;
+      markDirtyRange(vol, prev, sizeof(struct extent));
+
+      struct extent* ext = extentAt(vol, inode, k);
+      *ext = (struct extent) { logical + count, old.start + (int32_t) count, (int32_t) after };
+      markDirtyRange(vol, ext, sizeof(struct extent));
+      return 0;
+    }
+  }
+
+  // two extent blocks are the most the extra extents could need
+  if(n + extra > MAX_EXTENTS(vol) || (extra > 0 && vol->used_count->blocks + 2 > vol->num_data_blocks))
+  {
+    return -1;
+  }
+
+  uint32_t i;
+  for(i = 0; i < extra; i++)
+  {
+    appendExtent(vol, inode, 0, 0, 0);
+  }
+
+  for(i = n; i-- > (uint32_t) k + 1; )
+  {
+    struct extent* ext = extentAt(vol, inode, i + extra);
+    *ext = *extentAt(vol, inode, i);
+    markDirtyRange(vol, ext, sizeof(struct extent));
+  }
+
+  struct extent pieces[3];
+  uint32_t num_pieces = 0;
+
+  if(before > 0)
+  {
+    pieces[num_pieces++] = (struct extent) { old.logical, old.start, (int32_t) before };
+  }
+
+  pieces[num_pieces++] = (struct extent) { logical, block, (int32_t) count };
+
+  if(after > 0)
+  {
+    pieces[num_pieces++] = (struct extent) { logical + count, old.start + (int32_t) (before + count), (int32_t) after };
+  }
+
+  for(i = 0; i < num_pieces; i++)
+  {
+    struct extent* ext = extentAt(vol, inode, k + i);
+    *ext = pieces[i];
+    markDirtyRange(vol, ext, sizeof(struct extent));
+  }
+
+  return 0;
+}
+
+
+// Add count zeroed blocks to the end of a file that has have blocks,
+// in as few runs as the allocator can give, growing the last extent
+// when a run follows straight on from it. Returns -1, with the file as
+// it was, when there is no room
+int growFile(struct msf_volume* vol, int32_t inode, uint32_t have, uint32_t count)
+{
+  uint32_t n = vol->inodes[inode].num_extents;
+  int32_t last_length = n > 0 ? extentAt(vol, inode, n - 1)->length : 0;
+  uint32_t logical = have;
+
+  while(count > 0)
+  {
+    int32_t length;
+    int32_t start = findFreeRun(vol, count, &length);
+    if(start == -1)
+    {
+      break;
+    }
+
+    markDirty(vol, start, length);
+    memset(BLOCK(vol, start), 0, (size_t) length * vol->block_size);
+    cacheTouch(vol, start, length);
+    checksumBlocks(vol, start, length);
+
+    uint32_t k = vol->inodes[inode].num_extents;
+    struct extent* ext = k > 0 ? extentAt(vol, inode, k - 1) : NULL;
+
+    if(ext != NULL && ext->start + ext->length == start && ext->logical + ext->length == logical)
+    {
+      ext->length += length;
+      markDirtyRange(vol, ext, sizeof(struct extent));
+    }
+    else if(appendExtent(vol, inode, logical, start, length) == -1)
+    {
+      releaseBlocks(vol, start, length);
+      break;
+    }
+
+    logical += length;
+    count -= length;
+  }
+
+  if(count == 0)
+  {
+    return 0;
+  }
+
+  // give back what was added, in the last old extent and after it
+  dropExtents(vol, inode, n);
+  if(n > 0)
+  {
+    struct extent* ext = extentAt(vol, inode, n - 1);
+    releaseBlocks(vol, ext->start + last_length, ext->length - last_length);
+    ext->length = last_length;
+    markDirtyRange(vol, ext, sizeof(struct extent));
+  }
+
+  return -1;
+}
+
+
+// Store the block_size bytes at buf, whose CRC32C is crc, over a data
+// block no other file shares, keeping the fingerprint index in step
+void rewriteBlock(struct msf_volume* vol, int32_t block, const uint8_t* buf, uint32_t crc)
+{
+  removeFingerprint(vol, block);
+  markDirty(vol, block, 1);
+  memcpy(BLOCK(vol, block), buf, vol->block_size);
+  vol->checksums[block - vol->first_data_block] = crc;
+  markDirtyRange(vol, &vol->checksums[block - vol->first_data_block], sizeof(uint32_t));
+  addFingerprint(vol, crc, block);
+}
+
+
+// Move count blocks of a file from first, those the image file still
+// has in use, to blocks of their own so they can be changed where they
+// are. A crash before the next savefs then finds the old bytes wherever
+// the old metadata points. The old blocks go back to the free map but
+// are not handed out again before that savefs. Blocks there is no room
+// to move stay put and commitJournal logs them instead
+void copyOnWrite(struct msf_volume* vol, int32_t inode, uint32_t first, uint32_t count)
+{
+  uint32_t b = first;
+
+  while(b < first + count)
+  {
+    struct extent* ext = extentAt(vol, inode, findExtent(vol, inode, b));
+    int32_t old = ext->start + (b - ext->logical);
+    uint32_t limit = ext->logical + ext->length - b;
+    if(limit > first + count - b)
+    {
+      limit = first + count - b;
+    }
+
+    uint32_t run = 0;
+    while(run < limit && blockCommitted(vol, old + run))
+    {
+      run++;
+    }
+
+    if(run == 0)
+    {
+      b++;
+      continue;
+    }
+
+    int32_t length;
+    int32_t start = findFreeRun(vol, run, &length);
+    if(start == -1)
+    {
+      return;
+    }
+
+    if(setFileBlocks(vol, inode, b, start, length) == -1)
+    {
+      releaseBlocks(vol, start, length);
+      return;
+    }
+
+    markDirty(vol, start, length);
+    memcpy(BLOCK(vol, start), BLOCK(vol, old), (size_t) length * vol->block_size);
+    cacheTouch(vol, start, length);
+    memcpy(&vol->checksums[start - vol->first_data_block], &vol->checksums[old - vol->first_data_block],
+           (size_t) length * sizeof(uint32_t));
+    markDirtyRange(vol, &vol->checksums[start - vol->first_data_block], (size_t) length * sizeof(uint32_t));
+    releaseBlocks(vol, old, length);
+
+    b += length;
+  }
+}
+
+
+// Write len bytes at offset into a file kept in plain data blocks,
+// growing it first when they end past its last block. Only the blocks
+// the bytes land in, and any gap before them, are touched, and those the
+// image file holds are copied first, see copyOnWrite. With dedup a
+// changed block is shared with one already holding its new bytes if
+// there is one, changed where it is if no other file uses it and the
+// image file does not hold it, and copied to a block of its own
+// otherwise
+int writeFileBlocks(struct msf_volume* vol, int32_t inode, const uint8_t* buf, uint64_t offset, size_t len)
+{
+  struct inode* node = &vol->inodes[inode];
+  uint64_t end = offset + len;
+
+  // a packed tail is not a block, and this write does not reach it
+  uint32_t have = node->flags & INODE_TAIL ? node->file_size / vol->block_size :
+                  (node->file_size + vol->block_size - 1) / vol->block_size;
+  uint32_t first = offset / vol->block_size;
+  uint32_t last = (end - 1) / vol->block_size;
+
+  // a block only partly written keeps the rest of its bytes, so they
+  // had better be right
+  if((first < have && offset % vol->block_size && verifyBlocks(vol, fileBlock(vol, inode, first), 1) == -1) ||
+     (last < have && end % vol->block_size && verifyBlocks(vol, fileBlock(vol, inode, last), 1) == -1))
+  {
+    return MSF_EIO;
+  }
+
+  uint32_t old_tail = node->flags & INODE_TAIL ? 0 : node->file_size % vol->block_size;
+
+  if(vol->refcounts == NULL)
+  {
+    // the old blocks this changes move first if the image file holds them
+    if(end > node->file_size && old_tail > 0)
+    {
+      copyOnWrite(vol, inode, have - 1, 1);
+    }
+    if(first < have)
+    {
+      copyOnWrite(vol, inode, first, (last < have ? last + 1 : have) - first);
+    }
+
+    // whatever lies past the old end in its block is not file data, and
+    // has to read back as zeros once the file grows over it
+    if(end > node->file_size && old_tail > 0)
+    {
+      int32_t block = fileBlock(vol, inode, have - 1);
+      markDirty(vol, block, 1);
+      memset(BLOCK(vol, block) + old_tail, 0, vol->block_size - old_tail);
+      checksumBlocks(vol, block, 1);
+    }
+
+    if(last >= have && growFile(vol, inode, have, last + 1 - have) == -1)
+    {
+      return MSF_ENOSPC;
+    }
+
+    uint32_t b;
+    for(b = first; b <= last; b++)
+    {
+      uint64_t block_start = (uint64_t) b * vol->block_size;
+      size_t from = offset > block_start ? offset - block_start : 0;
+      size_t to = end - block_start < vol->block_size ? end - block_start : vol->block_size;
+      int32_t block = fileBlock(vol, inode, b);
+
+      markDirty(vol, block, 1);
+      memcpy(BLOCK(vol, block) + from, buf + (block_start + from - offset), to - from);
+      checksumBlocks(vol, block, 1);
+    }
+
+    if(end > node->file_size)
+    {
+      node->file_size = end;
+      markDirtyRange(vol, node, sizeof(struct inode));
+    }
+
+    return MSF_OK;
+  }
+
+  uint8_t* scratch = (uint8_t*) malloc(vol->block_size);
+  if(scratch == NULL)
+  {
+    return MSF_ENOMEM;
+  }
+
+  // growing over the old last block zeroes what lies past the old end
+  uint32_t from_block = end > node->file_size && old_tail > 0 ? have - 1 : have;
+
+  int status = MSF_OK;
+  uint32_t b;
+  for(b = first < from_block ? first : from_block; b <= last; b++)
+  {
+    uint64_t block_start = (uint64_t) b * vol->block_size;
+    int32_t old = b < have ? fileBlock(vol, inode, b) : -1;
+
+    memset(scratch, 0, vol->block_size);
+    if(old != -1)
+    {
+      memcpy(scratch, BLOCK(vol, old), b + 1 == have && old_tail > 0 ? old_tail : vol->block_size);
+    }
+
+    // blocks of the gap before offset stay zero
+    if(b >= first)
+    {
+      size_t from = offset > block_start ? offset - block_start : 0;
+      size_t to = end - block_start < vol->block_size ? end - block_start : vol->block_size;
+      memcpy(scratch + from, buf + (block_start + from - offset), to - from);
+    }
+
+    uint32_t crc = crc32c(0, scratch, vol->block_size);
+    int32_t block = findFingerprint(vol, crc, scratch);
+
+    if(block != -1 && block == old)
+    {
+      continue;
+    }
+
+    // nobody else sees the old block, so it may change where it is.
+    // It is still copied when the image file holds it and there is room
+    int own = old != -1 && vol->refcounts[old - vol->first_data_block] == 1;
+
+    if(block != -1)
+    {
+      vol->refcounts[block - vol->first_data_block]++;
+      markDirtyRange(vol, &vol->refcounts[block - vol->first_data_block], sizeof(uint16_t));
+      vol->used_count->shared++;
+      markDirtyRange(vol, vol->used_count, sizeof(struct usedCount));
+    }
+    else if(own && !blockCommitted(vol, old))
+    {
+      rewriteBlock(vol, old, scratch, crc);
+      continue;
+    }
+    else
+    {
+      block = findFreeBlock(vol);
+      if(block == -1 && own)
+      {
+        rewriteBlock(vol, old, scratch, crc);
+        continue;
+      }
+      if(block == -1)
+      {
+        status = MSF_ENOSPC;
+        break;
+      }
+
+      markDirty(vol, block, 1);
+      memcpy(BLOCK(vol, block), scratch, vol->block_size);
+      cacheTouch(vol, block, 1);
+      vol->checksums[block - vol->first_data_block] = crc;
+      markDirtyRange(vol, &vol->checksums[block - vol->first_data_block], sizeof(uint32_t));
+      addFingerprint(vol, crc, block);
+    }
+
+    if((old != -1 ? setFileBlocks(vol, inode, b, block, 1) : appendFileBlock(vol, inode, b, block)) == -1)
+    {
+      releaseBlocks(vol, block, 1);
+      if(own)
+      {
+        rewriteBlock(vol, old, scratch, crc);
+        continue;
+      }
+      status = MSF_ENOSPC;
+      break;
+    }
+
+    if(old != -1)
+    {
+      releaseBlocks(vol, old, 1);
+    }
+  }
+
+  free(scratch);
+
+  // on a failure the file keeps the blocks it gained before it
+  uint64_t size = status == MSF_OK ? end : (uint64_t) b * vol->block_size;
+  if(size > end)
+  {
+    size = end;
+  }
+
+  if(size > node->file_size)
+  {
+    node->file_size = size;
+    markDirtyRange(vol, node, sizeof(struct inode));
+  }
+
+  return status;
+}
+
+
+// Compress the len bytes of cluster k of a compressed file at raw, with
+// packed as room to do it in, and store them in new blocks. They take
+// the place of the cluster's old blocks if it has any, otherwise they
+// are added to the end of the file. Returns an msf_error
+int storeCluster(struct msf_volume* vol, int32_t inode, uint32_t k, uint8_t* raw, size_t len, uint8_t* packed)
+{
+  size_t stored;
+  uint8_t* src = packCluster(vol, raw, len, packed, &stored);
+  uint32_t blocks = (stored + vol->block_size - 1) / vol->block_size;
+  int replacing = k < vol->inodes[inode].num_extents;
+
+  int32_t start = findContiguousRun(vol, blocks);
+  if(start == -1)
+  {
+    return MSF_ENOSPC;
+  }
+
+  if(!replacing && appendExtent(vol, inode, k * CLUSTER_BLOCKS(vol), start, blocks) == -1)
+  {
+    releaseBlocks(vol, start, blocks);
+    return MSF_ENOSPC;
+  }
+
+  markDirty(vol, start, blocks);
+  memcpy(BLOCK(vol, start), src, stored);
+  memset(BLOCK(vol, start) + stored, 0, (size_t) blocks * vol->block_size - stored);
+  cacheTouch(vol, start, blocks);
+  checksumBlocks(vol, start, blocks);
+
+  if(replacing)
+  {
+    struct extent* ext = extentAt(vol, inode, k);
+    releaseBlocks(vol, ext->start, ext->length);
+    ext->start = start;
+    ext->length = blocks;
+    markDirtyRange(vol, ext, sizeof(struct extent));
+
+    // a thread may have the old cluster expanded
+    STAT_ADD(cluster_generation, 1);
+  }
+
+  return MSF_OK;
+}
+
+
+// Write len bytes at offset into a compressed file. Every cluster they
+// land in is expanded, changed, compressed again and stored in new
+// blocks in place of its old ones. Growing the file lengthens its old
+// last cluster, so that is stored again too, as is any gap after it
+int writeClusters(struct msf_volume* vol, int32_t inode, const uint8_t* buf, uint64_t offset, size_t len)
+{
+  struct inode* node = &vol->inodes[inode];
+  uint64_t cluster_bytes = (uint64_t) CLUSTER_BLOCKS(vol) * vol->block_size;
+  uint64_t size = node->file_size;
+  uint64_t end = offset + len;
+  uint64_t new_size = end > size ? end : size;
+  uint32_t have = node->num_extents;
+  uint32_t first = offset / cluster_bytes;
+  uint32_t last = (end - 1) / cluster_bytes;
+
+  if(first > size / cluster_bytes)
+  {
+    first = size / cluster_bytes;
+  }
+
+  uint8_t* raw = (uint8_t*) malloc(cluster_bytes);
+  uint8_t* packed = (uint8_t*) malloc(cluster_bytes);
+  int status = MSF_OK;
+
+  if(raw == NULL || packed == NULL)
+  {
+    free(raw);
+    free(packed);
+    return MSF_ENOMEM;
+  }
+
+  uint32_t k;
+  for(k = first; k <= last; k++)
+  {
+    uint64_t base = (uint64_t) k * cluster_bytes;
+    size_t old_len = k < have ? clusterBytes(vol, size, k) : 0;
+    size_t new_len = clusterBytes(vol, new_size, k);
+
+    if(old_len > 0)
+    {
+      uint8_t* span;
+      if(clusterSpan(vol, inode, k, 0, &span) != old_len)
+      {
+        status = MSF_EIO;
+        break;
+      }
+
+      memcpy(raw, span, old_len);
+    }
+
+    memset(raw + old_len, 0, new_len - old_len);
+
+    if(end > base && offset < base + new_len)
+    {
+      size_t from = offset > base ? offset - base : 0;
+      size_t to = end - base < new_len ? end - base : new_len;
+      memcpy(raw + from, buf + (base + from - offset), to - from);
+    }
+
+    status = storeCluster(vol, inode, k, raw, new_len, packed);
+    if(status != MSF_OK)
+    {
+      break;
+    }
+  }
+
+  free(raw);
+  free(packed);
+
+  // on a failure the clusters stored before it are whole
+  uint64_t done = (uint64_t) k * cluster_bytes;
+  node->file_size = status == MSF_OK ? new_size : (done > size ? done : size);
+  markDirtyRange(vol, node, sizeof(struct inode));
+
+  return status;
+}
+
+
+int writeFileRange(struct msf_volume* vol, int32_t inode, const uint8_t* buf, uint64_t offset, size_t len);
+
+// Move the bytes a file keeps in its inode out to data blocks, so it can
+// be written like any other file. An inline file becomes a compressed
+// one when the image compresses files. Returns an msf_error, with the
+// file as it was on a failure
+int unpackInode(struct msf_volume* vol, int32_t inode)
+{
+  struct inode* node = &vol->inodes[inode];
+  struct inode saved = *node;
+  uint8_t held[INLINE_MAX];
+  uint64_t start;
+  uint8_t* bytes = inodeData(vol, inode, &start);
+  size_t count = node->file_size - start;
+
+  memcpy(held, bytes, count);
+
+  if(node->flags & INODE_INLINE)
+  {
+    memset(node->extents, 0, sizeof(node->extents));
+    node->flags = vol->superblock->features & FEATURE_COMPRESS ? INODE_COMPRESSED : 0;
+  }
+  else
+  {
+    node->flags &= ~INODE_TAIL;
+  }
+
+  memset(node->tail, 0, sizeof(node->tail));
+  node->file_size = start;
+  markDirtyRange(vol, node, sizeof(struct inode));
+
+  // what fits in an inode fits in one block or cluster, so a failed
+  // write has not kept any of it
+  int status = count > 0 ? writeFileRange(vol, inode, held, start, count) : MSF_OK;
+  if(status != MSF_OK)
+  {
+    *node = saved;
+  }
+
+  return status;
+}
+
+
+// Write len bytes from buf into a file at offset, growing it when they
+// end past its end. A gap between the old end and offset reads back as
+// zeros. The caller holds fs_lock. Returns an msf_error, the file
+// holding none or the first part of the bytes on a failure
+int writeFileRange(struct msf_volume* vol, int32_t inode, const uint8_t* buf, uint64_t offset, size_t len)
+{
+  struct inode* node = &vol->inodes[inode];
+  uint64_t end = offset + len;
+
+  if(len == 0)
+  {
+    return MSF_OK;
+  }
+
+  if(end < offset || end > (uint64_t) vol->num_data_blocks * vol->block_size)
+  {
+    return MSF_EFBIG;
+  }
+
+  // a file that still fits stays in its inode
+  if((node->flags & INODE_INLINE) && end <= INLINE_MAX)
+  {
+    uint8_t* bytes = (uint8_t*) node->extents;
+
+    if(offset > node->file_size)
+    {
+      memset(bytes + node->file_size, 0, offset - node->file_size);
+    }
+
+    memcpy(bytes + offset, buf, len);
+    if(end > node->file_size)
+    {
+      node->file_size = end;
+    }
+
+    markDirtyRange(vol, node, sizeof(struct inode));
+    return MSF_OK;
+  }
+
+  if((node->flags & INODE_INLINE) ||
+     ((node->flags & INODE_TAIL) && end > node->file_size - node->file_size % vol->block_size))
+  {
+    int status = unpackInode(vol, inode);
+    if(status != MSF_OK)
+    {
+      return status;
+    }
+  }
+
+  if(node->flags & INODE_COMPRESSED)
+  {
+    return writeClusters(vol, inode, buf, offset, len);
+  }
+
+  return writeFileBlocks(vol, inode, buf, offset, len);
+}
+
+
+// Cut a file down to size bytes. Only its last kept block or cluster is
+// looked at, and everything after it goes back to the free block map
+// in time proportional to what is let go of. The caller holds fs_lock
+int shrinkFile(struct msf_volume* vol, int32_t inode, uint64_t size)
+{
+  struct inode* node = &vol->inodes[inode];
+
+  if(node->flags & INODE_INLINE)
+  {
+    memset((uint8_t*) node->extents + size, 0, node->file_size - size);
+  }
+  else if(node->flags & INODE_COMPRESSED)
+  {
+    uint64_t cluster_bytes = (uint64_t) CLUSTER_BLOCKS(vol) * vol->block_size;
+    uint32_t keep = (size + cluster_bytes - 1) / cluster_bytes;
+
+    // a cluster expands to exactly its length, so a shorter last
+    // cluster has to be stored again
+    if(keep > 0 && clusterBytes(vol, size, keep - 1) != clusterBytes(vol, node->file_size, keep - 1))
+    {
+      size_t len = clusterBytes(vol, size, keep - 1);
+      uint8_t* raw = (uint8_t*) malloc(cluster_bytes);
+      uint8_t* packed = (uint8_t*) malloc(cluster_bytes);
+      uint8_t* span;
+      int status = MSF_ENOMEM;
+
+      if(raw != NULL && packed != NULL)
+      {
+        status = clusterSpan(vol, inode, keep - 1, 0, &span) == 0 ? MSF_EIO : MSF_OK;
+      }
+
+      if(status == MSF_OK)
+      {
+        memcpy(raw, span, len);
+        status = storeCluster(vol, inode, keep - 1, raw, len, packed);
+      }
+
+      free(raw);
+      free(packed);
+      if(status != MSF_OK)
+      {
+        return status;
+      }
+    }
+
+    dropExtents(vol, inode, keep);
+  }
+  else
+  {
+    uint64_t tail_start = node->file_size - node->file_size % vol->block_size;
+
+    if(node->flags & INODE_TAIL)
+    {
+      if(size > tail_start)
+      {
+        memset(node->tail + (size - tail_start), 0, node->file_size - size);
+        node->file_size = size;
+        markDirtyRange(vol, node, sizeof(struct inode));
+        return MSF_OK;
+      }
+
+      memset(node->tail, 0, sizeof(node->tail));
+      node->flags &= ~INODE_TAIL;
+    }
+
+    // the bytes past size in the last kept block are left as they are,
+    // a write that grows the file over them zeroes them first
+    uint32_t keep = (size + vol->block_size - 1) / vol->block_size;
+    int32_t k = keep > 0 ? findExtent(vol, inode, keep - 1) : -1;
+
+    if(k != -1)
+    {
+      struct extent* ext = extentAt(vol, inode, k);
+      int32_t cut = ext->logical + ext->length - keep;
+
+      if(cut > 0)
+      {
+        releaseBlocks(vol, ext->start + ext->length - cut, cut);
+        ext->length -= cut;
+        markDirtyRange(vol, ext, sizeof(struct extent));
+      }
+    }
+
+    dropExtents(vol, inode, k + 1);
+  }
+
+  node->file_size = size;
+  markDirtyRange(vol, node, sizeof(struct inode));
+  return MSF_OK;
+}
+
+
+// Make a file size bytes long, cutting it short or growing it with
+// zeros. The caller holds fs_lock. Returns an msf_error
+int truncateFile(struct msf_volume* vol, int32_t inode, uint64_t size)
+{
+  struct inode* node = &vol->inodes[inode];
+
+  if(size <= node->file_size)
+  {
+    return size == node->file_size ? MSF_OK : shrinkFile(vol, inode, size);
+  }
+
+  if(size > (uint64_t) vol->num_data_blocks * vol->block_size)
+  {
+    return MSF_EFBIG;
+  }
+
+  size_t chunk = size - node->file_size < PIPE_CHUNK ? size - node->file_size : PIPE_CHUNK;
+  uint8_t* zeros = (uint8_t*) calloc(1, chunk);
+  if(zeros == NULL)
+  {
+    return MSF_ENOMEM;
+  }
+
+  int status = MSF_OK;
+  while(status == MSF_OK && node->file_size < size)
+  {
+    uint64_t len = size - node->file_size < chunk ? size - node->file_size : chunk;
+    status = writeFileRange(vol, inode, zeros, node->file_size, len);
+  }
+
+  free(zeros);
+  return status;
+}
+
+
+// FNV-1a hash of a filename
+uint32_t hashFilename(const char* filename, uint32_t len)
+{
+  uint32_t hash = 2166136261u;
+  uint32_t i;
+  for(i = 0; i < len; i++)
+  {
+    hash ^= (uint8_t) filename[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+
+// Look a filename up in the directory index. Probes linearly from the
+// hash slot and only compares names whose hash and length match.
+// Returns the directory entry number or -1 if the file does not exist
+int32_t findDirectoryEntry(struct msf_volume* vol, const char* filename)
+{
+  if(filename == NULL)
+  {
+    return -1;
+  }
+
+  uint32_t len = strlen(filename);
+  uint32_t hash = hashFilename(filename, len);
+  uint32_t slot = hash % vol->dir_index_slots;
+
+  STAT_ADD(stats.dir_lookups, 1);
+
+  int i;
+  for(i = 0; i < vol->dir_index_slots && vol->dir_index[slot] != DIR_SLOT_EMPTY; i++)
+  {
+    int32_t entry = vol->dir_index[slot] - 1;
+    STAT_ADD(stats.dir_probes, 1);
+
+    if(vol->dir_index[slot] != DIR_SLOT_DELETED &&
+       vol->directory[entry].hash == hash &&
+       vol->directory[entry].name_len == len &&
+       !memcmp(vol->directory[entry].filename, filename, len))
+    {
+      return entry;
+    }
+
+    slot = (slot + 1) % vol->dir_index_slots;
+  }
+
+  return -1;
+}
+
+
+// Add a directory entry, whose hash is already filled in, to the index.
+// It takes the first empty or deleted slot it probes, so deleted slots
+// are used again instead of piling up
+void addDirectoryIndex(struct msf_volume* vol, int32_t entry)
+{
+  uint32_t slot = vol->directory[entry].hash % vol->dir_index_slots;
+
+  while(vol->dir_index[slot] > 0)
+  {
+    slot = (slot + 1) % vol->dir_index_slots;
+  }
+
+  vol->dir_index[slot] = entry + 1;
+  markDirtyRange(vol, &vol->dir_index[slot], sizeof(int32_t));
+}
+
+
+// Claim the first clear bit of the used entry bitmap, -1 when the directory is full
+int32_t findFreeDirectoryEntry(struct msf_volume* vol)
+{
+  return findFreeBit(vol, vol->used_entries, NULL, vol->num_files, &vol->entry_hint);
+}
+
+
+// Take a directory entry out of the index, clear it and
+// clear its bit in the used entry bitmap. A slot only has to stay
+// marked deleted while later slots of a probe chain depend on it, so
+// when the slot after it is empty it goes back to empty, along with
+// the deleted slots just before it
+void releaseDirectoryEntry(struct msf_volume* vol, int32_t entry)
+{
+  uint32_t slot = vol->directory[entry].hash % vol->dir_index_slots;
+
+  int i;
+  for(i = 0; i < vol->dir_index_slots && vol->dir_index[slot] != DIR_SLOT_EMPTY; i++)
+  {
+    if(vol->dir_index[slot] == entry + 1)
+    {
+      vol->dir_index[slot] = DIR_SLOT_DELETED;
+      markDirtyRange(vol, &vol->dir_index[slot], sizeof(int32_t));
+
+      while(vol->dir_index[(slot + 1) % vol->dir_index_slots] == DIR_SLOT_EMPTY &&
+            vol->dir_index[slot] == DIR_SLOT_DELETED)
+      {
+        vol->dir_index[slot] = DIR_SLOT_EMPTY;
+        markDirtyRange(vol, &vol->dir_index[slot], sizeof(int32_t));
+        slot = (slot + vol->dir_index_slots - 1) % vol->dir_index_slots;
+      }
+      break;
+    }
+
+    slot = (slot + 1) % vol->dir_index_slots;
+  }
+
+  memset(&vol->directory[entry], 0, sizeof(struct directoryEntry));
+  markDirtyRange(vol, &vol->directory[entry], sizeof(struct directoryEntry));
+
+  vol->used_entries[entry / BITS_PER_WORD] &= ~(1ULL << (entry % BITS_PER_WORD));
+  markDirtyRange(vol, &vol->used_entries[entry / BITS_PER_WORD], sizeof(uint64_t));
+}
+
+
+// Delete the file in directory entry entry, giving back its blocks, its
+// inode and the entry. Takes time in the number of extents and blocks
+// the file has. The caller holds fs_lock
+void removeFile(struct msf_volume* vol, int32_t entry)
+{
+  int32_t inode = vol->directory[entry].inode;
+
+  releaseExtents(vol, inode);
+
+  vol->inodes[inode].in_use = 0;
+  vol->inodes[inode].file_size = 0;
+  markDirtyRange(vol, &vol->inodes[inode], sizeof(struct inode));
+  releaseInode(vol, inode);
+  vol->generations[inode]++;
+
+  releaseDirectoryEntry(vol, entry);
+}
+
+
+// Point directory, inodes and the free maps at the metadata
+// blocks of whatever data currently refers to
+void mapMetadata(struct msf_volume* vol)
+{
+  // nothing to point at until an image is created or opened
+  if(vol->data == NULL)
+  {
+    return;
+  }
+
+  vol->superblock = (struct superBlock*) vol->data;
+
+  // directory pointer will point to the beginning of our directory,
+  // right after the superblock
+  vol->directory = (struct directoryEntry*) BLOCK(vol, vol->directory_block);
+
+
+  // inodes will point to beginning of our inodes treated
+  // as inode structs, num_files + 1 of them with slot 0 unused
+  vol->inodes = (struct inode*) BLOCK(vol, vol->inode_block);
+  
+
+  // one bit for every block of file data
+  vol->used_blocks = (uint64_t*) BLOCK(vol, vol->block_map_block);
+
+
+  // a bit per inode to represent used or not, with the used
+  // counts and the directory entry map stored right after it
+  vol->used_inodes = (uint64_t*) BLOCK(vol, vol->inode_map_block);
+  vol->used_count = (struct usedCount*) &vol->used_inodes[WORDS_FOR(vol->num_files)];
+  vol->used_entries = (uint64_t*) &vol->used_count[1];
+
+
+  // the directory index takes the blocks right after the block map
+  vol->dir_index = (int32_t*) BLOCK(vol, vol->dir_index_block);
+
+  vol->checksums = (uint32_t*) BLOCK(vol, vol->checksum_block);
+
+  // and the dedup tables follow the checksums when the image has them
+  vol->refcounts = vol->refcount_block ? (uint16_t*) BLOCK(vol, vol->refcount_block) : NULL;
+  vol->fingerprints = vol->fingerprint_block ? (struct fingerprint*) BLOCK(vol, vol->fingerprint_block) : NULL;
+
+  vol->journal = (struct journalHeader*) BLOCK(vol, vol->journal_block);
+
+  vol->block_hint = 0;
+  vol->inode_hint = 0;
+  vol->entry_hint = 0;
+}
+
+
+// Number of blocks of size bytes it takes to hold bytes bytes
+uint32_t blocksFor(size_t bytes, uint32_t size)
+{
+  return (bytes + size - 1) / size;
+}
+
+
+// Journal blocks of an image made before the journal was sized to fit
+// its metadata, and the least a journal is given now
+uint32_t legacyJournalBlocks(uint32_t size)
+{
+  uint32_t blocks = JOURNAL_BYTES / size;
+  return blocks < MIN_JOURNAL_BLOCKS ? MIN_JOURNAL_BLOCKS : blocks;
+}
+
+
+// Lay out an image of blocks blocks of size bytes holding up to files
+// files, as drawn above struct superBlock, and make it the current
+// geometry. Returns -1, changing nothing, when the block size is not
+// a power of two we support or the metadata leaves no room for data
+int setGeometry(struct msf_volume* vol, uint32_t size, uint32_t blocks, uint32_t files, uint32_t features, uint32_t journal_size)
+{
+  if(size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) ||
+     files == 0 || files > MAX_NUM_FILES)
+  {
+    return -1;
+  }
+
+  uint32_t dir_blocks = blocksFor((size_t) files * sizeof(struct directoryEntry), size);
+  uint32_t inode_map_blocks = blocksFor(2 * WORDS_FOR(files) * sizeof(uint64_t) + sizeof(struct usedCount), size);
+  uint32_t inode_table_blocks = blocksFor((size_t)(files + 1) * sizeof(struct inode), size);
+  uint32_t block_map_blocks = blocksFor(WORDS_FOR(blocks) * sizeof(uint64_t), size);
+  uint32_t index_blocks = blocksFor((size_t) 2 * files * sizeof(int32_t), size);
+  uint32_t checksum_blocks = blocksFor((size_t) blocks * sizeof(uint32_t), size);
+
+  uint32_t refcount_blocks = 0;
+  uint32_t fingerprint_blocks = 0;
+  if(features & FEATURE_DEDUP)
+  {
+    refcount_blocks = blocksFor((size_t) blocks * sizeof(uint16_t), size);
+    fingerprint_blocks = blocksFor((size_t) 2 * blocks * sizeof(struct fingerprint), size);
+  }
+
+  // half of a descriptor lists metadata blocks, the rest data runs
+  size_t desc_space = size - sizeof(struct journalDescriptor);
+  uint32_t max_meta = desc_space / 2 / sizeof(uint32_t);
+
+  if(journal_size == 0)
+  {
+    // Room after the header for one transaction holding every metadata
+    // block outside the journal, so a save never needs more than the log
+    uint64_t meta = 1 + (uint64_t) dir_blocks + inode_map_blocks + inode_table_blocks +
+                    block_map_blocks + index_blocks + checksum_blocks +
+                    refcount_blocks + fingerprint_blocks;
+    uint64_t fit = 1 + (meta + max_meta - 1) / max_meta + meta + 1;
+    journal_size = legacyJournalBlocks(size);
+    if(fit > journal_size)
+    {
+      journal_size = fit > blocks ? blocks : fit;
+    }
+  }
+  else if(journal_size < MIN_JOURNAL_BLOCKS)
+  {
+    return -1;
+  }
+
+  uint64_t next = 1;
+
+  uint32_t dir = next;
+  next += dir_blocks;
+
+  uint32_t inode_map = next;
+  next += inode_map_blocks;
+
+  uint32_t inode_table = next;
+  next += inode_table_blocks;
+
+  uint32_t log = next;
+  next += journal_size;
+
+  uint32_t block_map = next;
+  next += block_map_blocks;
+
+  uint32_t index = next;
+  next += index_blocks;
+
+  uint32_t checksum_table = next;
+  next += checksum_blocks;
+
+  uint32_t refcount_table = 0;
+  uint32_t fingerprint_table = 0;
+  if(features & FEATURE_DEDUP)
+  {
+    refcount_table = next;
+    next += refcount_blocks;
+
+    fingerprint_table = next;
+    next += fingerprint_blocks;
+  }
+
+  if(next >= blocks)
+  {
+    return -1;
+  }
+
+  vol->block_size = size;
+  vol->num_blocks = blocks;
+  vol->num_files = files;
+
+  vol->directory_block = dir;
+  vol->inode_map_block = inode_map;
+  vol->inode_block = inode_table;
+  vol->journal_block = log;
+  vol->journal_blocks = journal_size;
+  vol->journal_log_blocks = journal_size - 1;
+  vol->block_map_block = block_map;
+  vol->dir_index_block = index;
+  vol->dir_index_slots = 2 * files;
+  vol->checksum_block = checksum_table;
+  vol->refcount_block = refcount_table;
+  vol->fingerprint_block = fingerprint_table;
+  vol->fingerprint_slots = 2 * blocks;
+  vol->first_data_block = next;
+  vol->num_data_blocks = blocks - next;
+  vol->image_size = (size_t) blocks * size;
+
+  vol->journal_max_meta = max_meta;
+  vol->journal_max_runs = (desc_space - vol->journal_max_meta * sizeof(uint32_t)) / sizeof(struct journalRun);
+
+  free(vol->dirty_blocks);
+  free(vol->punch_blocks);
+  free(vol->committed_blocks);
+  free(vol->verified_blocks);
+  free(vol->generations);
+  vol->dirty_words = WORDS_FOR(blocks);
+  vol->dirty_blocks = (uint64_t*) calloc(vol->dirty_words, sizeof(uint64_t));
+  vol->punch_blocks = (uint64_t*) calloc(vol->dirty_words, sizeof(uint64_t));
+  vol->committed_blocks = (uint64_t*) calloc(vol->dirty_words, sizeof(uint64_t));
+  vol->verified_blocks = (uint64_t*) calloc(vol->dirty_words, sizeof(uint64_t));
+  vol->generations = (uint32_t*) calloc(files + 1, sizeof(uint32_t));
+
+  return 0;
+}
+
+
+// Read the superblock of an image file into sb. Returns -1 if the
+// file does not start with one, or needs features we do not know
+int readSuperblock(int fd, struct superBlock* sb)
+{
+  if(pread(fd, sb, sizeof(struct superBlock), 0) != sizeof(struct superBlock) ||
+     sb->magic != SUPERBLOCK_MAGIC || (sb->features & ~FEATURES_KNOWN))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+
+// Let go of memory_image, and of the image file when it maps one
+void releaseMemoryImage(struct msf_volume* vol)
+{
+  if(vol->memory_image != NULL)
+  {
+    munmap(vol->memory_image, vol->memory_size);
+  }
+
+  if(vol->cache_fd != -1)
+  {
+    close(vol->cache_fd);
+  }
+
+  free(vol->cache_state);
+  STAT_ADD(cluster_generation, 1);
+
+  vol->memory_image = NULL;
+  vol->memory_size = 0;
+  vol->cache_fd = -1;
+  vol->cache_state = NULL;
+  vol->data = NULL;
+}
+
+
+// Map the image file copy on write as memory_image and run it as a
+// block cache of cache_budget bytes. Nothing is read up front, the
+// kernel pages blocks in from the file as they are touched and our
+// changes stay private until savefs writes them. Returns -1, with no
+// memory_image, if the file can not be mapped
+int cacheImage(struct msf_volume* vol, char* filename)
+{
+  releaseMemoryImage(vol);
+
+  int fd = open(filename, O_RDWR);
+  if(fd == -1)
+  {
+    return -1;
+  }
+
+  struct stat buf;
+  if(fstat(fd, &buf) == -1 || (size_t) buf.st_size < vol->image_size)
+  {
+    close(fd);
+    return -1;
+  }
+
+  void* map = mmap(NULL, vol->image_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    close(fd);
+    return -1;
+  }
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  vol->cache_chunk = page_size > CACHE_CHUNK ? page_size : CACHE_CHUNK;
+  vol->cache_chunks = (vol->image_size + vol->cache_chunk - 1) / vol->cache_chunk;
+
+  vol->cache_state = (uint8_t*) calloc(vol->cache_chunks, 1);
+  if(vol->cache_state == NULL)
+  {
+    munmap(map, vol->image_size);
+    close(fd);
+    return -1;
+  }
+
+  vol->cache_first = ((size_t) vol->first_data_block * vol->block_size + vol->cache_chunk - 1) / vol->cache_chunk;
+  vol->cache_limit = vol->cache_budget / vol->cache_chunk > 0 ? vol->cache_budget / vol->cache_chunk : 1;
+  vol->cache_hand = vol->cache_first;
+  vol->cache_resident = 0;
+  vol->cache_written = 0;
+
+  vol->memory_image = (uint8_t*) map;
+  vol->memory_size = vol->image_size;
+  vol->data = vol->memory_image;
+  vol->cache_fd = fd;
+  return 0;
+}
+
+
+// Make memory_image big enough for the current geometry. Its contents
+// are undefined afterwards, callers fill in what they need
+int allocMemoryImage(struct msf_volume* vol)
+{
+  // a mapped image file can not be reused as scratch memory
+  if(vol->cache_fd != -1)
+  {
+    releaseMemoryImage(vol);
+  }
+
+  if(vol->memory_image != NULL && vol->memory_size == vol->image_size)
+  {
+    vol->data = vol->memory_image;
+    return 0;
+  }
+
+  if(vol->memory_image != NULL)
+  {
+    munmap(vol->memory_image, vol->memory_size);
+  }
+
+  // anonymous memory reads back as zeros and only takes up space
+  // once it is touched, so a big image costs nothing up front
+  void* map = mmap(NULL, vol->image_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if(map == MAP_FAILED)
+  {
+    vol->memory_image = NULL;
+    vol->memory_size = 0;
+    vol->data = NULL;
+    return -1;
+  }
+
+  vol->memory_image = (uint8_t*) map;
+  vol->memory_size = vol->image_size;
+  vol->data = vol->memory_image;
+  return 0;
+}
+
+
+// A volume with no image open. There is no memory_image until createfs
+// or open says how big it is. Returns NULL when out of memory
+struct msf_volume* allocVolume()
+{
+  struct msf_volume* vol = (struct msf_volume*) calloc(1, sizeof(struct msf_volume));
+  if(vol == NULL)
+  {
+    return NULL;
+  }
+
+  vol->image_fd = -1;
+  vol->cache_fd = -1;
+  vol->cache_budget = DEFAULT_CACHE_BYTES;
+  pthread_mutex_init(&vol->fs_lock, NULL);
+  pthread_rwlock_init(&vol->lock, NULL);
+  return vol;
+}
+
+
+// Let go of a volume and any image it still has open, without saving it
+void releaseVolume(struct msf_volume* vol)
+{
+  if(vol->image_open)
+  {
+    closeImage(vol);
+  }
+
+  free(vol->dirty_blocks);
+  free(vol->punch_blocks);
+  free(vol->committed_blocks);
+  free(vol->verified_blocks);
+  free(vol->generations);
+
+  pthread_rwlock_destroy(&vol->lock);
+  pthread_mutex_destroy(&vol->fs_lock);
+  free(vol);
+}
+
+
+uint64_t df(struct msf_volume* vol)
+{
+  // The free block count is kept up to date by the allocator
+  // so we just multiply it by the # bytes stored in
+  // each block
+  return (uint64_t)(vol->num_data_blocks - vol->used_count->blocks) * vol->block_size;
+}
+
+
+// Zero len bytes of memory_image. Whole pages are handed back to the
+// kernel, which maps fresh zero pages on the next touch, so zeroing
+// the image costs nothing until the memory is used again
+void zeroMemory(struct msf_volume* vol, void* ptr, size_t len)
+{
+  uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t) ptr;
+  uintptr_t end = start + len;
+  uintptr_t first = (start + page_size - 1) & ~(page_size - 1);
+  uintptr_t last = end & ~(page_size - 1);
+
+  // dropped pages of a mapped image file would read back from the file
+  if(vol->data != vol->memory_image || vol->cache_fd != -1 || first >= last ||
+     madvise((void*) first, last - first, MADV_DONTNEED) == -1)
+  {
+    memset(ptr, 0, len);
+    return;
+  }
+
+  memset(ptr, 0, first - start);
+  memset((void*) last, 0, end - last);
+}
+
+
+// Drop the mapping of a memory mapped image and go back to
+// holding the filesystem in memory_image
+void unmapImage(struct msf_volume* vol)
+{
+  if(!vol->image_mapped)
+  {
+    return;
+  }
+
+  munmap(vol->data, vol->image_size);
+  close(vol->image_fd);
+  STAT_ADD(cluster_generation, 1);
+
+  vol->image_fd = -1;
+  vol->image_mapped = 0;
+
+  vol->data = vol->memory_image;
+  mapMetadata(vol);
+}
+
+
+// Map the image file straight into our address space. Nothing is read
+// up front, the kernel pages blocks in as we touch them and writes
+// to data go to the page cache of the image file
+int mapImage(struct msf_volume* vol, char* filename)
+{
+  int fd = open(filename, O_RDWR);
+  if(fd == -1)
+  {
+    return -1;
+  }
+
+  struct superBlock sb;
+  if(readSuperblock(fd, &sb) == -1 ||
+     setGeometry(vol, sb.block_size, sb.num_blocks, sb.num_files, sb.features,
+                 sb.journal_blocks ? sb.journal_blocks : legacyJournalBlocks(sb.block_size)) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+
+  // whatever was open was laid out for the old geometry
+  vol->image_open = 0;
+
+  // the shared mapping takes the place of any cached one
+  releaseMemoryImage(vol);
+
+  struct stat buf;
+  if(fstat(fd, &buf) == -1 || (size_t) buf.st_size < vol->image_size)
+  {
+    close(fd);
+    return -1;
+  }
+
+  void* map = mmap(NULL, vol->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    close(fd);
+    return -1;
+  }
+
+  vol->image_fd = fd;
+  vol->image_mapped = 1;
+
+  vol->data = (uint8_t*) map;
+  mapMetadata(vol);
+
+  return 0;
+}
+
+
+//creating a filesystem image and zeroing out all memory
+int createfs(struct msf_volume* vol, char* filename, uint32_t size, uint32_t blocks, uint32_t files, uint32_t features)
+{
+  if(strlen(filename) >= sizeof(vol->image_name))
+  {
+    printf("ERROR: Filename is too long\n");
+    return -1;
+  }
+
+  // never build the new filesystem on top of a mapped image
+  unmapImage(vol);
+
+  if(setGeometry(vol, size, blocks, files, features, 0) == -1)
+  {
+    printf("ERROR: Invalid file system geometry\n");
+    return -1;
+  }
+
+  // whatever was open was laid out for the old geometry. It may map the
+  // file about to be truncated, so it goes first
+  vol->image_open = 0;
+  releaseMemoryImage(vol);
+
+  FILE* fp = fopen(filename, "w");
+  if(fp == NULL)
+  {
+    printf("ERROR: Could not create file system image\n");
+    return -1;
+  }
+
+  // copy new filesystem filename to image_name
+  memset(vol->image_name, 0, sizeof(vol->image_name));
+  strncpy(vol->image_name, filename, sizeof(vol->image_name) - 1);
+
+  // size the image file up front. It stays sparse, only the blocks
+  // savefs writes take up space on the host
+  if(ftruncate(fileno(fp), vol->image_size) == -1)
+  {
+    printf("ERROR: Could not create file system image\n");
+    fclose(fp);
+    return -1;
+  }
+
+  if((vol->cache_budget == 0 || cacheImage(vol, filename) == -1) && allocMemoryImage(vol) == -1)
+  {
+    printf("ERROR: Not enough memory for the file system image\n");
+    fclose(fp);
+    return -1;
+  }
+
+  // A zeroed metadata region is an empty filesystem. Data blocks are
+  // left as they are, a block is always written in full, its tail
+  // zeroed, when it is first given to a file
+  zeroMemory(vol, vol->data, (size_t) vol->first_data_block * vol->block_size);
+  mapMetadata(vol);
+
+  vol->superblock->magic = SUPERBLOCK_MAGIC;
+  vol->superblock->block_size = vol->block_size;
+  vol->superblock->num_blocks = vol->num_blocks;
+  vol->superblock->num_files = vol->num_files;
+  vol->superblock->features = features;
+  vol->superblock->journal_blocks = vol->journal_blocks;
+
+  vol->image_open = 1;
+
+  // The journal header is zero too, so the first savefs starts the
+  // log and commits the superblock as its first transaction
+  vol->journal_head = 0;
+  vol->journal_seq = 1;
+
+  // The image file is one big hole that already reads back as this
+  // empty filesystem, so the superblock is all savefs has to write
+  memset(vol->dirty_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+  memset(vol->punch_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+  memset(vol->committed_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+  markDirty(vol, 0, 1);
+
+  fclose(fp);
+  return 0;
+}
+
+
+
+// Write count blocks starting at block to the image file with as few
+// pwrite calls as the kernel lets us get away with
+int writeBlocks(struct msf_volume* vol, int fd, uint32_t block, uint32_t count)
+{
+  uint8_t* buf = BLOCK(vol, block);
+  size_t len = (size_t) count * vol->block_size;
+  off_t offset = (off_t) block * vol->block_size;
+
+  while(len > 0)
+  {
+    ssize_t written = pwrite(fd, buf, len, offset);
+    if(written == -1)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+
+    STAT_ADD(stats.host_writes, 1);
+    STAT_ADD(stats.host_bytes_written, written);
+
+    buf += written;
+    len -= written;
+    offset += written;
+  }
+
+  return 0;
+}
+
+
+// Drop chunks until the cache is back within its budget. The hand
+// sweeps the data chunks CLOCK style, a referenced chunk loses its
+// bit and is passed over once, and the first unreferenced one with
+// no unsaved blocks in it is dropped. It still matches the image file,
+// so the kernel reads it back in if it is touched again. Holding
+// fs_lock keeps blocks from turning dirty under the sweep, and when
+// somebody else holds it the next touch tries again
+void cacheTrim(struct msf_volume* vol)
+{
+  if(pthread_mutex_trylock(&vol->fs_lock) != 0)
+  {
+    return;
+  }
+
+  size_t looked;
+  for(looked = 0; looked < 2 * (vol->cache_chunks - vol->cache_first) &&
+                  __atomic_load_n(&vol->cache_resident, __ATOMIC_RELAXED) > vol->cache_limit; looked++)
+  {
+    size_t c = vol->cache_hand;
+    vol->cache_hand = c + 1 < vol->cache_chunks ? c + 1 : vol->cache_first;
+
+    uint8_t state = __atomic_load_n(&vol->cache_state[c], __ATOMIC_RELAXED);
+    if(!(state & CHUNK_RESIDENT))
+    {
+      continue;
+    }
+
+    if(state & CHUNK_REFERENCED)
+    {
+      __atomic_fetch_and(&vol->cache_state[c], (uint8_t) ~CHUNK_REFERENCED, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    // blocks never straddle chunks, both are powers of two
+    uint32_t block = c * vol->cache_chunk / vol->block_size;
+    uint32_t end = (c + 1) * vol->cache_chunk / vol->block_size;
+    uint32_t length;
+    if(end > vol->num_blocks)
+    {
+      end = vol->num_blocks;
+    }
+
+    if(findSetRun(vol->dirty_blocks, end, block, &length) != -1)
+    {
+      continue;
+    }
+
+    // a reader may have touched it since we looked
+    uint8_t expected = CHUNK_RESIDENT;
+    if(!__atomic_compare_exchange_n(&vol->cache_state[c], &expected, 0, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      continue;
+    }
+
+    size_t len = vol->image_size - c * vol->cache_chunk < vol->cache_chunk ? vol->image_size - c * vol->cache_chunk : vol->cache_chunk;
+    madvise(vol->data + c * vol->cache_chunk, len, MADV_DONTNEED);
+    __atomic_sub_fetch(&vol->cache_resident, 1, __ATOMIC_RELAXED);
+    STAT_ADD(stats.cache_evictions, 1);
+  }
+
+  pthread_mutex_unlock(&vol->fs_lock);
+}
+
+
+// Bytes of file data the block cache holds in memory, 0 without one
+size_t cacheResidentBytes(struct msf_volume* vol)
+{
+  return vol->cache_state != NULL ? vol->cache_resident * vol->cache_chunk : 0;
+}
+
+
+// Whether count data blocks from block are in memory, so checking them
+// reads nothing from the image file. Blocks of a mapped image, and ones
+// in chunks the cache dropped, would have to be paged in
+int blocksResident(struct msf_volume* vol, uint32_t block, uint32_t count)
+{
+  if(vol->image_mapped)
+  {
+    return 0;
+  }
+
+  if(vol->cache_state == NULL || count == 0)
+  {
+    return 1;
+  }
+
+  size_t c = (size_t) block * vol->block_size / vol->cache_chunk;
+  size_t last = ((size_t)(block + count) * vol->block_size - 1) / vol->cache_chunk;
+
+  for(; c <= last; c++)
+  {
+    if(c >= vol->cache_first && !(__atomic_load_n(&vol->cache_state[c], __ATOMIC_RELAXED) & CHUNK_RESIDENT))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+// Count count data blocks from block as in use by the cache, making
+// room for them if that takes it over budget
+void cacheTouch(struct msf_volume* vol, uint32_t block, uint32_t count)
+{
+  if(vol->cache_state == NULL || count == 0)
+  {
+    return;
+  }
+
+  size_t c = (size_t) block * vol->block_size / vol->cache_chunk;
+  size_t last = ((size_t)(block + count) * vol->block_size - 1) / vol->cache_chunk;
+  int over = 0;
+
+  // chunks holding metadata never leave memory
+  if(c < vol->cache_first)
+  {
+    c = vol->cache_first;
+  }
+
+  for(; c <= last; c++)
+  {
+    if(__atomic_load_n(&vol->cache_state[c], __ATOMIC_RELAXED) == (CHUNK_RESIDENT | CHUNK_REFERENCED))
+    {
+      continue;
+    }
+
+    uint8_t old = __atomic_fetch_or(&vol->cache_state[c], CHUNK_RESIDENT | CHUNK_REFERENCED, __ATOMIC_RELAXED);
+    if(!(old & CHUNK_RESIDENT) &&
+       __atomic_add_fetch(&vol->cache_resident, 1, __ATOMIC_RELAXED) > vol->cache_limit)
+    {
+      over = 1;
+    }
+  }
+
+  if(over)
+  {
+    cacheTrim(vol);
+  }
+}
+
+
+// Write count finished blocks from start to the image file ahead of
+// savefs when the cache is over budget, so they are clean and can be
+// dropped like any other. Their checksums are already worked out and
+// go out with the next savefs. Blocks freed
+// since the last savefs may still belong to a file as far as the image
+// file knows, so those stay dirty until savefs. Called by whoever owns
+// the blocks, without fs_lock
+void cacheWriteBack(struct msf_volume* vol, uint32_t start, uint32_t count)
+{
+  if(vol->cache_fd == -1 || __atomic_load_n(&vol->cache_resident, __ATOMIC_RELAXED) <= vol->cache_limit)
+  {
+    return;
+  }
+
+  uint32_t end = start + count;
+  uint32_t b = start;
+
+  while(b < end)
+  {
+    uint32_t run = 0;
+    while(b + run < end &&
+          !((__atomic_load_n(&vol->punch_blocks[(b + run) / BITS_PER_WORD], __ATOMIC_RELAXED) >>
+             ((b + run) % BITS_PER_WORD)) & 1))
+    {
+      run++;
+    }
+
+    if(run == 0)
+    {
+      b++;
+      continue;
+    }
+
+    if(writeBlocks(vol, vol->cache_fd, b, run) == 0)
+    {
+      pthread_mutex_lock(&vol->fs_lock);
+      clearBits(vol->dirty_blocks, b, run);
+      vol->cache_written = 1;
+      pthread_mutex_unlock(&vol->fs_lock);
+
+      STAT_ADD(stats.cache_writebacks, run);
+    }
+
+    b += run;
+  }
+}
+
+
+// Whether data block b belongs to a file, or holds extents for one
+int blockInUse(struct msf_volume* vol, uint32_t b)
+{
+  uint32_t bit = b - vol->first_data_block;
+  return (vol->used_blocks[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+
+// Whether data block b is in use as far as the image file knows, so
+// writing over it there before the next commit could tear a file
+int blockCommitted(struct msf_volume* vol, uint32_t b)
+{
+  uint32_t bit = b - vol->first_data_block;
+  return (vol->committed_blocks[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+
+// The image file has caught up with the free block map in memory. A
+// mapped image changes in the file as it changes in memory, there is
+// no commit to keep its blocks for, so for it the map stays empty
+void commitBlockMap(struct msf_volume* vol)
+{
+  if(vol->image_mapped)
+  {
+    return;
+  }
+
+  memcpy(vol->committed_blocks, vol->used_blocks, WORDS_FOR(vol->num_data_blocks) * sizeof(uint64_t));
+}
+
+
+int blockIsZero(struct msf_volume* vol, uint32_t block)
+{
+  const uint64_t* word = (const uint64_t*) BLOCK(vol, block);
+
+  int i;
+  for(i = 0; i < vol->block_size / 8; i++)
+  {
+    if(word[i])
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+// Drop count blocks starting at block from the image file, leaving a
+// hole that reads back as zeros. Fails where the host filesystem
+// cannot punch holes
+int punchBlocks(struct msf_volume* vol, int fd, uint32_t block, uint32_t count)
+{
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   (off_t) block * vol->block_size, (off_t) count * vol->block_size);
+}
+
+
+// writeBlocks, except that runs of all zero blocks become holes in
+// the image file instead of being written out
+int writeSparse(struct msf_volume* vol, int fd, uint32_t block, uint32_t count)
+{
+  uint32_t end = block + count;
+
+  while(block < end)
+  {
+    int zero = blockIsZero(vol, block);
+    uint32_t run = 1;
+
+    while(block + run < end && blockIsZero(vol, block + run) == zero)
+    {
+      run++;
+    }
+
+    if(!zero || punchBlocks(vol, fd, block, run) == -1)
+    {
+      if(writeBlocks(vol, fd, block, run) == -1)
+      {
+        return -1;
+      }
+    }
+
+    block += run;
+  }
+
+  return 0;
+}
+
+
+// Punch out every block freed since the last savefs that is still
+// free. Called once the frees are durable in the image, so a crash
+// can never leave a file pointing at a hole. Returns -1 if a punch
+// failed for any reason but the host not supporting holes
+int punchFreedBlocks(struct msf_volume* vol, int fd)
+{
+  uint32_t length;
+  int32_t block = 0;
+  int ret = 0;
+
+  while((block = findSetRun(vol->punch_blocks, vol->num_blocks, block, &length)) != -1)
+  {
+    uint32_t end = block + length;
+
+    while((uint32_t) block < end)
+    {
+      // blocks handed out again since they were freed hold live data
+      uint32_t run = 0;
+      while(block + run < end && !blockInUse(vol, block + run))
+      {
+        run++;
+      }
+
+      if(run > 0)
+      {
+        if(punchBlocks(vol, fd, block, run) == -1 && errno != EOPNOTSUPP)
+        {
+          ret = -1;
+        }
+        block += run;
+      }
+      else
+      {
+        block++;
+      }
+    }
+  }
+
+  memset(vol->punch_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+  return ret;
+}
+
+
+// Read len bytes at offset of fd into the image in memory. Whatever is
+// past the end of the file is zeroed
+void readImageRange(struct msf_volume* vol, int fd, off_t offset, size_t len)
+{
+  uint8_t* buf = vol->data + offset;
+
+  while(len > 0)
+  {
+    ssize_t got = pread(fd, buf, len, offset);
+    if(got == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if(got <= 0)
+    {
+      break;
+    }
+
+    stats.host_reads++;
+    stats.host_bytes_read += got;
+
+    buf += got;
+    len -= got;
+    offset += got;
+  }
+
+  zeroMemory(vol, buf, len);
+}
+
+
+// Load an image file into memory_image, reading only the ranges that
+// hold data. SEEK_DATA and SEEK_HOLE find them, and holes are zeroed
+// in memory without any I/O
+void loadImage(struct msf_volume* vol, int fd)
+{
+  off_t offset = 0;
+
+  while((size_t) offset < vol->image_size)
+  {
+    off_t start = lseek(fd, offset, SEEK_DATA);
+    if(start == -1)
+    {
+      // ENXIO means nothing but holes from here to the end. Anything
+      // else is a filesystem that cannot tell, so read it all
+      if(errno == ENXIO)
+      {
+        zeroMemory(vol, vol->data + offset, vol->image_size - offset);
+      }
+      else
+      {
+        readImageRange(vol, fd, offset, vol->image_size - offset);
+      }
+      return;
+    }
+
+    if((size_t) start > vol->image_size)
+    {
+      start = vol->image_size;
+    }
+
+    off_t end = lseek(fd, start, SEEK_HOLE);
+    if(end == -1 || (size_t) end > vol->image_size)
+    {
+      end = vol->image_size;
+    }
+
+    zeroMemory(vol, vol->data + offset, start - offset);
+    readImageRange(vol, fd, start, end - start);
+    offset = end;
+  }
+}
+
+
+// Is block part of the journal itself? Those blocks are never logged
+int inJournal(struct msf_volume* vol, uint32_t block)
+{
+  return block >= vol->journal_block && block < vol->journal_block + vol->journal_blocks;
+}
+
+
+// Write a list of metadata blocks to their home in the image,
+// merging neighbours into a single write
+int writeMetaBlocks(struct msf_volume* vol, int fd, const uint32_t* meta, uint32_t num_meta)
+{
+  uint32_t i = 0;
+  while(i < num_meta)
+  {
+    uint32_t j = i + 1;
+    while(j < num_meta && meta[j] == meta[j - 1] + 1)
+    {
+      j++;
+    }
+
+    if(writeSparse(vol, fd, meta[i], j - i) == -1)
+    {
+      return -1;
+    }
+
+    i = j;
+  }
+
+  return 0;
+}
+
+
+// Log blocks a transaction of num_meta metadata blocks and num_runs
+// data runs takes, descriptors and commit block included
+uint32_t transactionBlocks(struct msf_volume* vol, uint32_t num_meta, uint32_t num_runs)
+{
+  uint32_t num_desc = (num_meta + vol->journal_max_meta - 1) / vol->journal_max_meta;
+  uint32_t run_desc = (num_runs + vol->journal_max_runs - 1) / vol->journal_max_runs;
+  if(run_desc > num_desc)
+  {
+    num_desc = run_desc;
+  }
+  if(num_desc == 0)
+  {
+    num_desc = 1;
+  }
+
+  return num_desc + num_meta + 1;
+}
+
+
+// Commit everything marked dirty as one journal transaction, so a batch
+// of inserts costs one sequential log append and one fsync:
+//
+//   1. data runs are written in place. They were free in the last
+//      committed state so nothing live is overwritten. A data block
+//      that was in use then, which is mostly an extent block since
+//      writes copy file blocks elsewhere, is logged like metadata
+//   2. the descriptors, metadata block images and commit block are
+//      appended to the log with a single pwrite
+//   3. one fsync makes the data and the transaction durable together.
+//      The commit block checksums both, so a transaction that only
+//      partly reached the disk is thrown away by replay
+//   4. the metadata is written in place. These writes are not synced,
+//      the log covers them until it fills up and is started over
+//
+// The log is sized to hold every metadata block at once, so nothing is
+// ever written in place without being logged first. Returns MSF_OK,
+// MSF_EIO, or MSF_ENOSPC when the change does not fit the smaller
+// journal of an older image, or logs too many data blocks
+int commitJournal(struct msf_volume* vol, int fd)
+{
+  uint32_t max_meta = vol->first_data_block;
+  uint32_t* meta = (uint32_t*) malloc(max_meta * sizeof(uint32_t));
+  uint32_t num_meta = 0;
+
+  struct journalRun* runs = NULL;
+  uint32_t num_runs = 0;
+  uint32_t max_runs = 0;
+
+  uint32_t length;
+  int32_t block = 0;
+  int ret = MSF_EIO;
+
+  // sort the dirty blocks into metadata blocks and data runs
+  while((block = findSetRun(vol->dirty_blocks, vol->num_blocks, block, &length)) != -1)
+  {
+    uint32_t end = block + length;
+
+    for(; (uint32_t) block < end && block < vol->first_data_block; block++)
+    {
+      if(!inJournal(vol, block))
+      {
+        meta[num_meta++] = block;
+      }
+    }
+
+    // blocks freed since they changed are not written, they are about
+    // to be punched and would no longer match the transaction's data_crc
+    while((uint32_t) block < end)
+    {
+      if(!blockInUse(vol, block))
+      {
+        block++;
+        continue;
+      }
+
+      if(blockCommitted(vol, block))
+      {
+        if(num_meta == max_meta)
+        {
+          max_meta *= 2;
+          meta = (uint32_t*) realloc(meta, max_meta * sizeof(uint32_t));
+        }
+
+        meta[num_meta++] = block++;
+        continue;
+      }
+
+      uint32_t run = 0;
+      while(block + run < end && blockInUse(vol, block + run) && !blockCommitted(vol, block + run))
+      {
+        run++;
+      }
+
+      if(num_runs == max_runs)
+      {
+        max_runs = max_runs ? max_runs * 2 : 64;
+        runs = (struct journalRun*) realloc(runs, max_runs * sizeof(struct journalRun));
+      }
+
+      runs[num_runs].start = block;
+      runs[num_runs].length = run;
+      num_runs++;
+
+      block += run;
+    }
+  }
+
+  uint32_t data_crc = 0;
+  uint32_t i;
+  for(i = 0; i < num_runs; i++)
+  {
+    if(writeSparse(vol, fd, runs[i].start, runs[i].length) == -1)
+    {
+      goto out;
+    }
+
+    data_crc = crc32c(data_crc, BLOCK(vol, runs[i].start), (size_t) runs[i].length * vol->block_size);
+  }
+
+  uint32_t txn_blocks = transactionBlocks(vol, num_meta, num_runs);
+
+  // Data blocks the image file holds that are too many to log, because
+  // a full image left no room to copy them, go out in place like any
+  // other data. A crash before the commit can then tear them
+  uint32_t num_logged = 0;
+  while(num_logged < num_meta && meta[num_meta - num_logged - 1] >= vol->first_data_block)
+  {
+    num_logged++;
+  }
+
+  if(txn_blocks > vol->journal_log_blocks && num_logged > 0)
+  {
+    if(writeMetaBlocks(vol, fd, meta + num_meta - num_logged, num_logged) == -1)
+    {
+      goto out;
+    }
+
+    num_meta -= num_logged;
+    txn_blocks = transactionBlocks(vol, num_meta, num_runs);
+  }
+
+  // Too many data runs to list in the log. They are already written,
+  // so sync them now and leave them out of the transaction
+  if(txn_blocks > vol->journal_log_blocks && num_runs > 0)
+  {
+    if(fsync(fd) == -1)
+    {
+      goto out;
+    }
+
+    stats.host_syncs++;
+    num_runs = 0;
+    data_crc = 0;
+    txn_blocks = transactionBlocks(vol, num_meta, num_runs);
+  }
+
+  if(txn_blocks > vol->journal_log_blocks)
+  {
+    ret = MSF_ENOSPC;
+    goto out;
+  }
+
+  // An image whose log was never started gets an empty one. Its header
+  // goes out with the first transaction's fsync
+  if(vol->journal->magic != JOURNAL_MAGIC)
+  {
+    vol->journal->magic = JOURNAL_MAGIC;
+    vol->journal->seq = vol->journal_seq;
+    vol->journal_head = 0;
+
+    if(writeBlocks(vol, fd, vol->journal_block, 1) == -1)
+    {
+      goto out;
+    }
+  }
+
+
+  // When the log is full, sync the in place metadata it was covering
+  // and start it over from the top
+  if(vol->journal_head + txn_blocks > vol->journal_log_blocks)
+  {
+    if(fsync(fd) == -1)
+    {
+      goto out;
+    }
+
+    stats.host_syncs++;
+    vol->journal->seq = vol->journal_seq;
+    vol->journal_head = 0;
+
+    if(writeBlocks(vol, fd, vol->journal_block, 1) == -1)
+    {
+      goto out;
+    }
+  }
+
+
+  // lay the transaction out in memory so it goes to the log in one write
+  uint8_t* txn = (uint8_t*) calloc(txn_blocks, vol->block_size);
+  uint8_t* pos = txn;
+  uint32_t next_meta = 0;
+  uint32_t next_run = 0;
+  uint32_t num_desc = txn_blocks - num_meta - 1;
+
+  uint32_t d;
+  for(d = 0; d < num_desc; d++)
+  {
+    struct journalDescriptor* desc = (struct journalDescriptor*) pos;
+    desc->magic = JOURNAL_DESC_MAGIC;
+    desc->seq = vol->journal_seq;
+
+    while(desc->num_meta < vol->journal_max_meta && next_meta < num_meta)
+    {
+      desc->meta[desc->num_meta++] = meta[next_meta++];
+    }
+
+    while(desc->num_runs < vol->journal_max_runs && next_run < num_runs)
+    {
+      DESC_RUNS(vol, desc)[desc->num_runs++] = runs[next_run++];
+    }
+
+    pos += vol->block_size;
+
+    for(i = 0; i < desc->num_meta; i++)
+    {
+      memcpy(pos, BLOCK(vol, desc->meta[i]), vol->block_size);
+      pos += vol->block_size;
+    }
+  }
+
+  struct journalCommit* commit = (struct journalCommit*) pos;
+  commit->magic = JOURNAL_COMMIT_MAGIC;
+  commit->seq = vol->journal_seq;
+  commit->num_blocks = txn_blocks - 1;
+  commit->journal_crc = crc32c(0, txn, (size_t)(txn_blocks - 1) * vol->block_size);
+  commit->data_crc = data_crc;
+
+  off_t log_offset = (off_t)(vol->journal_block + 1 + vol->journal_head) * vol->block_size;
+  ssize_t written = pwrite(fd, txn, (size_t) txn_blocks * vol->block_size, log_offset);
+  free(txn);
+
+  if(written != (ssize_t) txn_blocks * vol->block_size || fsync(fd) == -1)
+  {
+    goto out;
+  }
+
+  stats.host_writes++;
+  stats.host_bytes_written += written;
+  stats.host_syncs++;
+
+  vol->journal_head += txn_blocks;
+  vol->journal_seq++;
+
+  // checkpoint, the transaction is durable so these can go out lazily
+  if(writeMetaBlocks(vol, fd, meta, num_meta) == -1)
+  {
+    goto out;
+  }
+
+  ret = MSF_OK;
+
+out:
+  free(meta);
+  free(runs);
+  return ret;
+}
+
+
+// Check that a transaction numbered seq starts at block pos of the log
+// and is complete. Returns the number of log blocks it takes, commit
+// block included, or -1 if there is no valid transaction there
+int32_t checkTransaction(struct msf_volume* vol, uint32_t pos, uint32_t seq)
+{
+  uint8_t* log = BLOCK(vol, vol->journal_block + 1);
+  uint32_t p = pos;
+  uint32_t crc = 0;
+
+  while(p < vol->journal_log_blocks)
+  {
+    struct journalDescriptor* desc = (struct journalDescriptor*) (log + (size_t) p * vol->block_size);
+
+    if(desc->magic == JOURNAL_COMMIT_MAGIC && desc->seq == seq)
+    {
+      struct journalCommit* commit = (struct journalCommit*) desc;
+
+      if(p == pos || commit->num_blocks != p - pos || commit->journal_crc != crc)
+      {
+        return -1;
+      }
+
+      return p - pos + 1;
+    }
+
+    if(desc->magic != JOURNAL_DESC_MAGIC || desc->seq != seq ||
+       desc->num_meta > vol->journal_max_meta || desc->num_runs > vol->journal_max_runs ||
+       p + 1 + desc->num_meta >= vol->journal_log_blocks)
+    {
+      return -1;
+    }
+
+    uint32_t i;
+    for(i = 0; i < desc->num_meta; i++)
+    {
+      if(desc->meta[i] >= vol->num_blocks || inJournal(vol, desc->meta[i]))
+      {
+        return -1;
+      }
+    }
+
+    crc = crc32c(crc, desc, (size_t)(1 + desc->num_meta) * vol->block_size);
+    p += 1 + desc->num_meta;
+  }
+
+  return -1;
+}
+
+
+// CRC32C of the data runs listed by the transaction at log block pos
+uint32_t transactionDataCrc(struct msf_volume* vol, uint32_t pos, uint32_t length)
+{
+  uint8_t* log = BLOCK(vol, vol->journal_block + 1);
+  uint32_t end = pos + length - 1;
+  uint32_t crc = 0;
+
+  while(pos < end)
+  {
+    struct journalDescriptor* desc = (struct journalDescriptor*) (log + (size_t) pos * vol->block_size);
+
+    uint32_t i;
+    for(i = 0; i < desc->num_runs; i++)
+    {
+      if(DESC_RUNS(vol, desc)[i].start < vol->first_data_block ||
+         DESC_RUNS(vol, desc)[i].start + DESC_RUNS(vol, desc)[i].length > vol->num_blocks)
+      {
+        return ~crc;
+      }
+
+      crc = crc32c(crc, BLOCK(vol, DESC_RUNS(vol, desc)[i].start), (size_t) DESC_RUNS(vol, desc)[i].length * vol->block_size);
+    }
+
+    pos += 1 + desc->num_meta;
+  }
+
+  return crc;
+}
+
+
+// Copy the block images of the transaction at log block pos into
+// place and mark them dirty
+void applyTransaction(struct msf_volume* vol, uint32_t pos, uint32_t length)
+{
+  uint8_t* log = BLOCK(vol, vol->journal_block + 1);
+  uint32_t end = pos + length - 1;
+
+  while(pos < end)
+  {
+    struct journalDescriptor* desc = (struct journalDescriptor*) (log + (size_t) pos * vol->block_size);
+
+    uint32_t i;
+    for(i = 0; i < desc->num_meta; i++)
+    {
+      memcpy(BLOCK(vol, desc->meta[i]), log + (size_t)(pos + 1 + i) * vol->block_size, vol->block_size);
+      markDirty(vol, desc->meta[i], 1);
+    }
+
+    pos += 1 + desc->num_meta;
+  }
+}
+
+
+// Replay the committed transactions in the log of a just opened image.
+// Every transaction but the last was followed by a later commit and its
+// fsync, so only the last one needs its data checked. Returns the
+// number of transactions applied
+uint32_t replayJournal(struct msf_volume* vol)
+{
+  vol->journal_head = 0;
+  vol->journal_seq = vol->journal->seq;
+
+  if(vol->journal->magic != JOURNAL_MAGIC)
+  {
+    return 0;
+  }
+
+  // a transaction takes at least two blocks. The log grows with the
+  // image, so these are too big for the stack
+  uint32_t* pos = (uint32_t*) malloc((vol->journal_log_blocks / 2) * sizeof(uint32_t));
+  uint32_t* len = (uint32_t*) malloc((vol->journal_log_blocks / 2) * sizeof(uint32_t));
+  uint32_t count = 0;
+  uint32_t p = 0;
+
+  int32_t n;
+  while((n = checkTransaction(vol, p, vol->journal->seq + count)) != -1)
+  {
+    pos[count] = p;
+    len[count] = n;
+    count++;
+    p += n;
+  }
+
+  if(count > 0)
+  {
+    struct journalCommit* commit = (struct journalCommit*)
+      BLOCK(vol, vol->journal_block + 1 + pos[count - 1] + len[count - 1] - 1);
+
+    if(transactionDataCrc(vol, pos[count - 1], len[count - 1]) != commit->data_crc)
+    {
+      count--;
+    }
+  }
+
+  uint32_t i;
+  for(i = 0; i < count; i++)
+  {
+    applyTransaction(vol, pos[i], len[i]);
+  }
+
+  vol->journal_seq = vol->journal->seq + count;
+
+  free(pos);
+  free(len);
+  return count;
+}
+
+
+//saving the filesystem image to disk. Only the blocks changed since
+//the image was opened or last saved are written, as one journal
+//transaction. A mapped image is flushed with msync and not journaled.
+//Returns MSF_OK or what went wrong, without saying anything about it
+int saveImage(struct msf_volume* vol)
+{
+    uint32_t length;
+    int32_t block = 0;
+
+    //nothing changed since the last save, so there is nothing to log
+    //and an image that can not be written is no obstacle
+    if(findSetRun(vol->dirty_blocks, vol->num_blocks, 0, &length) == -1 &&
+       findSetRun(vol->punch_blocks, vol->num_blocks, 0, &length) == -1)
+    {
+        return MSF_OK;
+    }
+
+    //a mapped image already lives in the file, flushing the
+    //dirty pages is all that is left to do
+    if(vol->image_mapped)
+    {
+        long page_size = sysconf(_SC_PAGESIZE);
+
+        while((block = findSetRun(vol->dirty_blocks, vol->num_blocks, block, &length)) != -1)
+        {
+            //msync wants a page aligned address
+            uintptr_t start = (uintptr_t) BLOCK(vol, block) & ~(uintptr_t)(page_size - 1);
+            uintptr_t end = (uintptr_t) BLOCK(vol, block) + (size_t) length * vol->block_size;
+
+            //what did not reach the file stays dirty for the next try
+            if(msync((void*) start, end - start, MS_SYNC) == -1)
+            {
+                return MSF_EIO;
+            }
+            stats.host_syncs++;
+            block += length;
+        }
+
+        memset(vol->dirty_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+        commitBlockMap(vol);
+        return punchFreedBlocks(vol, vol->image_fd) == -1 ? MSF_EIO : MSF_OK;
+    }
+
+    int fd = open(vol->image_name, O_WRONLY | O_CREAT, 0644);
+    if(fd == -1)
+    {
+        return MSF_ENOENT;
+    }
+
+    //data blocks the cache wrote early have to be on disk before the
+    //metadata that points at them
+    if(vol->cache_written)
+    {
+        if(fsync(vol->cache_fd) == -1)
+        {
+            close(fd);
+            return MSF_EIO;
+        }
+        stats.host_syncs++;
+        vol->cache_written = 0;
+    }
+
+    int status = commitJournal(vol, fd);
+    if(status != MSF_OK)
+    {
+        close(fd);
+        return status;
+    }
+
+    //the transaction is durable from here on, so the image is clean
+    //even if tidying up the file after it fails, and the blocks it
+    //freed can be handed out again
+    memset(vol->dirty_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+    commitBlockMap(vol);
+
+    if(punchFreedBlocks(vol, fd) == -1)
+    {
+        status = MSF_EIO;
+    }
+
+    //an image cut short, as older versions made them, reads back
+    //as zeros past its end once it is extended to full size
+    struct stat buf;
+    if(fstat(fd, &buf) == 0 && (size_t) buf.st_size < vol->image_size &&
+       ftruncate(fd, vol->image_size) == -1)
+    {
+        status = MSF_EIO;
+    }
+
+    close(fd);
+
+    //everything in the cache is clean now, so it can shrink back
+    if(vol->cache_state != NULL && vol->cache_resident > vol->cache_limit)
+    {
+        cacheTrim(vol);
+    }
+    return status;
+}
+
+
+int savefs(struct msf_volume* vol)
+{
+    if(vol->image_open == 0)
+    {
+        printf("ERROR: Disk image is not open\n");
+        return -1;
+    }
+
+    int status = saveImage(vol);
+    if(status == MSF_ENOENT)
+    {
+        printf("ERROR: Could not open file system image\n");
+    }
+    else if(status == MSF_ENOSPC)
+    {
+        printf("ERROR: Too many changes for the journal of this image, save more often\n");
+    }
+    else if(status != MSF_OK)
+    {
+        printf("ERROR: Could not write file system image\n");
+    }
+
+    return status == MSF_OK ? 0 : -1;
+}
+
+
+//open the filesytem image and parse all of our data. With use_mmap
+//the image is mapped instead of read into memory. Returns MSF_OK or
+//what went wrong, without saying anything about it
+int openImage(struct msf_volume* vol, const char* filename, int use_mmap)
+{
+  if(strlen(filename) >= sizeof(vol->image_name))
+  {
+    return MSF_ENAMETOOLONG;
+  }
+
+  unmapImage(vol);
+
+  if(use_mmap)
+  {
+    if(mapImage(vol, (char*) filename) == -1)
+    {
+      return MSF_EIO;
+    }
+  }
+  else
+  {
+    //open image to read from
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1)
+    {
+      return errno == ENOENT ? MSF_ENOENT : MSF_EIO;
+    }
+
+    //the superblock says how the rest of the image is laid out
+    struct superBlock sb;
+    if(readSuperblock(fd, &sb) == -1 ||
+       setGeometry(vol, sb.block_size, sb.num_blocks, sb.num_files, sb.features,
+                   sb.journal_blocks ? sb.journal_blocks : legacyJournalBlocks(sb.block_size)) == -1)
+    {
+      close(fd);
+      return MSF_EBADIMAGE;
+    }
+
+    vol->image_open = 0;
+
+    //map the image as a block cache, which only needs the metadata
+    //read in now. The free counts come in with it so there is nothing
+    //to rescan. Without a cache the populated parts of the image are
+    //all read into memory
+    if(vol->cache_budget > 0 && cacheImage(vol, (char*) filename) == 0)
+    {
+      madvise(vol->data, (size_t) vol->first_data_block * vol->block_size, MADV_WILLNEED);
+    }
+    else if(allocMemoryImage(vol) == 0)
+    {
+      loadImage(vol, fd);
+    }
+    else
+    {
+      close(fd);
+      return MSF_ENOMEM;
+    }
+    close(fd);
+
+    mapMetadata(vol);
+  }
+
+  memset(vol->image_name, 0, sizeof(vol->image_name));
+  strncpy(vol->image_name, filename, sizeof(vol->image_name) - 1);
+
+  //what is in memory now matches the image file
+  memset(vol->dirty_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+  memset(vol->punch_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+
+  //finish anything a crash left in the journal. The replayed metadata
+  //has to be on disk before the header moves past the log, so they
+  //are synced one after the other
+  if(replayJournal(vol) > 0)
+  {
+    if(vol->image_mapped)
+    {
+      long page_size = sysconf(_SC_PAGESIZE);
+
+      msync(vol->data, vol->first_data_block * vol->block_size, MS_SYNC);
+      vol->journal->seq = vol->journal_seq;
+      msync((void*) ((uintptr_t) vol->journal & ~(uintptr_t)(page_size - 1)), page_size, MS_SYNC);
+    }
+    else
+    {
+      int fd = open(filename, O_WRONLY);
+      if(fd != -1)
+      {
+        uint32_t length;
+        int32_t block = 0;
+
+        while((block = findSetRun(vol->dirty_blocks, vol->num_blocks, block, &length)) != -1)
+        {
+          writeBlocks(vol, fd, block, length);
+          block += length;
+        }
+
+        fsync(fd);
+        vol->journal->seq = vol->journal_seq;
+        writeBlocks(vol, fd, vol->journal_block, 1);
+        fsync(fd);
+        close(fd);
+      }
+    }
+
+    memset(vol->dirty_blocks, 0, vol->dirty_words * sizeof(uint64_t));
+  }
+
+  commitBlockMap(vol);
+  vol->block_hint = 0;
+  vol->inode_hint = 0;
+
+  vol->image_open = 1;
+  return MSF_OK;
+}
+
+
+int openfs(struct msf_volume* vol, char* filename, int use_mmap)
+{
+  int status = openImage(vol, filename, use_mmap);
+
+  if(status == MSF_OK)
+  {
+    return 0;
+  }
+
+  if(status == MSF_ENAMETOOLONG)
+  {
+    printf("ERROR: Filename is too long\n");
+  }
+  else if(use_mmap)
+  {
+    printf("ERROR: Could not map file system image\n");
+  }
+  else if(status == MSF_EBADIMAGE)
+  {
+    printf("ERROR: Not a valid file system image\n");
+  }
+  else if(status == MSF_ENOMEM)
+  {
+    printf("ERROR: Not enough memory for the file system image\n");
+  }
+  else
+  {
+    printf("ERROR: Could not open file system image\n");
+  }
+  return -1;
+}
+
+
+// Let go of the open image without saving it
+void closeImage(struct msf_volume* vol)
+{
+  unmapImage(vol);
+  releaseMemoryImage(vol);
+
+  vol->image_open = 0;
+  memset(vol->image_name, 0, 64);
+}
+
+
+//close our filesytem image
+int closefs(struct msf_volume* vol)
+{
+  if(vol->image_open == 0)
+  {
+    printf("ERROR: Disk image is not open\n");
+    return -1;
+  }
+
+  closeImage(vol);
+  return 0;
+}
+
+
+//list files in our filesystem image
+int list(struct msf_volume* vol)
+{
+
+  int i;
+  int not_found = 1;
+
+  for(i = 0; i < vol->num_files; i++)
+  {
+    //\TODO Add a check to not list if the file is hidden
+    if(vol->directory[i].in_use == 1)
+    {
+      not_found = 0;
+
+      char filename[65];
+      memset(filename, 0, 65);
+      memcpy(filename, vol->directory[i].filename, vol->directory[i].name_len);
+
+      printf("%s\n",filename);
+    }
+  }
+
+  if(not_found)
+  {
+    printf("list: No files found.\n");
+  }
+
+  return 0;
+}
+
+
+struct workQueue
+{
+  struct msf_volume* vol;
+  int (*fn)(struct msf_volume* vol, char* name);
+  char** names;
+  int (*job)(struct msf_volume* vol, int i); // run for 0 to count - 1 instead of fn on names
+  int count;
+  int next;   // next name to hand out
+  int failed; // number of names fn returned -1 for
+};
+
+
+void* workerMain(void* arg)
+{
+  struct workQueue* queue = (struct workQueue*) arg;
+
+  while(1)
+  {
+    int i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+    if(i >= queue->count)
+    {
+      break;
+    }
+
+    int status = queue->job ? queue->job(queue->vol, i) : queue->fn(queue->vol, queue->names[i]);
+    if(status == -1)
+    {
+      __atomic_fetch_add(&queue->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+
+// Work through a queue on a pool of worker threads that each take the
+// next item off a shared counter. Returns -1 if any item failed
+int runQueue(struct msf_volume* vol, struct workQueue* queue)
+{
+  int threads = vol->num_workers > 0 ? vol->num_workers : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads > queue->count)
+  {
+    threads = queue->count;
+  }
+
+  pthread_t* workers = (pthread_t*) calloc(threads, sizeof(pthread_t));
+  int started = 0;
+
+  // the calling thread is a worker too, so one name or one
+  // thread never starts any
+  while(started < threads - 1 &&
+        pthread_create(&workers[started], NULL, workerMain, queue) == 0)
+  {
+    started++;
+  }
+
+  workerMain(queue);
+
+  int i;
+  for(i = 0; i < started; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+
+  free(workers);
+  return queue->failed ? -1 : 0;
+}
+
+
+// Run fn on every name on the worker pool. Returns -1 if fn failed
+// for any of them
+int runWorkers(struct msf_volume* vol, int (*fn)(struct msf_volume* vol, char* name), char** names, int count)
+{
+  struct workQueue queue = { vol, fn, names, NULL, count, 0, 0 };
+  return runQueue(vol, &queue);
+}
+
+
+// Run job(0) to job(count - 1) on the worker pool
+int runJobs(struct msf_volume* vol, int (*job)(struct msf_volume* vol, int i), int count)
+{
+  struct workQueue queue = { vol, NULL, NULL, job, count, 0, 0 };
+  return runQueue(vol, &queue);
+}
+
+
+// Give filename a directory entry and a new inode for size bytes laid
+// out as flags says, with nothing stored yet. Called with fs_lock held.
+// Returns the inode, with its directory entry in *entry, or MSF_EEXIST,
+// MSF_EDIRFULL or MSF_ENOINODE
+int32_t createFile(struct msf_volume* vol, const char* filename, uint64_t size, uint8_t flags, int32_t* entry)
+{
+  uint32_t name_len = strlen(filename);
+
+  if(findDirectoryEntry(vol, filename) != -1)
+  {
+    return MSF_EEXIST;
+  }
+
+  //find an empty directory
+  int32_t directory_entry = findFreeDirectoryEntry(vol);
+  if(directory_entry == -1)
+  {
+    return MSF_EDIRFULL;
+  }
+
+  // find a free inode from our inode map
+  int32_t inode_index = findFreeInode(vol);
+  if(inode_index == -1)
+  {
+    releaseDirectoryEntry(vol, directory_entry);
+    return MSF_ENOINODE;
+  }
+
+
+  // place the file info in the directory and index it
+  vol->directory[directory_entry].in_use = 1;
+  vol->directory[directory_entry].inode = inode_index;
+  vol->directory[directory_entry].name_len = name_len;
+  vol->directory[directory_entry].hash = hashFilename(filename, name_len);
+  // callers have already turned away names longer than MSF_NAME_MAX
+  memcpy(vol->directory[directory_entry].filename, filename, name_len);
+  vol->directory[directory_entry].filename[name_len] = '\0';
+  markDirtyRange(vol, &vol->directory[directory_entry], sizeof(struct directoryEntry));
+  addDirectoryIndex(vol, directory_entry);
+
+
+  // Take our found free indoe and set file size and set unavailable
+  vol->inodes[inode_index].file_size = size;
+  vol->inodes[inode_index].in_use = 1;
+  vol->inodes[inode_index].flags = flags;
+  markDirtyRange(vol, &vol->inodes[inode_index], sizeof(struct inode));
+
+  *entry = directory_entry;
+  return inode_index;
+}
+
+
+// insert a file into system
+int insert(struct msf_volume* vol, char* filename)
+{
+  // verify filename is not NULL
+  if(filename == NULL)
+  {
+    printf("ERROR: Filename is Null\n");
+    return -1;
+  }
+
+
+  // verify the file exists
+  struct stat buf;
+  int ret = stat(filename, &buf);
+  if(ret == -1)
+  {
+    printf("ERROR: File does not exist\n");
+    return -1;
+  }
+
+
+  //verify the file is not bigger than the whole data region
+  if((uint64_t) buf.st_size > (uint64_t) vol->num_data_blocks * vol->block_size)
+  {
+    printf("ERROR: File is too large\n");
+    return -1;
+  }
+
+
+  if(strlen(filename) > MSF_NAME_MAX)
+  {
+    printf("ERROR: Filename is too long\n");
+    return -1;
+  }
+
+
+  // Open the input file read-only
+  int ifd = open(filename, O_RDONLY);
+  if(ifd == -1)
+  {
+    printf("ERROR: Could not open the input file\n");
+    return -1;
+  }
+
+
+  // From here until the blocks are reserved we are changing
+  // metadata that other insert workers share with us
+  pthread_mutex_lock(&vol->fs_lock);
+
+
+  //verify there is enough space
+  // a compressed or deduplicated file may well fit where the raw one
+  // would not, and runs out of space cleanly if it does not
+  if(!(vol->superblock->features & (FEATURE_COMPRESS | FEATURE_DEDUP)) && (uint64_t) buf.st_size > df(vol))
+  {
+    printf("ERROR: Not enough free disk space\n");
+    pthread_mutex_unlock(&vol->fs_lock);
+    close(ifd);
+    return -1;
+  }
+
+
+  // Save off the size of the input file since we'll use it in a couple of places
+  uint64_t copy_size = buf.st_size;
+
+
+  // A tiny file goes entirely in its inode. Otherwise it is compressed
+  // when the image asks for it, or with tail packing a short last block
+  // goes in the inode's tail and the rest in data blocks
+  uint8_t flags = 0;
+  uint64_t block_bytes = copy_size;
+
+  if(copy_size <= INLINE_MAX)
+  {
+    flags = INODE_INLINE;
+    block_bytes = 0;
+  }
+  else if(vol->superblock->features & FEATURE_COMPRESS)
+  {
+    flags = INODE_COMPRESSED;
+    block_bytes = 0;
+  }
+  else if((vol->superblock->features & FEATURE_TAIL_PACK) &&
+          copy_size % vol->block_size != 0 && copy_size % vol->block_size <= INODE_TAIL_SIZE)
+  {
+    flags = INODE_TAIL;
+    block_bytes = copy_size - copy_size % vol->block_size;
+  }
+
+  // Number of blocks the file needs, rounding up for a partial last block.
+  // With dedup they are found or taken as the file is read instead
+  int dedup = (vol->superblock->features & FEATURE_DEDUP) != 0;
+  uint32_t blocks_needed = dedup ? 0 : (block_bytes + vol->block_size - 1) / vol->block_size;
+
+
+  int32_t directory_entry;
+  int32_t inode_index = createFile(vol, filename, copy_size, flags, &directory_entry);
+  if(inode_index < 0)
+  {
+    if(inode_index == MSF_EEXIST)
+    {
+      printf("ERROR: File already exists\n");
+    }
+    else if(inode_index == MSF_EDIRFULL)
+    {
+      printf("ERROR: Could not find a free directory entry\n");
+    }
+    else
+    {
+      printf("ERROR: Can not find a free inode\n");
+    }
+
+    pthread_mutex_unlock(&vol->fs_lock);
+    close(ifd);
+    return -1;
+  }
+  printf("Reading %lld bytes from %s\n", (long long) copy_size, filename);
+
+
+  // Reserve every block the file needs up front, then pull the
+  // whole file straight into those blocks without the lock
+  int failed = 0;
+  if(reserveExtents(vol, inode_index, blocks_needed) == -1)
+  {
+    printf("ERROR: Not enough contiguous free space for the file\n");
+    failed = 1;
+  }
+  else
+  {
+    pthread_mutex_unlock(&vol->fs_lock);
+    posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if(flags & INODE_COMPRESSED)
+    {
+      failed = readClusters(vol, ifd, inode_index, copy_size) == -1;
+    }
+    else if(dedup)
+    {
+      failed = readDeduped(vol, ifd, inode_index, block_bytes) == -1;
+    }
+    else if(readExtents(vol, ifd, inode_index, block_bytes) == -1)
+    {
+      printf("ERROR: An error occured reading from the input file\n");
+      failed = 1;
+    }
+
+    // whatever did not go in blocks goes in the inode, which was
+    // already marked dirty above
+    if(!failed && (flags & (INODE_INLINE | INODE_TAIL)) && copy_size > block_bytes)
+    {
+      uint64_t start;
+      struct iovec iov;
+      iov.iov_base = inodeData(vol, inode_index, &start);
+      iov.iov_len = copy_size - block_bytes;
+
+      if(readFullv(ifd, &iov, 1, block_bytes) == -1)
+      {
+        printf("ERROR: An error occured reading from the input file\n");
+        failed = 1;
+      }
+    }
+
+    if(failed)
+    {
+      pthread_mutex_lock(&vol->fs_lock);
+    }
+  }
+
+
+  // Something went wrong part way through, so give back
+  // everything we took for this file
+  if(failed)
+  {
+    removeFile(vol, directory_entry);
+    pthread_mutex_unlock(&vol->fs_lock);
+  }
+
+  // We are done copying from the input file so close it out
+  close(ifd);
+  return failed ? -1 : 0;
+}
+
+
+// Copy len bytes at offset of the image file to the end of out_fd inside
+// the kernel, with copy_file_range or failing that sendfile. Returns how
+// many bytes were copied, the caller writes whatever is left itself
+size_t copyFromImage(int img_fd, off_t offset, int out_fd, size_t len)
+{
+  size_t copied = 0;
+
+  while(copied < len)
+  {
+    ssize_t n = copy_file_range(img_fd, &offset, out_fd, NULL, len - copied, 0);
+    if(n == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if(n <= 0)
+    {
+      break;
+    }
+
+    STAT_ADD(stats.host_bytes_copied, n);
+    copied += n;
+  }
+
+  // copy_file_range is not supported between every pair of files
+  while(copied < len)
+  {
+    ssize_t n = sendfile(out_fd, img_fd, &offset, len - copied);
+    if(n == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if(n <= 0)
+    {
+      break;
+    }
+
+    STAT_ADD(stats.host_bytes_copied, n);
+    copied += n;
+  }
+
+  return copied;
+}
+
+
+// retrieve a file and place it into CWD. The file's extents are gathered
+// into an iovec list and written with writev. Extents whose blocks are
+// the same in the image file as in memory are instead copied from the
+// image file by the kernel, so their bytes never pass through user space
+// and are not checked against their checksums unless already in memory
+int retrieve(struct msf_volume* vol, char* filename, char* new_filename)
+{
+  int directory_location = findDirectoryEntry(vol, filename);
+
+
+  if(directory_location == -1)
+  {
+    printf("ERROR: File not found\n");
+    return -1;
+  }
+
+
+  int file_inode = vol->directory[directory_location].inode;
+
+
+  if(new_filename == NULL)
+  {
+    new_filename = filename;
+  }
+
+  int ofd = open(new_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(ofd == -1)
+  {
+    printf("ERROR: Could not open the specified file\n");
+    return -1;
+  }
+
+
+  // A mapped image is always current in the page cache. Otherwise the
+  // image file is only current for blocks written since the last savefs
+  int img_fd = vol->image_mapped ? vol->image_fd : open(vol->image_name, O_RDONLY);
+
+
+  // Record the file size to know how many bytes to copy
+  uint64_t copy_size = vol->inodes[file_inode].file_size;
+
+  struct iovec iov[IOV_BATCH];
+  int count = 0;
+  int failed = 0;
+  int damaged = 0; // the file itself is bad, already reported
+
+  // a compressed file comes out a cluster at a time, each expanded
+  // into the same buffer, so it is copied into a pipe that writes it
+  // out behind us while the next one is expanded
+  if(vol->inodes[file_inode].flags & INODE_COMPRESSED)
+  {
+    struct ioPipe pipe;
+    uint64_t offset = 0;
+
+    int opened = pipeOpen(&pipe, ofd, 1, copy_size, (size_t) CLUSTER_BLOCKS(vol) * vol->block_size) == 0;
+
+    failed = !opened;
+    while(offset < copy_size && !failed)
+    {
+      uint8_t* span;
+      size_t room;
+      size_t len = fileSpan(vol, file_inode, offset, &span);
+      uint8_t* buf = pipeGet(&pipe, &room);
+
+      damaged = len == 0;
+      failed = damaged || buf == NULL;
+      if(!failed)
+      {
+        memcpy(buf, span, len);
+        pipePut(&pipe, len);
+        offset += len;
+      }
+    }
+
+    if(opened && pipeClose(&pipe) == -1)
+    {
+      failed = 1;
+    }
+
+    copy_size = 0;
+  }
+
+  uint32_t k;
+  for(k = 0; k < vol->inodes[file_inode].num_extents && copy_size > 0 && !failed; k++)
+  {
+    // Save off the current extent within our inode that has our data
+    struct extent* ext = extentAt(vol, file_inode, k);
+    size_t num_bytes = (size_t) ext->length * vol->block_size;
+    size_t copied = 0;
+
+    if(copy_size < num_bytes)
+    {
+      num_bytes = copy_size;
+    }
+
+    uint32_t length;
+    uint32_t last = ext->start + (num_bytes + vol->block_size - 1) / vol->block_size;
+    int zero_copy = img_fd != -1 &&
+                    (vol->image_mapped || findSetRun(vol->dirty_blocks, last, ext->start, &length) == -1);
+
+    // Blocks are checked on their way through memory. The kernel copies
+    // the others, and they are only checked if they are in memory anyway
+    // since paging them in would undo the zero copy. Scrub checks them
+    int verified = !zero_copy || blocksResident(vol, ext->start, last - ext->start);
+    if(verified && verifyBlocks(vol, ext->start, last - ext->start) == -1)
+    {
+      failed = damaged = 1;
+      break;
+    }
+
+    if(zero_copy)
+    {
+      // everything gathered so far has to land in the file first
+      failed = writeFullv(ofd, iov, count) == -1;
+      count = 0;
+
+      if(!failed)
+      {
+        copied = copyFromImage(img_fd, (off_t) ext->start * vol->block_size, ofd, num_bytes);
+      }
+    }
+
+    // the gather list is full, so write it out before adding to it
+    if(copied < num_bytes && count == IOV_BATCH)
+    {
+      failed = writeFullv(ofd, iov, count) == -1;
+      count = 0;
+    }
+
+    // what the kernel did not copy comes from memory after all
+    uint32_t rest = ext->start + copied / vol->block_size;
+    if(copied < num_bytes && !verified && verifyBlocks(vol, rest, last - rest) == -1)
+    {
+      failed = damaged = 1;
+      break;
+    }
+
+    if(copied < num_bytes)
+    {
+      iov[count].iov_base = BLOCK(vol, ext->start) + copied;
+      iov[count].iov_len = num_bytes - copied;
+      count++;
+    }
+
+    copy_size -= num_bytes;
+  }
+
+  // what is left is kept in the inode itself
+  if(copy_size > 0 && !failed)
+  {
+    if(count == IOV_BATCH)
+    {
+      failed = writeFullv(ofd, iov, count) == -1;
+      count = 0;
+    }
+
+    uint64_t start;
+    iov[count].iov_base = inodeData(vol, file_inode, &start);
+    iov[count].iov_len = copy_size;
+    count++;
+  }
+
+  if(!failed)
+  {
+    failed = writeFullv(ofd, iov, count) == -1;
+  }
+
+  if(failed && !damaged)
+  {
+    printf("ERROR: An error occurred writing to the specified file\n");
+  }
+
+  if(img_fd != -1 && !vol->image_mapped)
+  {
+    close(img_fd);
+  }
+
+  close(ofd);
+  return failed ? -1 : 0;
+}
+
+
+// Encode len bytes as two lower case hex digits each into out. With SSE2
+// we split 16 bytes at a time into nibbles, interleave them high nibble
+// first and turn them into digits with a compare and two adds
+void hexEncode(const uint8_t* in, size_t len, char* out)
+{
+  static const char digits[] = "0123456789abcdef";
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i letters = _mm_set1_epi8('a' - '0' - 10);
+
+  for(; i + 16 <= len; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*) (in + i));
+    __m128i lo = _mm_and_si128(v, mask);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+
+    __m128i a = _mm_unpacklo_epi8(hi, lo);
+    __m128i b = _mm_unpackhi_epi8(hi, lo);
+
+    a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), letters));
+    b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), letters));
+
+    _mm_storeu_si128((__m128i*) (out + 2 * i), a);
+    _mm_storeu_si128((__m128i*) (out + 2 * i + 16), b);
+  }
+#endif
+
+  for(; i < len; i++)
+  {
+    out[2 * i] = digits[in[i] >> 4];
+    out[2 * i + 1] = digits[in[i] & 0x0f];
+  }
+}
+
+
+#define HEX_CHUNK 32768 // bytes encoded per write to stdout
+
+// Read a specified number of bytes and print their hex value, two
+// digits per byte. The range is walked a contiguous span at a time and
+// encoded straight from the data blocks into a buffer that goes out
+// with one fwrite per HEX_CHUNK bytes
+int read_bytes(struct msf_volume* vol, char* filename, uint64_t start_byte, uint64_t req_num_bytes)
+{
+  int file_location = findDirectoryEntry(vol, filename);
+
+
+  if(file_location == -1)
+  {
+    printf("ERROR: File not found\n");
+    return -1;
+  }
+
+
+  if(req_num_bytes == 0)
+  {
+    printf("ERROR: No bytes to read\n");
+    return -1;
+  }
+
+  
+  int32_t file_inode = vol->directory[file_location].inode;
+  if(req_num_bytes > vol->inodes[file_inode].file_size)
+  {
+    printf("ERROR: Request exceeds file size\n");
+    return -1;
+  }
+
+
+  // start_byte + req_num_bytes could wrap, so compare what is left
+  uint64_t file_size = vol->inodes[file_inode].file_size;
+  if(start_byte > file_size || req_num_bytes > file_size - start_byte)
+  {
+    printf("ERROR: Specifications of request exceed file size\n");
+    return -1;
+  }
+
+
+  static char hex[2 * HEX_CHUNK];
+  uint64_t offset = start_byte;
+  uint64_t remaining_bytes = req_num_bytes;
+
+  while(remaining_bytes > 0)
+  {
+    uint8_t* span;
+    size_t span_len = fileSpan(vol, file_inode, offset, &span);
+
+    if(span_len == 0)
+    {
+      printf("\nERROR: The file is damaged\n");
+      return -1;
+    }
+
+    if(span_len > remaining_bytes)
+    {
+      span_len = remaining_bytes;
+    }
+
+    if(span_len > HEX_CHUNK)
+    {
+      span_len = HEX_CHUNK;
+    }
+
+    hexEncode(span, span_len, hex);
+    fwrite(hex, 2, span_len, stdout);
+
+    offset += span_len;
+    remaining_bytes -= span_len;
+  }
+  printf("\n");
+
+  return 0;
+}
+
+
+// Write the contents of the host file source into filename at offset,
+// or at its end with append, creating it first if it is not there.
+// Only the blocks the bytes land in are touched, so changing a little
+// of a big file costs a little. The source comes in through a pipe, the
+// next piece read while this one is written. A file made for the write
+// is removed again if the write fails
+int write_bytes(struct msf_volume* vol, char* filename, uint64_t offset, char* source, int append)
+{
+  if(strlen(filename) > MSF_NAME_MAX)
+  {
+    printf("ERROR: Filename is too long\n");
+    return -1;
+  }
+
+  int ifd = open(source, O_RDONLY);
+  struct stat buf;
+  if(ifd == -1 || fstat(ifd, &buf) == -1)
+  {
+    printf("ERROR: Could not open the input file\n");
+    if(ifd != -1)
+    {
+      close(ifd);
+    }
+    return -1;
+  }
+
+  pthread_mutex_lock(&vol->fs_lock);
+  int32_t entry = findDirectoryEntry(vol, filename);
+  int created = entry == -1;
+  int32_t inode = !created ? vol->directory[entry].inode : createFile(vol, filename, 0, INODE_INLINE, &entry);
+  if(inode > 0 && append)
+  {
+    offset = vol->inodes[inode].file_size;
+  }
+  pthread_mutex_unlock(&vol->fs_lock);
+
+  if(inode < 0)
+  {
+    printf("ERROR: %s\n", msf_strerror(inode));
+    close(ifd);
+    return -1;
+  }
+
+  int status = MSF_OK;
+  uint64_t done = 0;
+
+  struct ioPipe pipe;
+  if(pipeOpen(&pipe, ifd, 0, buf.st_size, PIPE_CHUNK) == -1)
+  {
+    printf("ERROR: Not enough memory to read the file\n");
+    status = MSF_ENOMEM;
+  }
+
+  while(status == MSF_OK && done < (uint64_t) buf.st_size)
+  {
+    size_t len;
+    uint8_t* bytes = pipeGet(&pipe, &len);
+    if(bytes == NULL)
+    {
+      printf("ERROR: An error occured reading from the input file\n");
+      status = MSF_EIO;
+      break;
+    }
+
+    pthread_mutex_lock(&vol->fs_lock);
+    status = writeFileRange(vol, inode, bytes, offset + done, len);
+    pthread_mutex_unlock(&vol->fs_lock);
+
+    if(status != MSF_OK)
+    {
+      printf("ERROR: %s\n", msf_strerror(status));
+    }
+
+    pipePut(&pipe, 0);
+    done += len;
+  }
+
+  if(status != MSF_ENOMEM && pipeClose(&pipe) == -1 && status == MSF_OK)
+  {
+    printf("ERROR: An error occured reading from the input file\n");
+    status = MSF_EIO;
+  }
+  close(ifd);
+
+  // nothing is left behind of a file that was only made for this write
+  if(status != MSF_OK && created)
+  {
+    pthread_mutex_lock(&vol->fs_lock);
+    removeFile(vol, entry);
+    pthread_mutex_unlock(&vol->fs_lock);
+  }
+
+  return status == MSF_OK ? 0 : -1;
+}
+
+
+// Cut a file down to size bytes, or grow it to size with zeros
+int truncate_file(struct msf_volume* vol, char* filename, uint64_t size)
+{
+  int32_t entry = findDirectoryEntry(vol, filename);
+  if(entry == -1)
+  {
+    printf("ERROR: File not found\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&vol->fs_lock);
+  int status = truncateFile(vol, vol->directory[entry].inode, size);
+  pthread_mutex_unlock(&vol->fs_lock);
+
+  if(status != MSF_OK)
+  {
+    printf("ERROR: %s\n", msf_strerror(status));
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Delete a file, handing its blocks, inode and directory entry back
+int del(struct msf_volume* vol, char* filename)
+{
+  int32_t entry = findDirectoryEntry(vol, filename);
+  if(entry == -1)
+  {
+    printf("ERROR: File not found\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&vol->fs_lock);
+  removeFile(vol, entry);
+  pthread_mutex_unlock(&vol->fs_lock);
+  return 0;
+}
+
+
+// insert every host file named by paths, a NULL terminated list of
+// names and glob patterns, on the worker pool
+int insertMany(struct msf_volume* vol, char** paths)
+{
+  glob_t found;
+  int flags = GLOB_NOCHECK;
+
+  // a pattern matching nothing is kept as is, so insert
+  // reports it as a file that does not exist
+  int i;
+  for(i = 0; paths[i] != NULL; i++)
+  {
+    glob(paths[i], flags, NULL, &found);
+    flags |= GLOB_APPEND;
+  }
+
+  int status = runWorkers(vol, insert, found.gl_pathv, found.gl_pathc);
+
+  globfree(&found);
+  return status;
+}
+
+
+int retrieveOwnName(struct msf_volume* vol, char* filename)
+{
+  return retrieve(vol, filename, NULL);
+}
+
+
+// retrieve every file in the image matching one of patterns, a NULL
+// terminated list, under its own name on the worker pool
+int retrieveMany(struct msf_volume* vol, char** patterns)
+{
+  char (*names)[64] = malloc(vol->num_files * sizeof(*names));
+  char** list = (char**) malloc(vol->num_files * sizeof(char*));
+  int count = 0;
+  int status = 0;
+
+  int i;
+  for(i = 0; patterns[i] != NULL; i++)
+  {
+    int matched = 0;
+
+    int j;
+    for(j = 0; j < vol->num_files && count < vol->num_files; j++)
+    {
+      if(vol->directory[j].in_use &&
+         fnmatch(patterns[i], vol->directory[j].filename, 0) == 0)
+      {
+        strncpy(names[count], vol->directory[j].filename, 64);
+        names[count][63] = '\0';
+        list[count] = names[count];
+        count++;
+        matched = 1;
+      }
+    }
+
+    if(!matched)
+    {
+      printf("ERROR: File not found: %s\n", patterns[i]);
+      status = -1;
+    }
+  }
+
+  if(runWorkers(vol, retrieveOwnName, list, count) == -1)
+  {
+    status = -1;
+  }
+
+  free(names);
+  free(list);
+  return status;
+}
+
+
+// scrub checks a whole image: every data block in use against its
+// checksum, and the directory, inodes and free maps against each other.
+// The inodes and then the blocks are split into chunks that run on the
+// worker pool, and the directory is checked last on the calling thread
+#define SCRUB_CHUNK 4096       // inodes or blocks per scrub job
+#define SCRUB_MAX_REPORTS 32   // problems printed before scrub only counts them
+
+
+// Report a problem, printed whole so workers do not interleave
+void scrubProblem(struct msf_volume* vol, const char* format, ...)
+{
+  if(__atomic_fetch_add(&vol->scrub_problems, 1, __ATOMIC_RELAXED) >= SCRUB_MAX_REPORTS)
+  {
+    return;
+  }
+
+  char message[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  printf("ERROR: %s\n", message);
+}
+
+
+int isDataBlock(struct msf_volume* vol, int64_t block)
+{
+  return block >= vol->first_data_block && block < vol->num_blocks;
+}
+
+
+// Count a reference from an inode to each of length blocks from start
+void scrubReference(struct msf_volume* vol, int32_t inode, int64_t start, int64_t length)
+{
+  if(length <= 0 || !isDataBlock(vol, start) || !isDataBlock(vol, start + length - 1))
+  {
+    scrubProblem(vol, "Inode %d points outside the data blocks", inode);
+    return;
+  }
+
+  int64_t b;
+  for(b = start; b < start + length; b++)
+  {
+    __atomic_fetch_add(&vol->scrub_refs[b - vol->first_data_block], 1, __ATOMIC_RELAXED);
+  }
+}
+
+
+// Check the inodes of one chunk against the inode map and each other,
+// and count the blocks they use
+int scrubInodes(struct msf_volume* vol, int job)
+{
+  int32_t first = job * SCRUB_CHUNK + 1;
+  int32_t last = first + SCRUB_CHUNK - 1;
+  if(last > (int32_t) vol->num_files)
+  {
+    last = vol->num_files;
+  }
+
+  int32_t i;
+  for(i = first; i <= last; i++)
+  {
+    struct inode* node = &vol->inodes[i];
+    int mapped = (vol->used_inodes[(i - 1) / BITS_PER_WORD] >> ((i - 1) % BITS_PER_WORD)) & 1;
+
+    if(!!node->in_use != mapped)
+    {
+      scrubProblem(vol, "Inode %d is %s but the inode map says otherwise", i, node->in_use ? "in use" : "free");
+    }
+
+    if(!node->in_use)
+    {
+      continue;
+    }
+
+    if(node->flags & INODE_INLINE)
+    {
+      if(node->num_extents != 0 || node->file_size > INLINE_MAX)
+      {
+        scrubProblem(vol, "Inline inode %d has blocks or is too large", i);
+      }
+      continue;
+    }
+
+    // the blocks listing extents have to be sound before extentAt
+    // can be trusted with them. A double indirect block is only kept
+    // while there are extents past the indirect ones to list
+    uint32_t extents = node->num_extents;
+    if(extents > MAX_EXTENTS(vol) ||
+       (extents > NUM_EXTENTS && !isDataBlock(vol, node->indirect)) ||
+       (extents > NUM_EXTENTS + EXTENTS_PER_BLOCK(vol) && !isDataBlock(vol, node->double_indirect)) ||
+       (extents <= NUM_EXTENTS + EXTENTS_PER_BLOCK(vol) && node->double_indirect != 0))
+    {
+      scrubProblem(vol, "Inode %d has a damaged extent list", i);
+      continue;
+    }
+
+    if(node->indirect)
+    {
+      scrubReference(vol, i, node->indirect, 1);
+    }
+
+    if(node->double_indirect)
+    {
+      uint32_t* extent_blocks = (uint32_t*) BLOCK(vol, node->double_indirect);
+      uint32_t used = extents - NUM_EXTENTS - EXTENTS_PER_BLOCK(vol);
+      uint32_t j;
+
+      scrubReference(vol, i, node->double_indirect, 1);
+      for(j = 0; j < (used + EXTENTS_PER_BLOCK(vol) - 1) / EXTENTS_PER_BLOCK(vol); j++)
+      {
+        if(!isDataBlock(vol, extent_blocks[j]))
+        {
+          scrubProblem(vol, "Inode %d has a damaged extent list", i);
+          extents = NUM_EXTENTS + EXTENTS_PER_BLOCK(vol) + j * EXTENTS_PER_BLOCK(vol);
+          break;
+        }
+        scrubReference(vol, i, extent_blocks[j], 1);
+      }
+    }
+
+    // extents run in file order with no gaps, and a compressed file
+    // has one per cluster
+    int compressed = node->flags & INODE_COMPRESSED;
+    uint64_t covered = 0;
+    uint32_t k;
+    for(k = 0; k < extents; k++)
+    {
+      struct extent* ext = extentAt(vol, i, k);
+      uint64_t expected = compressed ? (uint64_t) k * CLUSTER_BLOCKS(vol) : covered;
+
+      if(ext->logical != expected)
+      {
+        scrubProblem(vol, "Extent %u of inode %d is out of place", k, i);
+      }
+
+      scrubReference(vol, i, ext->start, ext->length);
+      covered = expected + (compressed ? CLUSTER_BLOCKS(vol) : (uint64_t) ext->length);
+    }
+
+    uint64_t needed = (node->flags & INODE_TAIL) ? node->file_size / vol->block_size
+                                                  : (node->file_size + vol->block_size - 1) / vol->block_size;
+    if(compressed)
+    {
+      uint64_t cluster_bytes = (uint64_t) CLUSTER_BLOCKS(vol) * vol->block_size;
+      if(extents != (node->file_size + cluster_bytes - 1) / cluster_bytes)
+      {
+        scrubProblem(vol, "Inode %d has %u clusters for %llu bytes", i, extents,
+                     (unsigned long long) node->file_size);
+      }
+    }
+    else if(covered != needed)
+    {
+      scrubProblem(vol, "Inode %d has %llu blocks for %llu bytes", i,
+                   (unsigned long long) covered, (unsigned long long) node->file_size);
+    }
+  }
+
+  return 0;
+}
+
+
+// Check the data blocks of one chunk against the block map, their
+// reference counts and their checksums
+int scrubBlocks(struct msf_volume* vol, int job)
+{
+  uint32_t first = vol->first_data_block + job * SCRUB_CHUNK;
+  uint32_t last = first + SCRUB_CHUNK;
+  if(last > vol->num_blocks)
+  {
+    last = vol->num_blocks;
+  }
+
+  uint64_t checked = 0;
+  uint64_t unsaved = 0;
+  uint64_t used = 0;
+  uint64_t shared = 0;
+
+  uint32_t b;
+  for(b = first; b < last; b++)
+  {
+    uint32_t index = b - vol->first_data_block;
+    uint32_t refs = vol->scrub_refs[index];
+    int in_use = (vol->used_blocks[index / BITS_PER_WORD] >> (index % BITS_PER_WORD)) & 1;
+
+    if(in_use && refs == 0)
+    {
+      scrubProblem(vol, "Block %u is marked in use but no file uses it", b);
+    }
+    else if(!in_use && refs > 0)
+    {
+      scrubProblem(vol, "Block %u is used by a file but marked free", b);
+    }
+    else if(vol->refcounts != NULL ? refs != vol->refcounts[index] : refs > 1)
+    {
+      scrubProblem(vol, "Block %u is used %u times but counted %u times", b, refs,
+                   vol->refcounts != NULL ? vol->refcounts[index] : 1);
+    }
+
+    if(!in_use)
+    {
+      continue;
+    }
+
+    used++;
+    shared += refs > 1 ? refs - 1 : 0;
+
+    if((vol->dirty_blocks[b / BITS_PER_WORD] >> (b % BITS_PER_WORD)) & 1)
+    {
+      unsaved++;
+    }
+
+    if(crc32c(0, BLOCK(vol, b), vol->block_size) != vol->checksums[index])
+    {
+      scrubProblem(vol, "Block %u failed its checksum", b);
+      STAT_ADD(stats.checksum_errors, 1);
+      continue;
+    }
+
+    __atomic_fetch_or(&vol->verified_blocks[b / BITS_PER_WORD], 1ULL << (b % BITS_PER_WORD), __ATOMIC_RELAXED);
+    checked++;
+  }
+
+  STAT_ADD(stats.blocks_verified, checked);
+  __atomic_fetch_add(&vol->scrub_checked, checked, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&vol->scrub_unsaved, unsaved, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&vol->scrub_used, used, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&vol->scrub_shared, shared, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+// Check that every directory entry in use names an inode in use that no
+// other entry names, can be found through the directory index, and that
+// every inode in use has an entry. Returns the number of files
+uint32_t scrubDirectory(struct msf_volume* vol)
+{
+  uint8_t* owners = (uint8_t*) calloc(vol->num_files + 1, 1);
+  uint32_t files = 0;
+  uint32_t inodes_used = 0;
+
+  uint32_t e;
+  for(e = 0; e < vol->num_files; e++)
+  {
+    struct directoryEntry* entry = &vol->directory[e];
+    int mapped = (vol->used_entries[e / BITS_PER_WORD] >> (e % BITS_PER_WORD)) & 1;
+
+    if(!!entry->in_use != mapped)
+    {
+      scrubProblem(vol, "Directory entry %u is %s but the entry map says otherwise", e,
+                   entry->in_use ? "in use" : "free");
+    }
+
+    if(!entry->in_use)
+    {
+      continue;
+    }
+
+    files++;
+
+    if(entry->inode < 1 || entry->inode > (int32_t) vol->num_files || !vol->inodes[entry->inode].in_use)
+    {
+      scrubProblem(vol, "Directory entry %u points at inode %d, which is not in use", e, entry->inode);
+    }
+    else if(owners[entry->inode]++)
+    {
+      scrubProblem(vol, "Inode %d belongs to more than one directory entry", entry->inode);
+    }
+
+    char name[sizeof(entry->filename) + 1];
+    uint32_t len = entry->name_len < sizeof(entry->filename) ? entry->name_len : sizeof(entry->filename);
+    memcpy(name, entry->filename, len);
+    name[len] = '\0';
+
+    if(findDirectoryEntry(vol, name) != (int32_t) e)
+    {
+      scrubProblem(vol, "Directory entry %u is missing from the directory index", e);
+    }
+  }
+
+  uint32_t i;
+  for(i = 1; i <= vol->num_files; i++)
+  {
+    if(vol->inodes[i].in_use)
+    {
+      inodes_used++;
+      if(!owners[i])
+      {
+        scrubProblem(vol, "Inode %u is in use but in no directory entry", i);
+      }
+    }
+  }
+
+  if(inodes_used != vol->used_count->inodes)
+  {
+    scrubProblem(vol, "%u inodes are in use but %u are counted", inodes_used, vol->used_count->inodes);
+  }
+
+  free(owners);
+  return files;
+}
+
+
+// scrub, also fsck. Returns -1 if anything is wrong
+int scrub(struct msf_volume* vol)
+{
+  if(!vol->image_open)
+  {
+    printf("ERROR: Disk image is not open\n");
+    return -1;
+  }
+
+  vol->scrub_refs = (uint32_t*) calloc(vol->num_data_blocks, sizeof(uint32_t));
+  if(vol->scrub_refs == NULL)
+  {
+    printf("ERROR: Not enough memory to scrub the image\n");
+    return -1;
+  }
+
+  vol->scrub_problems = 0;
+  vol->scrub_checked = 0;
+  vol->scrub_unsaved = 0;
+  vol->scrub_used = 0;
+  vol->scrub_shared = 0;
+
+  runJobs(vol, scrubInodes, (vol->num_files + SCRUB_CHUNK - 1) / SCRUB_CHUNK);
+  runJobs(vol, scrubBlocks, (vol->num_data_blocks + SCRUB_CHUNK - 1) / SCRUB_CHUNK);
+  uint32_t files = scrubDirectory(vol);
+
+  if(vol->scrub_used != vol->used_count->blocks)
+  {
+    scrubProblem(vol, "%llu blocks are in use but %u are counted",
+                 (unsigned long long) vol->scrub_used, vol->used_count->blocks);
+  }
+
+  if(vol->refcounts != NULL && vol->scrub_shared != vol->used_count->shared)
+  {
+    scrubProblem(vol, "%llu block references are shared but %u are counted",
+                 (unsigned long long) vol->scrub_shared, vol->used_count->shared);
+  }
+
+  free(vol->scrub_refs);
+  vol->scrub_refs = NULL;
+
+  printf("%u files, %llu blocks in use, %llu checksums verified, %llu blocks not saved yet\n",
+         files, (unsigned long long) vol->scrub_used, (unsigned long long) vol->scrub_checked,
+         (unsigned long long) vol->scrub_unsaved);
+  printf("%llu problems found\n", (unsigned long long) vol->scrub_problems);
+
+  return vol->scrub_problems ? -1 : 0;
+}
+
+
+// Print a histogram, one line per non-empty bucket
+void printHistogram(const uint64_t* buckets, const char* unit)
+{
+  for(int i = 0; i < STAT_BUCKETS; i++)
+  {
+    if(buckets[i] == 0)
+    {
+      continue;
+    }
+
+    uint64_t low = i ? 1ULL << (i - 1) : 0;
+    printf("    [%llu, %llu) %s: %llu\n", (unsigned long long) low,
+           (unsigned long long) (1ULL << i), unit, (unsigned long long) buckets[i]);
+  }
+}
+
+
+void printJsonBuckets(const uint64_t* buckets)
+{
+  printf("[");
+  for(int i = 0; i < STAT_BUCKETS; i++)
+  {
+    printf("%s%llu", i ? "," : "", (unsigned long long) buckets[i]);
+  }
+  printf("]");
+}
+
+
+// **stats**
+// Print what the shell has done since it started or since the
+// last "stats reset". With json it is one object on one line
+int printStats(struct msf_volume* vol, int json)
+{
+  if(json)
+  {
+    printf("{\"ops\":{");
+    for(int i = 0; i < NUM_OPS; i++)
+    {
+      struct opStats* op = &stats.ops[i];
+      printf("%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"total_ns\":%llu,"
+             "\"max_ns\":%llu,\"latency_us_log2\":", i ? "," : "", op_names[i],
+             (unsigned long long) op->count, (unsigned long long) op->errors,
+             (unsigned long long) op->total_ns, (unsigned long long) op->max_ns);
+      printJsonBuckets(op->buckets);
+      printf("}");
+    }
+
+    printf("},\"host\":{\"reads\":%llu,\"bytes_read\":%llu,\"writes\":%llu,"
+           "\"bytes_written\":%llu,\"bytes_copied\":%llu,\"syncs\":%llu}",
+           (unsigned long long) stats.host_reads, (unsigned long long) stats.host_bytes_read,
+           (unsigned long long) stats.host_writes, (unsigned long long) stats.host_bytes_written,
+           (unsigned long long) stats.host_bytes_copied, (unsigned long long) stats.host_syncs);
+
+    printf(",\"alloc\":{\"blocks_allocated\":%llu,\"blocks_freed\":%llu,\"calls\":%llu,"
+           "\"probes\":%llu,\"probe_max\":%llu,\"probes_log2\":",
+           (unsigned long long) stats.blocks_allocated, (unsigned long long) stats.blocks_freed,
+           (unsigned long long) stats.alloc_calls, (unsigned long long) stats.alloc_probes,
+           (unsigned long long) stats.alloc_probe_max);
+    printJsonBuckets(stats.alloc_probe_buckets);
+
+    printf("},\"dir\":{\"lookups\":%llu,\"probes\":%llu}",
+           (unsigned long long) stats.dir_lookups, (unsigned long long) stats.dir_probes);
+
+    printf(",\"checksums\":{\"blocks_verified\":%llu,\"errors\":%llu}",
+           (unsigned long long) stats.blocks_verified, (unsigned long long) stats.checksum_errors);
+
+    printf(",\"compress\":{\"bytes_in\":%llu,\"bytes_stored\":%llu,\"clusters_raw\":%llu}",
+           (unsigned long long) stats.compress_in, (unsigned long long) stats.compress_out,
+           (unsigned long long) stats.clusters_raw);
+
+    printf(",\"cache\":{\"resident_bytes\":%llu,\"budget_bytes\":%llu,\"evictions\":%llu,"
+           "\"writebacks\":%llu}}\n",
+           (unsigned long long) cacheResidentBytes(vol), (unsigned long long) vol->cache_budget,
+           (unsigned long long) stats.cache_evictions, (unsigned long long) stats.cache_writebacks);
+    return 0;
+  }
+
+  printf("%-10s %10s %8s %12s %12s\n", "command", "count", "errors", "avg us", "max us");
+  for(int i = 0; i < NUM_OPS; i++)
+  {
+    struct opStats* op = &stats.ops[i];
+    if(op->count == 0)
+    {
+      continue;
+    }
+
+    printf("%-10s %10llu %8llu %12.1f %12.1f\n", op_names[i],
+           (unsigned long long) op->count, (unsigned long long) op->errors,
+           op->total_ns / 1000.0 / op->count, op->max_ns / 1000.0);
+    printHistogram(op->buckets, "us");
+  }
+
+  printf("host I/O: %llu reads, %llu bytes read, %llu writes, %llu bytes written, "
+         "%llu bytes copied, %llu syncs\n",
+         (unsigned long long) stats.host_reads, (unsigned long long) stats.host_bytes_read,
+         (unsigned long long) stats.host_writes, (unsigned long long) stats.host_bytes_written,
+         (unsigned long long) stats.host_bytes_copied, (unsigned long long) stats.host_syncs);
+
+  printf("allocator: %llu blocks allocated, %llu freed, %llu searches, "
+         "%llu words probed, %llu most in one search\n",
+         (unsigned long long) stats.blocks_allocated, (unsigned long long) stats.blocks_freed,
+         (unsigned long long) stats.alloc_calls, (unsigned long long) stats.alloc_probes,
+         (unsigned long long) stats.alloc_probe_max);
+  printHistogram(stats.alloc_probe_buckets, "words");
+
+  printf("directory: %llu lookups, %llu slots probed\n",
+         (unsigned long long) stats.dir_lookups, (unsigned long long) stats.dir_probes);
+
+  printf("checksums: %llu blocks verified, %llu errors\n",
+         (unsigned long long) stats.blocks_verified, (unsigned long long) stats.checksum_errors);
+
+  printf("compression: %llu bytes in, %llu bytes stored, %llu clusters stored raw\n",
+         (unsigned long long) stats.compress_in, (unsigned long long) stats.compress_out,
+         (unsigned long long) stats.clusters_raw);
+
+  printf("cache: %llu bytes of data in memory of %llu, %llu chunks evicted, "
+         "%llu blocks written back early\n",
+         (unsigned long long) cacheResidentBytes(vol), (unsigned long long) vol->cache_budget,
+         (unsigned long long) stats.cache_evictions, (unsigned long long) stats.cache_writebacks);
+  return 0;
+}
+
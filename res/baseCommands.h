@@ -1,7 +1,523 @@
 #ifndef __BASECOMMANDS_H__
 #define __BASECOMMANDS_H__
 
+// The filesystem itself. Everything about an open image lives in a
+// struct msf_volume that is handed to every function working on it, so
+// a process can have any number of images open at once. The shell in
+// mfs.c and libmsf in res/msf.c are both built on what is declared here
 
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
+#include "msf.h"
 
-#endif
\ No newline at end of file
+// Geometry createfs uses when it is not given one. 66,370 blocks of
+// 1 KB hold a 68 MB image with 256 files
+#define DEFAULT_BLOCK_SIZE 1024 //Bytes
+#define DEFAULT_NUM_BLOCKS 66370
+#define DEFAULT_NUM_FILES 256
+
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MAX_NUM_FILES (1 << 24)
+
+#define JOURNAL_BYTES (512 * 1024) // least size of the journal, rounded to whole blocks
+#define MIN_JOURNAL_BLOCKS 64
+
+#define DIR_SLOT_EMPTY 0        // slots hold entry + 1 so a zeroed index is empty
+#define DIR_SLOT_DELETED -1
+
+#define BITS_PER_WORD 64
+#define WORDS_FOR(bits) (((bits) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+
+// Block 0 of every image. It records the geometry the image was
+// created with, and every other part of the layout is worked out from
+// it by setGeometry:
+//
+//   block 0                superblock
+//   directory              num_files 76 byte entries
+//   inode map block(s)     inode map, used counts, directory entry map
+//   inode table            num_files + 1 inodes, slot 0 unused
+//   journal                header block, then a log that can hold every
+//                          other metadata block in one transaction
+//   block map              one bit per data block
+//   directory index        2 * num_files hash slots
+//   checksums              a CRC32C per block
+//   reference counts       with dedup, a uint16_t per block
+//   fingerprint index      with dedup, 2 * num_blocks hash slots
+//   data                   everything from first_data_block on
+#define SUPERBLOCK_MAGIC 0x5346534d // "MSFS"
+
+// optional features an image was created with
+#define FEATURE_TAIL_PACK 0x1 // short last blocks are kept in the inode
+#define FEATURE_COMPRESS  0x2 // files are stored as compressed clusters
+#define FEATURE_DEDUP     0x4 // identical blocks are stored once
+#define FEATURES_KNOWN (FEATURE_TAIL_PACK | FEATURE_COMPRESS | FEATURE_DEDUP)
+
+struct superBlock
+{
+  uint32_t magic;
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint32_t num_files;
+  uint32_t features;
+  uint32_t journal_blocks; // 0 in images whose journal is the fixed JOURNAL_BYTES
+};
+
+// Block cache state flags, one byte per cache_chunk bytes of the image
+#define CHUNK_RESIDENT   0x1
+#define CHUNK_REFERENCED 0x2
+
+#define CACHE_CHUNK 65536               // least the cache tracks and drops at once
+#define DEFAULT_CACHE_BYTES (32 << 20)  // data kept in memory unless -M says otherwise
+
+// Everything in the metadata is laid out so that all zeros is a valid
+// empty filesystem. A clear bit in a map is free, inode 0 and block 0
+// mean none, so createfs only has to zero the metadata blocks
+
+// Running totals of used blocks and inodes. These live in the inode map block
+// right behind the inode map so they are saved with the image
+// and df() never has to rescan the block map
+struct usedCount
+{
+  uint32_t blocks;
+  uint32_t inodes;
+  uint32_t shared; // references to a block beyond its first, with dedup
+};
+
+// With dedup every data block has a count of the file blocks that share
+// it. A count never goes past REFCOUNT_MAX
+#define REFCOUNT_MAX 65535
+
+// Open addressed hash table from the CRC32C of a block's contents to the
+// block, over every data block written by a dedup insert. A match is only
+// a candidate until the contents are compared
+#define FINGERPRINT_EMPTY 0 // no data block is block 0
+#define FINGERPRINT_DELETED UINT32_MAX
+
+struct fingerprint
+{
+  uint32_t crc;
+  uint32_t block;
+};
+
+// directory
+// num_files 76 byte entries from block 1 on. The hash and length of the
+// filename are stored with the entry so lookups rarely need a memcmp
+struct directoryEntry
+{
+  char     filename[64];
+  short    in_use;
+  uint16_t name_len;
+  int32_t  inode; // 0 when the entry is unused
+  uint32_t hash;
+};
+
+// A run of contiguous data blocks holding part of a file. logical is
+// the block of the file the run starts at and start the absolute block
+// number it lives at. Block 0 is the superblock so no extent starts there
+struct extent
+{
+  uint32_t logical;
+  int32_t  start;
+  int32_t  length;
+};
+
+#define NUM_EXTENTS 16 // extents held in the inode itself
+
+#define INODE_TAIL_SIZE 40 // bytes of a packed tail, rounds the inode up to 256
+
+#define INODE_INLINE     0x1 // the whole file is in the extents and tail space
+#define INODE_TAIL       0x2 // the bytes after the last full block are in tail
+#define INODE_COMPRESSED 0x4 // one extent per cluster, see readClusters
+
+// inode
+// The first NUM_EXTENTS extents of a file are kept here. Further ones go
+// in an indirect block full of extents and then in extent blocks listed
+// by a double indirect block. Extents are in file order, so the one
+// holding any offset is found with a binary search.
+// A file of up to INLINE_MAX bytes has no extents at all and lives in
+// the space they and tail would take. With tail packing, a file whose
+// last block would hold no more than INODE_TAIL_SIZE bytes keeps those
+// bytes in tail instead of spending a whole block on them
+struct inode
+{
+  struct extent extents[NUM_EXTENTS];
+  uint8_t  tail[INODE_TAIL_SIZE];
+  uint32_t num_extents;
+  uint32_t indirect;        // block of extents after the direct ones, 0 if none
+  uint32_t double_indirect; // block of extent block numbers, 0 if none
+  short    in_use;
+  uint8_t  attribute;
+  uint8_t  flags;           // INODE_INLINE, INODE_TAIL or INODE_COMPRESSED
+  uint64_t file_size;
+};
+
+#define INLINE_MAX offsetof(struct inode, num_extents)
+
+// A compressed file is cut into clusters of CLUSTER_BLOCKS blocks, each
+// compressed on its own and kept in one extent. A cluster that would not
+// save a block is stored as it is, so an extent as long as the cluster
+// is raw and a shorter one starts with a uint32_t compressed length
+#define CLUSTER_BYTES 65536
+#define CLUSTER_BLOCKS(vol) ((vol)->block_size < CLUSTER_BYTES ? CLUSTER_BYTES / (vol)->block_size : 1)
+
+#define EXTENTS_PER_BLOCK(vol) ((vol)->block_size / sizeof(struct extent))
+#define POINTERS_PER_BLOCK(vol) ((vol)->block_size / sizeof(uint32_t))
+#define MAX_EXTENTS(vol) (NUM_EXTENTS + EXTENTS_PER_BLOCK(vol) + \
+                          POINTERS_PER_BLOCK(vol) * EXTENTS_PER_BLOCK(vol))
+
+
+// Write-ahead journal. savefs writes changed data blocks to their home
+// in the image, then appends every changed metadata block to the log as
+// one transaction and only then updates the metadata in place. Data
+// blocks the image file already had in use are logged like metadata. A
+// transaction is one or more descriptor blocks, each followed by the
+// block images it lists, and a commit block. openfs replays any
+// committed transactions it finds.
+#define JOURNAL_MAGIC 0x4a53464d        // "MFSJ"
+#define JOURNAL_DESC_MAGIC 0x4453464d   // "MFSD"
+#define JOURNAL_COMMIT_MAGIC 0x4353464d // "MFSC"
+
+// Kept in journal_block. The log holds transactions numbered seq, seq + 1, ...
+// starting at its first block, anything else found there is stale
+struct journalHeader
+{
+  uint32_t magic;
+  uint32_t seq;
+};
+
+struct journalRun
+{
+  uint32_t start;
+  uint32_t length;
+};
+
+// The rest of a descriptor block holds journal_max_meta block numbers,
+// where each following block image goes, then journal_max_runs data
+// runs written in place by this transaction. Both depend on block_size
+struct journalDescriptor
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t num_meta;
+  uint32_t num_runs;
+  uint32_t meta[];
+};
+
+#define DESC_RUNS(vol, desc) ((struct journalRun*) &(desc)->meta[(vol)->journal_max_meta])
+
+// The data runs are not copied into the log. Their checksum is, so a
+// transaction whose data never made it to disk is not replayed
+struct journalCommit
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t num_blocks;  // descriptor and image blocks before the commit
+  uint32_t journal_crc; // CRC32C of those blocks
+  uint32_t data_crc;    // CRC32C of the data runs, in order
+};
+
+
+// An image, open or not, and everything known about it. The pointers
+// into the metadata are set by mapMetadata once the image is in memory
+struct msf_volume
+{
+  struct superBlock* superblock;
+
+  // The geometry of the open image and the layout that follows from it
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint32_t num_files;
+  uint32_t num_data_blocks;
+  uint32_t first_data_block;
+  uint32_t directory_block;
+  uint32_t inode_map_block;
+  uint32_t inode_block;
+  uint32_t journal_block;
+  uint32_t journal_blocks;
+  uint32_t journal_log_blocks;
+  uint32_t block_map_block;
+  uint32_t dir_index_block;
+  uint32_t dir_index_slots;
+  uint32_t checksum_block;
+  uint32_t refcount_block;    // 0 without dedup
+  uint32_t fingerprint_block; // 0 without dedup
+  uint32_t fingerprint_slots;
+  size_t image_size;
+
+  // The image is normally held in memory_image, a copy on write mapping
+  // of memory_size bytes of the image file run as a block cache, see
+  // cacheTouch. An image file too short to map is read into an anonymous
+  // mapping instead. When it is opened with open -m, data points into
+  // a shared mapping of the image file
+  uint8_t* memory_image;
+  size_t memory_size;
+  uint8_t* data;
+
+  // Block cache state, one byte per cache_chunk bytes of the image. NULL
+  // unless memory_image maps the image file
+  uint8_t* cache_state;
+  size_t cache_budget;   // 0 reads the whole image in
+  size_t cache_chunk;    // CACHE_CHUNK, or a page if that is bigger
+  size_t cache_chunks;
+  size_t cache_first;    // first chunk with nothing but data blocks in it
+  size_t cache_limit;    // chunks allowed in memory
+  size_t cache_hand;     // where the eviction sweep picks up
+  size_t cache_resident;
+  uint8_t cache_written; // blocks went to the image file since the last savefs
+
+  // One bit per data block, 1,020 64-bit words for a default image.
+  // A set bit means the data block is in use
+  uint64_t* used_blocks;
+
+  // Bit i is set when inode i + 1 is in use, inode 0 is never used.
+  // Kept at the start of the inode map block
+  uint64_t* used_inodes;
+
+  struct usedCount* used_count;
+
+  // One bit per directory entry, set while the entry is in use, so
+  // insert can find a free one without scanning the directory.
+  // Kept in the inode map block after the used counts
+  uint64_t* used_entries;
+
+  // Open addressed hash table over the directory, after the block map.
+  // Each slot holds a directory entry number + 1 or DIR_SLOT_EMPTY/DELETED
+  int32_t* dir_index;
+
+  // CRC32C of every data block as it was last stored, indexed from
+  // first_data_block. Checked the first time a block is read after the
+  // image is opened, and by scrub
+  uint32_t* checksums;
+
+  // One bit per block, set once its checksum has been checked since the
+  // image was opened. Only kept in memory
+  uint64_t* verified_blocks;
+
+  // With dedup, the count of file blocks sharing each data block,
+  // indexed from first_data_block. used_blocks stays as the allocator's
+  // summary of which counts are non zero. NULL without dedup
+  uint16_t* refcounts;
+  struct fingerprint* fingerprints;
+
+  // Next-fit hints so allocation picks up where the last one stopped
+  // instead of rescanning the front of the maps every time
+  uint32_t block_hint;
+  uint32_t inode_hint;
+  uint32_t entry_hint;
+
+  struct directoryEntry* directory;
+
+  // indexed by inode number, 1 to num_files. Slot 0 is never used
+  struct inode* inodes;
+
+  // Bumped each time an inode is freed, indexed like inodes. libmsf
+  // handles keep the one their inode had when they were opened, so a
+  // handle on a deleted file is never used on whatever gets the inode
+  // next. Only kept in memory
+  uint32_t* generations;
+
+  char image_name[64];
+  uint8_t image_open;
+
+  // descriptor of the image file while it is memory mapped, -1 otherwise
+  int image_fd;
+  uint8_t image_mapped;
+
+  // descriptor of the image file behind a cached memory_image, -1 otherwise
+  int cache_fd;
+
+  // One bit per block of the image, set when the block in memory differs
+  // from the image file so savefs only has to write those blocks back.
+  // This is not part of the image itself
+  uint64_t* dirty_blocks;
+  uint32_t dirty_words;
+
+  // Blocks freed since the last savefs. The ones still free when it runs
+  // are punched out of the image file so they stop using host disk space
+  uint64_t* punch_blocks;
+
+  // The free block map as the last savefs left it in the image file. A
+  // block set here is live on disk, so it is copied before it changes
+  // and only handed out again once nothing else is free
+  uint64_t* committed_blocks;
+
+  // descriptor and data run slots of a journal descriptor block
+  uint32_t journal_max_meta;
+  uint32_t journal_max_runs;
+
+  struct journalHeader* journal;
+
+  // where the next transaction goes in the log, and its sequence number
+  uint32_t journal_head;
+  uint32_t journal_seq;
+
+  // Held while a worker looks at or changes the directory, inodes and
+  // free maps. Copying file data happens outside it
+  pthread_mutex_t fs_lock;
+
+  // Taken by libmsf around every call. Reads run side by side, and
+  // anything that changes the image has the volume to itself
+  pthread_rwlock_t lock;
+
+  // Bumped whenever blocks leave a file, so a cached cluster is never
+  // mistaken for whatever is stored in its blocks next
+  uint64_t cluster_generation;
+
+  // Worker threads used by insert, retrieve and scrub when they have
+  // more than one thing to do, 0 means one per online CPU
+  int num_workers;
+
+  // what scrub has found so far, added to by its workers
+  uint32_t* scrub_refs;    // file references found to each data block
+  uint64_t scrub_problems;
+  uint64_t scrub_checked;  // data blocks whose checksum was checked
+  uint64_t scrub_unsaved;  // data blocks changed since savefs, checked all the same
+  uint64_t scrub_used;     // data blocks marked in use
+  uint64_t scrub_shared;   // references to data blocks beyond the first
+};
+
+
+// Statistics for the stats command. Every command handler gets a call
+// count, error count and a latency histogram with power of two buckets:
+// bucket 0 counts calls under 1us, bucket i calls of [2^(i-1), 2^i) us.
+// The counters below are plain increments so they cost next to nothing.
+// Counters that worker threads touch outside fs_lock go through STAT_ADD.
+// They add up over every volume the process has open
+#define STAT_BUCKETS 32
+
+enum
+{
+  OP_CREATEFS,
+  OP_SAVEFS,
+  OP_OPEN,
+  OP_CLOSE,
+  OP_LIST,
+  OP_DF,
+  OP_INSERT,
+  OP_RETRIEVE,
+  OP_READ,
+  OP_SCRUB,
+  OP_WRITE,
+  OP_APPEND,
+  OP_TRUNCATE,
+  OP_DEL,
+  NUM_OPS
+};
+
+// command names, in the order of the enum above
+extern const char* op_names[NUM_OPS];
+
+struct opStats
+{
+  uint64_t count;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STAT_BUCKETS];
+};
+
+struct fsStats
+{
+  struct opStats ops[NUM_OPS];
+
+  // I/O against host files, the image and the files we insert and retrieve
+  uint64_t host_reads;
+  uint64_t host_bytes_read;
+  uint64_t host_writes;
+  uint64_t host_bytes_written;
+  uint64_t host_bytes_copied; // moved file to file inside the kernel
+  uint64_t host_syncs;
+
+  // allocator activity. A probe is one word of a free map looked at
+  uint64_t blocks_allocated;
+  uint64_t blocks_freed;
+  uint64_t alloc_calls;
+  uint64_t alloc_probes;
+  uint64_t alloc_probe_max;
+  uint64_t alloc_probe_buckets[STAT_BUCKETS];
+
+  // directory index lookups and the hash slots they looked at
+  uint64_t dir_lookups;
+  uint64_t dir_probes;
+
+  // data blocks checked against their checksums, and the ones that failed
+  uint64_t blocks_verified;
+  uint64_t checksum_errors;
+
+  // compressed inserts, bytes going in and bytes stored for them
+  uint64_t compress_in;
+  uint64_t compress_out;
+  uint64_t clusters_raw;
+
+  // block cache chunks dropped to stay in budget, and blocks written to
+  // the image file ahead of savefs so they could be dropped
+  uint64_t cache_evictions;
+  uint64_t cache_writebacks;
+};
+
+extern struct fsStats stats;
+
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+
+void cacheTouch(struct msf_volume* vol, uint32_t block, uint32_t count);
+
+// Start of block b of the image. Data blocks are counted as cached
+// when they are touched, metadata always stays in memory
+static inline uint8_t* blockAt(struct msf_volume* vol, uint32_t b)
+{
+  if(vol->cache_state != NULL && b >= vol->first_data_block)
+  {
+    cacheTouch(vol, b, 1);
+  }
+  return vol->data + (size_t) b * vol->block_size;
+}
+
+#define BLOCK(vol, b) blockAt(vol, b)
+
+
+// volumes
+struct msf_volume* allocVolume();
+void releaseVolume(struct msf_volume* vol);
+
+// images, see baseCommands.c for what each returns
+int openImage(struct msf_volume* vol, const char* filename, int use_mmap);
+int saveImage(struct msf_volume* vol);
+void closeImage(struct msf_volume* vol);
+
+// files, called with fs_lock held where they change the image
+int32_t findDirectoryEntry(struct msf_volume* vol, const char* filename);
+int32_t createFile(struct msf_volume* vol, const char* filename, uint64_t size, uint8_t flags, int32_t* entry);
+void removeFile(struct msf_volume* vol, int32_t entry);
+struct extent* extentAt(struct msf_volume* vol, int32_t inode, uint32_t k);
+size_t readFileRange(struct msf_volume* vol, int32_t inode, uint8_t* buf, uint64_t offset, size_t len);
+int writeFileRange(struct msf_volume* vol, int32_t inode, const uint8_t* buf, uint64_t offset, size_t len);
+int truncateFile(struct msf_volume* vol, int32_t inode, uint64_t size);
+
+// the shell's commands. They print what they find and any errors, and
+// return 0 or -1
+int createfs(struct msf_volume* vol, char* filename, uint32_t size, uint32_t blocks, uint32_t files, uint32_t features);
+int savefs(struct msf_volume* vol);
+int openfs(struct msf_volume* vol, char* filename, int use_mmap);
+int closefs(struct msf_volume* vol);
+int list(struct msf_volume* vol);
+uint64_t df(struct msf_volume* vol);
+int insert(struct msf_volume* vol, char* filename);
+int insertMany(struct msf_volume* vol, char** paths);
+int retrieve(struct msf_volume* vol, char* filename, char* new_filename);
+int retrieveMany(struct msf_volume* vol, char** patterns);
+int read_bytes(struct msf_volume* vol, char* filename, uint64_t start_byte, uint64_t req_num_bytes);
+int write_bytes(struct msf_volume* vol, char* filename, uint64_t offset, char* source, int append);
+int truncate_file(struct msf_volume* vol, char* filename, uint64_t size);
+int del(struct msf_volume* vol, char* filename);
+int scrub(struct msf_volume* vol);
+int printStats(struct msf_volume* vol, int json);
+
+uint32_t statBucket(uint64_t value);
+uint64_t nowNs();
+
+#endif
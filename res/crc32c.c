@@ -0,0 +1,128 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HW
+#endif
+
+// Reflected CRC32C polynomial
+#define CRC32C_POLY 0x82f63b78
+
+// crc32c_table[0] is the usual byte at a time table. Table k advances a
+// byte k more bytes, so eight bytes can be folded in with eight lookups
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static int crc32c_hw_ready;
+
+
+// Build the lookup tables and see whether the CPU has a crc32
+// instruction, once, the first time any thread needs a checksum
+static void crc32c_init()
+{
+  uint32_t i;
+  for(i = 0; i < 256; i++)
+  {
+    uint32_t crc = i;
+
+    int j;
+    for(j = 0; j < 8; j++)
+    {
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+
+    crc32c_table[0][i] = crc;
+  }
+
+  for(i = 0; i < 256; i++)
+  {
+    int k;
+    for(k = 1; k < 8; k++)
+    {
+      uint32_t prev = crc32c_table[k - 1][i];
+      crc32c_table[k][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+    }
+  }
+
+#ifdef CRC32C_HW
+  __builtin_cpu_init();
+  crc32c_hw_ready = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+
+#ifdef CRC32C_HW
+// SSE4.2 crc32 instruction, eight bytes at a time once p is aligned
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t len)
+{
+  uint64_t c = crc;
+
+  while(len > 0 && ((uintptr_t) p & 7))
+  {
+    c = _mm_crc32_u8((uint32_t) c, *p++);
+    len--;
+  }
+
+  while(len >= 8)
+  {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    len -= 8;
+  }
+
+  while(len--)
+  {
+    c = _mm_crc32_u8((uint32_t) c, *p++);
+  }
+
+  return (uint32_t) c;
+}
+#endif
+
+
+// Slicing by 8, for CPUs without the instruction. Loads are little endian
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t len)
+{
+  while(len >= 8)
+  {
+    uint32_t lo;
+    uint32_t hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + 4, sizeof(hi));
+    lo ^= crc;
+
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+
+    p += 8;
+    len -= 8;
+  }
+
+  while(len--)
+  {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+
+#ifdef CRC32C_HW
+  if(crc32c_hw_ready)
+  {
+    return ~crc32c_hw(~crc, (const uint8_t*) buf, len);
+  }
+#endif
+
+  return ~crc32c_sw(~crc, (const uint8_t*) buf, len);
+}
@@ -0,0 +1,12 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC32C (Castagnoli) of len bytes at buf, with the SSE4.2 crc32
+// instruction when the CPU has it. Pass 0 to start a new
+// checksum or a previous result to continue one across buffers
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+#endif
@@ -0,0 +1,243 @@
+#include <string.h>
+#include "lz.h"
+
+// A byte oriented LZ77 in the style of LZ4. The compressed stream is a
+// list of sequences, each a token byte, some literals and a match:
+//
+//   token        high nibble literal count, low nibble match length - 4.
+//                15 in either means more length bytes follow
+//   lengths      literal count - 15 as 255s and a final byte under 255
+//   literals     copied as they are
+//   offset       2 bytes little endian, how far back the match starts
+//   lengths      match length - 19 in the same way
+//
+// The last sequence has literals only and ends the stream
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_SHIFT 6 // after 2^6 misses in a row the search steps 2 bytes, and so on
+
+
+static uint32_t lzRead32(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+static uint32_t lzHash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+
+// Write the part of a length that did not fit in its token nibble.
+// Returns where the next byte goes, or NULL if out runs out first
+static uint8_t* lzPutLength(uint8_t* op, uint8_t* op_end, size_t len)
+{
+  while(len >= 255)
+  {
+    if(op >= op_end)
+    {
+      return NULL;
+    }
+    *op++ = 255;
+    len -= 255;
+  }
+
+  if(op >= op_end)
+  {
+    return NULL;
+  }
+  *op++ = (uint8_t) len;
+  return op;
+}
+
+
+// Write one sequence. A match_len of 0 writes the last, literal only one
+static uint8_t* lzPutSequence(uint8_t* op, uint8_t* op_end, const uint8_t* lit,
+                              size_t lit_len, size_t offset, size_t match_len)
+{
+  if(op >= op_end)
+  {
+    return NULL;
+  }
+
+  uint8_t* token = op++;
+  *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+
+  if(lit_len >= 15 && (op = lzPutLength(op, op_end, lit_len - 15)) == NULL)
+  {
+    return NULL;
+  }
+
+  if(lit_len > (size_t)(op_end - op))
+  {
+    return NULL;
+  }
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+
+  if(match_len == 0)
+  {
+    return op;
+  }
+
+  if(op_end - op < 2)
+  {
+    return NULL;
+  }
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+
+  match_len -= LZ_MIN_MATCH;
+  *token |= match_len >= 15 ? 15 : match_len;
+
+  if(match_len >= 15)
+  {
+    op = lzPutLength(op, op_end, match_len - 15);
+  }
+  return op;
+}
+
+
+// Greedy compression with a single entry hash table of 4 byte prefixes.
+// Data that keeps missing is stepped over faster and faster, so
+// something incompressible costs little more than a pass over it
+size_t lzCompress(const uint8_t* in, size_t len, uint8_t* out, size_t out_cap)
+{
+  uint32_t table[1 << LZ_HASH_BITS];
+  const uint8_t* ip = in;
+  const uint8_t* anchor = in;
+  const uint8_t* end = in + len;
+  uint8_t* op = out;
+  uint8_t* op_end = out + out_cap;
+  uint32_t misses = 0;
+
+  memset(table, 0, sizeof(table));
+
+  while(len >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH)
+  {
+    uint32_t v = lzRead32(ip);
+    uint32_t h = lzHash(v);
+    const uint8_t* candidate = in + table[h];
+    table[h] = ip - in;
+
+    if(candidate < ip && ip - candidate <= LZ_MAX_OFFSET && lzRead32(candidate) == v)
+    {
+      size_t match = LZ_MIN_MATCH;
+      while(ip + match < end && candidate[match] == ip[match])
+      {
+        match++;
+      }
+
+      op = lzPutSequence(op, op_end, anchor, ip - anchor, ip - candidate, match);
+      if(op == NULL)
+      {
+        return 0;
+      }
+
+      ip += match;
+      anchor = ip;
+      misses = 0;
+    }
+    else
+    {
+      ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+    }
+  }
+
+  op = lzPutSequence(op, op_end, anchor, end - anchor, 0, 0);
+  return op == NULL ? 0 : (size_t)(op - out);
+}
+
+
+// Read the rest of a length whose token nibble was 15
+static int lzGetLength(const uint8_t** ip, const uint8_t* end, size_t* len)
+{
+  uint8_t b;
+  do
+  {
+    if(*ip >= end)
+    {
+      return -1;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while(b == 255);
+
+  return 0;
+}
+
+
+// Every length and offset is checked against both buffers, so a
+// corrupt stream fails instead of running off either end
+int lzDecompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len)
+{
+  const uint8_t* ip = in;
+  const uint8_t* end = in + in_len;
+  uint8_t* op = out;
+  uint8_t* op_end = out + out_len;
+
+  while(ip < end)
+  {
+    uint8_t token = *ip++;
+
+    size_t lit = token >> 4;
+    if(lit == 15 && lzGetLength(&ip, end, &lit) == -1)
+    {
+      return -1;
+    }
+
+    if(lit > (size_t)(end - ip) || lit > (size_t)(op_end - op))
+    {
+      return -1;
+    }
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+
+    // the last sequence has no match
+    if(ip == end)
+    {
+      break;
+    }
+
+    if(end - ip < 2)
+    {
+      return -1;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+
+    size_t match = token & 15;
+    if(match == 15 && lzGetLength(&ip, end, &match) == -1)
+    {
+      return -1;
+    }
+    match += LZ_MIN_MATCH;
+
+    if(offset == 0 || offset > (size_t)(op - out) || match > (size_t)(op_end - op))
+    {
+      return -1;
+    }
+
+    // a match may overlap the bytes it is producing
+    const uint8_t* from = op - offset;
+    if(offset >= match)
+    {
+      memcpy(op, from, match);
+      op += match;
+    }
+    else
+    {
+      while(match--)
+      {
+        *op++ = *from++;
+      }
+    }
+  }
+
+  return op == op_end ? 0 : -1;
+}
@@ -0,0 +1,15 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Compress len bytes at in into out, which has room for out_cap bytes.
+// Returns the compressed size, or 0 if it would not fit in out_cap
+size_t lzCompress(const uint8_t* in, size_t len, uint8_t* out, size_t out_cap);
+
+// Expand in_len compressed bytes at in into exactly out_len bytes at
+// out. Returns -1 if the input is corrupt or does not expand to out_len
+int lzDecompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len);
+
+#endif
@@ -0,0 +1,453 @@
+// libmsf, see msf.h. Each mount has a struct msf_volume of its own, so
+// a process can have any number of images mounted at once. The volume's
+// rwlock lets reads run side by side and gives anything that changes
+// the image the volume to itself. Writes also take fs_lock since the
+// allocators expect it
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "baseCommands.h"
+
+struct msf_file
+{
+  struct msf_volume* vol;
+  int32_t inode;
+  uint32_t generation; // of the inode when the file was opened
+  int flags;
+};
+
+// Image files mounted by this process. Two volumes over one image
+// would each save over what the other wrote, so that is refused
+struct mountEntry
+{
+  struct msf_volume* vol;
+  dev_t dev;
+  ino_t ino;
+  struct mountEntry* next;
+};
+
+struct mountEntry* mounts;
+pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// A handle whose file has been deleted since it was opened. The
+// caller holds the volume lock
+int staleFile(struct msf_file* file)
+{
+  return file->vol->generations[file->inode] != file->generation;
+}
+
+
+// Forget the mount of vol, if it is there. Called with mounts_lock held
+void dropMount(struct msf_volume* vol)
+{
+  struct mountEntry** link = &mounts;
+  while(*link != NULL)
+  {
+    if((*link)->vol == vol)
+    {
+      struct mountEntry* gone = *link;
+      *link = gone->next;
+      free(gone);
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+
+int msf_mount(const char* image, int flags, struct msf_volume** vol)
+{
+  if(image == NULL || vol == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  struct stat buf;
+  if(stat(image, &buf) == -1)
+  {
+    return MSF_ENOENT;
+  }
+
+  struct mountEntry* mount = (struct mountEntry*) malloc(sizeof(struct mountEntry));
+  struct msf_volume* v = allocVolume();
+  if(mount == NULL || v == NULL)
+  {
+    free(mount);
+    if(v != NULL)
+    {
+      releaseVolume(v);
+    }
+    return MSF_ENOMEM;
+  }
+
+  pthread_mutex_lock(&mounts_lock);
+
+  struct mountEntry* m;
+  for(m = mounts; m != NULL; m = m->next)
+  {
+    if(m->dev == buf.st_dev && m->ino == buf.st_ino)
+    {
+      pthread_mutex_unlock(&mounts_lock);
+      free(mount);
+      releaseVolume(v);
+      return MSF_EBUSY;
+    }
+  }
+
+  // the entry goes in first so a second mount of the image waits on it
+  mount->vol = v;
+  mount->dev = buf.st_dev;
+  mount->ino = buf.st_ino;
+  mount->next = mounts;
+  mounts = mount;
+
+  pthread_mutex_unlock(&mounts_lock);
+
+  int status = openImage(v, image, flags & MSF_MOUNT_MMAP);
+  if(status != MSF_OK)
+  {
+    pthread_mutex_lock(&mounts_lock);
+    dropMount(v);
+    pthread_mutex_unlock(&mounts_lock);
+    releaseVolume(v);
+    return status;
+  }
+
+  *vol = v;
+  return MSF_OK;
+}
+
+
+int msf_sync(struct msf_volume* vol)
+{
+  if(vol == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  pthread_rwlock_wrlock(&vol->lock);
+  int status = saveImage(vol);
+  pthread_rwlock_unlock(&vol->lock);
+
+  return status == MSF_OK ? MSF_OK : MSF_EIO;
+}
+
+
+int msf_unmount(struct msf_volume* vol)
+{
+  if(vol == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  // saveImage writes nothing when the volume was not changed, so an
+  // image that was only read is left alone
+  pthread_rwlock_wrlock(&vol->lock);
+  int status = saveImage(vol);
+  closeImage(vol);
+  pthread_rwlock_unlock(&vol->lock);
+
+  pthread_mutex_lock(&mounts_lock);
+  dropMount(vol);
+  pthread_mutex_unlock(&mounts_lock);
+
+  releaseVolume(vol);
+
+  return status == MSF_OK ? MSF_OK : MSF_EIO;
+}
+
+
+int msf_open(struct msf_volume* vol, const char* name, int flags, struct msf_file** file)
+{
+  if(vol == NULL || name == NULL || name[0] == '\0' || file == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  if(strlen(name) > MSF_NAME_MAX)
+  {
+    return MSF_ENAMETOOLONG;
+  }
+
+  struct msf_file* f = (struct msf_file*) malloc(sizeof(struct msf_file));
+  if(f == NULL)
+  {
+    return MSF_ENOMEM;
+  }
+
+  // only creating a file changes the volume
+  if(flags & MSF_CREAT)
+  {
+    pthread_rwlock_wrlock(&vol->lock);
+  }
+  else
+  {
+    pthread_rwlock_rdlock(&vol->lock);
+  }
+
+  int32_t entry = findDirectoryEntry(vol, name);
+  int32_t inode;
+
+  if(entry != -1)
+  {
+    inode = (flags & MSF_CREAT) && (flags & MSF_EXCL) ? MSF_EEXIST : vol->directory[entry].inode;
+  }
+  else if(flags & MSF_CREAT)
+  {
+    pthread_mutex_lock(&vol->fs_lock);
+    inode = createFile(vol, name, 0, INODE_INLINE, &entry);
+    pthread_mutex_unlock(&vol->fs_lock);
+  }
+  else
+  {
+    inode = MSF_ENOENT;
+  }
+
+  if(inode >= 0)
+  {
+    f->vol = vol;
+    f->inode = inode;
+    f->generation = vol->generations[inode];
+    f->flags = flags;
+  }
+
+  pthread_rwlock_unlock(&vol->lock);
+
+  if(inode < 0)
+  {
+    free(f);
+    return inode;
+  }
+
+  *file = f;
+  return MSF_OK;
+}
+
+
+int msf_close(struct msf_file* file)
+{
+  if(file == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  free(file);
+  return MSF_OK;
+}
+
+
+ssize_t msf_pread(struct msf_file* file, void* buf, size_t len, uint64_t offset)
+{
+  if(file == NULL || (buf == NULL && len > 0) || len > SSIZE_MAX)
+  {
+    return MSF_EINVAL;
+  }
+
+  struct msf_volume* vol = file->vol;
+  pthread_rwlock_rdlock(&vol->lock);
+
+  if(staleFile(file))
+  {
+    pthread_rwlock_unlock(&vol->lock);
+    return MSF_ESTALE;
+  }
+
+  uint64_t size = vol->inodes[file->inode].file_size;
+  size_t want = offset >= size ? 0 : (size - offset < len ? size - offset : len);
+  size_t copied = readFileRange(vol, file->inode, (uint8_t*) buf, offset, want);
+
+  pthread_rwlock_unlock(&vol->lock);
+
+  // inside the file only a block failing its checksum comes up short
+  return copied < want ? MSF_EIO : (ssize_t) copied;
+}
+
+
+ssize_t msf_pwrite(struct msf_file* file, const void* buf, size_t len, uint64_t offset)
+{
+  if(file == NULL || (buf == NULL && len > 0) || len > SSIZE_MAX)
+  {
+    return MSF_EINVAL;
+  }
+
+  if(!(file->flags & MSF_RDWR))
+  {
+    return MSF_EBADF;
+  }
+
+  struct msf_volume* vol = file->vol;
+  pthread_rwlock_wrlock(&vol->lock);
+  pthread_mutex_lock(&vol->fs_lock);
+
+  int status = staleFile(file) ? MSF_ESTALE : writeFileRange(vol, file->inode, (const uint8_t*) buf, offset, len);
+
+  pthread_mutex_unlock(&vol->fs_lock);
+  pthread_rwlock_unlock(&vol->lock);
+
+  return status == MSF_OK ? (ssize_t) len : status;
+}
+
+
+int msf_truncate(struct msf_file* file, uint64_t size)
+{
+  if(file == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  if(!(file->flags & MSF_RDWR))
+  {
+    return MSF_EBADF;
+  }
+
+  struct msf_volume* vol = file->vol;
+  pthread_rwlock_wrlock(&vol->lock);
+  pthread_mutex_lock(&vol->fs_lock);
+
+  int status = staleFile(file) ? MSF_ESTALE : truncateFile(vol, file->inode, size);
+
+  pthread_mutex_unlock(&vol->fs_lock);
+  pthread_rwlock_unlock(&vol->lock);
+  return status;
+}
+
+
+int msf_unlink(struct msf_volume* vol, const char* name)
+{
+  if(vol == NULL || name == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  pthread_rwlock_wrlock(&vol->lock);
+
+  int32_t entry = findDirectoryEntry(vol, name);
+  if(entry != -1)
+  {
+    pthread_mutex_lock(&vol->fs_lock);
+    removeFile(vol, entry);
+    pthread_mutex_unlock(&vol->fs_lock);
+  }
+
+  pthread_rwlock_unlock(&vol->lock);
+  return entry == -1 ? MSF_ENOENT : MSF_OK;
+}
+
+
+// Fill in an msf_stat for an inode. The caller holds the volume lock
+void statInode(struct msf_volume* vol, int32_t inode, struct msf_stat* st)
+{
+  struct inode* node = &vol->inodes[inode];
+
+  st->size = node->file_size;
+  st->inode = inode;
+  st->blocks = 0;
+
+  uint32_t k;
+  for(k = 0; k < node->num_extents; k++)
+  {
+    st->blocks += extentAt(vol, inode, k)->length;
+  }
+}
+
+
+int msf_stat(struct msf_volume* vol, const char* name, struct msf_stat* st)
+{
+  if(vol == NULL || name == NULL || st == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  pthread_rwlock_rdlock(&vol->lock);
+
+  int32_t entry = findDirectoryEntry(vol, name);
+  if(entry != -1)
+  {
+    statInode(vol, vol->directory[entry].inode, st);
+  }
+
+  pthread_rwlock_unlock(&vol->lock);
+  return entry == -1 ? MSF_ENOENT : MSF_OK;
+}
+
+
+int msf_fstat(struct msf_file* file, struct msf_stat* st)
+{
+  if(file == NULL || st == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  struct msf_volume* vol = file->vol;
+  pthread_rwlock_rdlock(&vol->lock);
+
+  int stale = staleFile(file);
+  if(!stale)
+  {
+    statInode(vol, file->inode, st);
+  }
+
+  pthread_rwlock_unlock(&vol->lock);
+  return stale ? MSF_ESTALE : MSF_OK;
+}
+
+
+int msf_readdir(struct msf_volume* vol, uint32_t* cursor, struct msf_dirent* ent)
+{
+  if(vol == NULL || cursor == NULL || ent == NULL)
+  {
+    return MSF_EINVAL;
+  }
+
+  pthread_rwlock_rdlock(&vol->lock);
+
+  int found = 0;
+  uint32_t i;
+  for(i = *cursor; i < vol->num_files; i++)
+  {
+    if(vol->directory[i].in_use == 1)
+    {
+      memset(ent->name, 0, sizeof(ent->name));
+      memcpy(ent->name, vol->directory[i].filename, vol->directory[i].name_len);
+      ent->size = vol->inodes[vol->directory[i].inode].file_size;
+      found = 1;
+      i++;
+      break;
+    }
+  }
+
+  *cursor = i;
+  pthread_rwlock_unlock(&vol->lock);
+  return found;
+}
+
+
+const char* msf_strerror(int error)
+{
+  switch(error)
+  {
+    case MSF_OK:           return "Success";
+    case MSF_EIO:          return "I/O error or checksum failure";
+    case MSF_ENOENT:       return "File not found";
+    case MSF_EEXIST:       return "File already exists";
+    case MSF_ENOSPC:       return "Not enough free disk space";
+    case MSF_EINVAL:       return "Invalid argument";
+    case MSF_ENAMETOOLONG: return "Filename is too long";
+    case MSF_ENOMEM:       return "Out of memory";
+    case MSF_EBADIMAGE:    return "Not a valid disk image";
+    case MSF_EBUSY:        return "The image is already mounted";
+    case MSF_EBADF:        return "File not open for writing";
+    case MSF_EFBIG:        return "File is too large";
+    case MSF_EDIRFULL:     return "Could not find a free directory entry";
+    case MSF_ENOINODE:     return "Can not find a free inode";
+    case MSF_ESTALE:       return "File was deleted after it was opened";
+  }
+
+  return "Unknown error";
+}
@@ -0,0 +1,110 @@
+#ifndef __MSF_H__
+#define __MSF_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// libmsf, the filesystem as a library. Build it with make libmsf.a and
+// link with -pthread. Every call returns MSF_OK or one of the negative
+// codes below, pread and pwrite the number of bytes moved instead
+//
+//   struct msf_volume* vol;
+//   struct msf_file* file;
+//   char buf[4096];
+//
+//   if(msf_mount("disk.img", 0, &vol) == MSF_OK &&
+//      msf_open(vol, "notes.txt", MSF_RDONLY, &file) == MSF_OK)
+//   {
+//     ssize_t got = msf_pread(file, buf, sizeof(buf), 0);
+//     msf_close(file);
+//   }
+//   msf_unmount(vol);
+//
+// A process may mount any number of images, each of them once. Reads
+// of the same volume may run on several threads at once, anything that
+// changes it waits for them and runs alone
+
+enum msf_error
+{
+  MSF_OK = 0,
+  MSF_EIO = -1,           // host I/O failed, or file data failed its checksum
+  MSF_ENOENT = -2,        // no such file, or no such image file
+  MSF_EEXIST = -3,        // the file is already there
+  MSF_ENOSPC = -4,        // out of data blocks, or of extents for the file
+  MSF_EINVAL = -5,        // a bad argument
+  MSF_ENAMETOOLONG = -6,  // names are at most 63 bytes
+  MSF_ENOMEM = -7,
+  MSF_EBADIMAGE = -8,     // not a filesystem image this version can read
+  MSF_EBUSY = -9,         // the image is already mounted
+  MSF_EBADF = -10,        // the file was not opened for writing
+  MSF_EFBIG = -11,        // bigger than the image could ever hold
+  MSF_EDIRFULL = -12,     // every directory entry is in use
+  MSF_ENOINODE = -13,     // every inode is in use
+  MSF_ESTALE = -14        // the file was deleted after it was opened
+};
+
+// msf_mount flags
+#define MSF_MOUNT_MMAP 0x1 // map the image file instead of caching it
+
+// msf_open flags
+#define MSF_RDONLY 0x0
+#define MSF_RDWR   0x1
+#define MSF_CREAT  0x2 // create the file, empty, if it is not there
+#define MSF_EXCL   0x4 // with MSF_CREAT, fail if it is already there
+
+#define MSF_NAME_MAX 63
+
+struct msf_volume;
+struct msf_file;
+
+struct msf_stat
+{
+  uint64_t size;
+  uint32_t inode;
+  uint32_t blocks;     // data blocks the file's extents take up
+};
+
+struct msf_dirent
+{
+  char name[MSF_NAME_MAX + 1];
+  uint64_t size;
+};
+
+// Mount the image in the file image. Changes stay in memory until
+// msf_sync or msf_unmount writes them to it
+int msf_mount(const char* image, int flags, struct msf_volume** vol);
+
+// Write out what changed since the last sync as one journal transaction
+int msf_sync(struct msf_volume* vol);
+
+// Sync and let go of the volume. It is gone even if the sync failed,
+// which is what the return value says
+int msf_unmount(struct msf_volume* vol);
+
+int msf_open(struct msf_volume* vol, const char* name, int flags, struct msf_file** file);
+int msf_close(struct msf_file* file);
+
+// Copy up to len bytes from offset. Returns how many, 0 at or past the end
+ssize_t msf_pread(struct msf_file* file, void* buf, size_t len, uint64_t offset);
+
+// Write len bytes at offset, growing the file if it ends past its end.
+// A gap left before offset reads back as zeros. Returns len
+ssize_t msf_pwrite(struct msf_file* file, const void* buf, size_t len, uint64_t offset);
+
+// Cut the file short at size bytes, or pad it to size with zeros
+int msf_truncate(struct msf_file* file, uint64_t size);
+
+// Delete a file. Handles still open on it fail with MSF_ESTALE from then on
+int msf_unlink(struct msf_volume* vol, const char* name);
+
+int msf_stat(struct msf_volume* vol, const char* name, struct msf_stat* st);
+int msf_fstat(struct msf_file* file, struct msf_stat* st);
+
+// List the directory. *cursor starts at 0 and is moved along by each
+// call. Returns 1 with the next file in *ent, or 0 once there are no more
+int msf_readdir(struct msf_volume* vol, uint32_t* cursor, struct msf_dirent* ent);
+
+// What an msf_error code means, for messages
+const char* msf_strerror(int error);
+
+#endif
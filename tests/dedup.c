@@ -0,0 +1,287 @@
+// Reference counts on an image created with dedup. Files that share
+// blocks are inserted, one of them is written over and they are deleted
+// one at a time. At every step each block's count has to match the file
+// blocks pointing at it, the used and shared totals have to follow, and
+// the files that are left have to read back unchanged.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../res/baseCommands.h"
+
+#define BLOCK_SIZE 1024
+#define FILE_BLOCKS 64
+
+static int failures;
+
+// the filesystem prints as it goes, test results go here instead
+static FILE* results;
+
+#define CHECK(cond, what) \
+  do { if(!(cond)) { fprintf(results, "FAIL: %s\n", what); failures++; } } while(0)
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t nextRandom()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+
+static void writeHostFile(const char* name, const uint8_t* bytes, size_t size)
+{
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || write(fd, bytes, size) != (ssize_t) size)
+  {
+    fprintf(results, "FAIL: could not write %s\n", name);
+    exit(1);
+  }
+  close(fd);
+}
+
+
+static int32_t inodeOf(struct msf_volume* vol, const char* name)
+{
+  int32_t entry = findDirectoryEntry(vol, name);
+  return entry == -1 ? 0 : vol->directory[entry].inode;
+}
+
+
+// Data block holding block n of a file, -1 if it has none
+static int32_t fileBlock(struct msf_volume* vol, const char* name, uint32_t n)
+{
+  int32_t inode = inodeOf(vol, name);
+  uint32_t k;
+
+  for(k = 0; inode != 0 && k < vol->inodes[inode].num_extents; k++)
+  {
+    struct extent* ext = extentAt(vol, inode, k);
+    if(n >= ext->logical && n < ext->logical + ext->length)
+    {
+      return ext->start + (n - ext->logical);
+    }
+  }
+  return -1;
+}
+
+
+static uint32_t refcount(struct msf_volume* vol, int32_t block)
+{
+  return block == -1 ? 0 : vol->refcounts[block - vol->first_data_block];
+}
+
+
+static int sameContents(struct msf_volume* vol, const char* name, const uint8_t* want, size_t size)
+{
+  int32_t inode = inodeOf(vol, name);
+  uint8_t* got = (uint8_t*) malloc(size);
+
+  int same = inode != 0 && vol->inodes[inode].file_size == size &&
+             readFileRange(vol, inode, got, 0, size) == size && memcmp(want, got, size) == 0;
+
+  free(got);
+  return same;
+}
+
+
+// Every count has to be what the files left say it is
+static void checkCounts(struct msf_volume* vol, const char* step)
+{
+  uint32_t* refs = (uint32_t*) calloc(vol->num_data_blocks, sizeof(uint32_t));
+  uint32_t used = 0;
+  uint32_t shared = 0;
+  char what[128];
+
+  uint32_t i;
+  for(i = 0; i < vol->num_files; i++)
+  {
+    if(vol->directory[i].in_use)
+    {
+      int32_t inode = vol->directory[i].inode;
+      uint32_t k;
+      for(k = 0; k < vol->inodes[inode].num_extents; k++)
+      {
+        struct extent* ext = extentAt(vol, inode, k);
+        int32_t b;
+        for(b = ext->start; b < ext->start + ext->length; b++)
+        {
+          refs[b - vol->first_data_block]++;
+        }
+      }
+    }
+  }
+
+  for(i = 0; i < vol->num_data_blocks; i++)
+  {
+    if(refs[i] != vol->refcounts[i])
+    {
+      snprintf(what, sizeof(what), "%s: block %u has count %u for %u references",
+               step, i + vol->first_data_block, vol->refcounts[i], refs[i]);
+      CHECK(0, what);
+      break;
+    }
+    used += refs[i] > 0;
+    shared += refs[i] > 1 ? refs[i] - 1 : 0;
+  }
+
+  snprintf(what, sizeof(what), "%s: %u blocks in use, counted %u", step, vol->used_count->blocks, used);
+  CHECK(vol->used_count->blocks == used, what);
+  snprintf(what, sizeof(what), "%s: %u shared references, counted %u", step, vol->used_count->shared, shared);
+  CHECK(vol->used_count->shared == shared, what);
+  // and only blocks in use are there to share
+  for(i = 0; i < vol->fingerprint_slots; i++)
+  {
+    uint32_t block = vol->fingerprints[i].block;
+    if(block != FINGERPRINT_EMPTY && block != FINGERPRINT_DELETED &&
+       vol->refcounts[block - vol->first_data_block] == 0)
+    {
+      snprintf(what, sizeof(what), "%s: free block %u still indexed", step, block);
+      CHECK(0, what);
+      break;
+    }
+  }
+
+  snprintf(what, sizeof(what), "%s: scrub", step);
+  CHECK(scrub(vol) == 0, what);
+
+  free(refs);
+}
+
+
+static void saveAndReopen(struct msf_volume* vol)
+{
+  CHECK(saveImage(vol) == MSF_OK, "save");
+  closeImage(vol);
+  CHECK(openImage(vol, "img", 0) == MSF_OK, "reopen");
+}
+
+
+int main()
+{
+  char dir[] = "/tmp/msf_dedup.XXXXXX";
+  if(mkdtemp(dir) == NULL || chdir(dir) == -1)
+  {
+    printf("FAIL: could not make a work directory\n");
+    return 1;
+  }
+
+  results = fdopen(dup(STDOUT_FILENO), "w");
+  setvbuf(results, NULL, _IOLBF, 0);
+  freopen("/dev/null", "w", stdout);
+
+  // a, b a copy of a, c the first half of a and something else, and
+  // d one block of a over and over
+  size_t size = FILE_BLOCKS * BLOCK_SIZE;
+  uint8_t* a = (uint8_t*) malloc(size);
+  uint8_t* c = (uint8_t*) malloc(size);
+  uint8_t* d = (uint8_t*) malloc(size / 8);
+
+  size_t i;
+  for(i = 0; i < size; i++)
+  {
+    a[i] = (uint8_t) nextRandom();
+    c[i] = i < size / 2 ? a[i] : (uint8_t) nextRandom();
+  }
+  for(i = 0; i < size / 8; i++)
+  {
+    d[i] = a[i % BLOCK_SIZE];
+  }
+
+  writeHostFile("a", a, size);
+  writeHostFile("b", a, size);
+  writeHostFile("c", c, size);
+  writeHostFile("d", d, size / 8);
+
+  struct msf_volume* vol = allocVolume();
+  CHECK(createfs(vol, "img", BLOCK_SIZE, 4096, 32, FEATURE_DEDUP) == 0, "createfs");
+  CHECK(insert(vol, "a") == 0 && insert(vol, "b") == 0 &&
+        insert(vol, "c") == 0 && insert(vol, "d") == 0, "insert");
+
+  CHECK(vol->used_count->blocks == FILE_BLOCKS + FILE_BLOCKS / 2, "shared blocks stored once");
+  CHECK(refcount(vol, fileBlock(vol, "a", 0)) == 3 + FILE_BLOCKS / 8, "count of a block in every file");
+  CHECK(refcount(vol, fileBlock(vol, "a", 1)) == 3, "count of a block in a, b and c");
+  CHECK(refcount(vol, fileBlock(vol, "a", FILE_BLOCKS - 1)) == 2, "count of a block in a and b");
+  CHECK(refcount(vol, fileBlock(vol, "c", FILE_BLOCKS - 1)) == 1, "count of a block only c has");
+  checkCounts(vol, "after insert");
+
+  saveAndReopen(vol);
+  checkCounts(vol, "after reopen");
+
+  // writing over a shared block gives the file a block of its own
+  uint8_t over[BLOCK_SIZE];
+  memset(over, 0x55, sizeof(over));
+  int32_t before = fileBlock(vol, "b", 1);
+
+  pthread_mutex_lock(&vol->fs_lock);
+  CHECK(writeFileRange(vol, inodeOf(vol, "b"), over, BLOCK_SIZE, BLOCK_SIZE) == MSF_OK, "write over b");
+  pthread_mutex_unlock(&vol->fs_lock);
+
+  CHECK(fileBlock(vol, "b", 1) != before, "written block moved");
+  CHECK(refcount(vol, before) == 2, "count of the block b let go of");
+  CHECK(sameContents(vol, "a", a, size), "a after writing over b");
+  memcpy(a + BLOCK_SIZE, over, BLOCK_SIZE);
+  CHECK(sameContents(vol, "b", a, size), "b after writing over it");
+  memcpy(a + BLOCK_SIZE, c + BLOCK_SIZE, BLOCK_SIZE);
+  checkCounts(vol, "after write");
+
+  // a block only c has, but the image file holds, is copied before it
+  // changes. The index has to drop the old one and find the new bytes
+  before = fileBlock(vol, "c", FILE_BLOCKS - 1);
+  memset(over, 0x66, sizeof(over));
+
+  pthread_mutex_lock(&vol->fs_lock);
+  CHECK(writeFileRange(vol, inodeOf(vol, "c"), over, (FILE_BLOCKS - 1) * BLOCK_SIZE, BLOCK_SIZE) == MSF_OK,
+        "write over c");
+  pthread_mutex_unlock(&vol->fs_lock);
+
+  memcpy(c + (FILE_BLOCKS - 1) * BLOCK_SIZE, over, BLOCK_SIZE);
+  CHECK(fileBlock(vol, "c", FILE_BLOCKS - 1) != before, "saved block copied before it changed");
+  CHECK(sameContents(vol, "c", c, size), "c after writing over it");
+  checkCounts(vol, "after write in place");
+
+  // and deleting takes the counts back down to nothing
+  static const char* names[] = { "b", "a", "d", "c" };
+  for(i = 0; i < 4; i++)
+  {
+    pthread_mutex_lock(&vol->fs_lock);
+    removeFile(vol, findDirectoryEntry(vol, names[i]));
+    pthread_mutex_unlock(&vol->fs_lock);
+
+    char step[32];
+    snprintf(step, sizeof(step), "after deleting %s", names[i]);
+    checkCounts(vol, step);
+
+    if(i == 0)
+    {
+      CHECK(sameContents(vol, "a", a, size), "a after deleting b");
+      CHECK(sameContents(vol, "c", c, size), "c after deleting b");
+    }
+  }
+
+  CHECK(vol->used_count->blocks == 0 && vol->used_count->shared == 0, "nothing left in use");
+  saveAndReopen(vol);
+  checkCounts(vol, "empty after reopen");
+  closeImage(vol);
+
+  releaseVolume(vol);
+  free(a);
+  free(c);
+  free(d);
+  unlink("a");
+  unlink("b");
+  unlink("c");
+  unlink("d");
+  unlink("img");
+  rmdir(dir);
+
+  fprintf(results, "dedup: %s\n", failures ? "FAILED" : "ok");
+  return failures != 0;
+}
@@ -0,0 +1,327 @@
+// Journal replay after a crash. An image is saved twice, and the second
+// save is then undone by hand to what a crash part way through it would
+// have left on disk: its log and data runs written and nothing else,
+// neither the blocks it logged nor the freed blocks it punched. With
+// the commit block there replay has to bring the second save back, and
+// with the commit block torn it has to leave the image as the first
+// save left it. That is done once for a save that adds a file and once
+// for one that writes over a saved file.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../res/baseCommands.h"
+
+#define FILE_BYTES 5000 // needs data blocks, not just the inode
+
+static int failures;
+
+#define CHECK(cond, what) \
+  do { if(!(cond)) { printf("FAIL: %s\n", what); failures++; } } while(0)
+
+// where the log is, taken while the image is open to say so
+struct logPlace
+{
+  size_t block_size;
+  uint32_t journal_block;
+  uint32_t journal_blocks;
+  uint32_t log_blocks;
+  uint32_t max_meta;
+};
+
+
+static uint8_t* readWhole(const char* name, size_t* size)
+{
+  struct stat buf;
+  int fd = open(name, O_RDONLY);
+  if(fd == -1 || fstat(fd, &buf) == -1)
+  {
+    return NULL;
+  }
+
+  uint8_t* bytes = (uint8_t*) malloc(buf.st_size);
+  if(pread(fd, bytes, buf.st_size, 0) != buf.st_size)
+  {
+    free(bytes);
+    bytes = NULL;
+  }
+
+  close(fd);
+  *size = buf.st_size;
+  return bytes;
+}
+
+
+static void writeWhole(const char* name, const uint8_t* bytes, size_t size)
+{
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || write(fd, bytes, size) != (ssize_t) size)
+  {
+    printf("FAIL: could not write %s\n", name);
+    exit(1);
+  }
+  close(fd);
+}
+
+
+static void fillPattern(uint8_t* buf, size_t len, int seed)
+{
+  size_t i;
+  for(i = 0; i < len; i++)
+  {
+    buf[i] = (uint8_t) (i * 31 + seed);
+  }
+}
+
+
+static void addFile(struct msf_volume* vol, const char* name, int seed)
+{
+  uint8_t buf[FILE_BYTES];
+  int32_t entry;
+
+  fillPattern(buf, sizeof(buf), seed);
+
+  int32_t inode = createFile(vol, name, 0, INODE_INLINE, &entry);
+  CHECK(inode > 0, "createFile");
+  CHECK(inode > 0 && writeFileRange(vol, inode, buf, 0, sizeof(buf)) == MSF_OK, "writeFileRange");
+}
+
+
+// 1 if name is in the image holding exactly the FILE_BYTES at want,
+// every block of it passing its checksum
+static int fileHolds(struct msf_volume* vol, const char* name, const uint8_t* want)
+{
+  uint8_t got[FILE_BYTES];
+
+  int32_t entry = findDirectoryEntry(vol, name);
+  if(entry == -1)
+  {
+    return 0;
+  }
+
+  int32_t inode = vol->directory[entry].inode;
+
+  return vol->inodes[inode].file_size == FILE_BYTES &&
+         readFileRange(vol, inode, got, 0, sizeof(got)) == sizeof(got) &&
+         memcmp(want, got, sizeof(got)) == 0;
+}
+
+
+// 1 if name is in the image with the bytes addFile gave it
+static int fileIntact(struct msf_volume* vol, const char* name, int seed)
+{
+  uint8_t want[FILE_BYTES];
+
+  fillPattern(want, sizeof(want), seed);
+  return fileHolds(vol, name, want);
+}
+
+
+// Log block of the newest commit block, -1 if there is none
+static int32_t newestCommit(uint8_t* image, const struct logPlace* place)
+{
+  uint8_t* log = image + (size_t) (place->journal_block + 1) * place->block_size;
+  int32_t newest = -1;
+  uint32_t newest_seq = 0;
+  uint32_t p;
+
+  for(p = 0; p < place->log_blocks; p++)
+  {
+    struct journalCommit* commit = (struct journalCommit*) (log + p * place->block_size);
+    if(commit->magic == JOURNAL_COMMIT_MAGIC && (newest == -1 || commit->seq > newest_seq))
+    {
+      newest = p;
+      newest_seq = commit->seq;
+    }
+  }
+
+  return newest;
+}
+
+
+// The crash: the newest transaction and the data runs it lists are on
+// disk, everything else is still what the save before it left there
+static void undoInPlace(uint8_t* image, const uint8_t* before, size_t size, const struct logPlace* place)
+{
+  uint8_t* log = image + (size_t) (place->journal_block + 1) * place->block_size;
+  uint8_t* keep = (uint8_t*) calloc(size / place->block_size, 1);
+  int32_t newest = newestCommit(image, place);
+
+  CHECK(newest != -1, "commit block in the log");
+  if(newest == -1)
+  {
+    free(keep);
+    return;
+  }
+
+  uint32_t b;
+  for(b = place->journal_block; b < place->journal_block + place->journal_blocks; b++)
+  {
+    keep[b] = 1;
+  }
+
+  struct journalCommit* commit = (struct journalCommit*) (log + newest * place->block_size);
+  uint32_t pos = newest - commit->num_blocks;
+
+  while(pos < (uint32_t) newest)
+  {
+    struct journalDescriptor* desc = (struct journalDescriptor*) (log + pos * place->block_size);
+    struct journalRun* runs = (struct journalRun*) &desc->meta[place->max_meta];
+    uint32_t i;
+
+    for(i = 0; i < desc->num_runs; i++)
+    {
+      memset(keep + runs[i].start, 1, runs[i].length);
+    }
+
+    pos += 1 + desc->num_meta;
+  }
+
+  for(b = 0; b < size / place->block_size; b++)
+  {
+    if(!keep[b])
+    {
+      memcpy(image + (size_t) b * place->block_size, before + (size_t) b * place->block_size, place->block_size);
+    }
+  }
+
+  free(keep);
+}
+
+
+// and then lose its commit block, as if the crash came before it got
+// to the disk
+static void tearCommit(uint8_t* image, const struct logPlace* place)
+{
+  int32_t newest = newestCommit(image, place);
+  if(newest != -1)
+  {
+    memset(image + (size_t) (place->journal_block + 1 + newest) * place->block_size, 0, place->block_size);
+  }
+}
+
+
+static void findLog(struct msf_volume* vol, struct logPlace* place)
+{
+  place->block_size = vol->block_size;
+  place->journal_block = vol->journal_block;
+  place->journal_blocks = vol->journal_blocks;
+  place->log_blocks = vol->journal_log_blocks;
+  place->max_meta = vol->journal_max_meta;
+}
+
+
+int main()
+{
+  char dir[] = "/tmp/msf_journal.XXXXXX";
+  if(mkdtemp(dir) == NULL || chdir(dir) == -1)
+  {
+    printf("FAIL: could not make a work directory\n");
+    return 1;
+  }
+
+  struct msf_volume* vol = allocVolume();
+  struct logPlace place;
+
+  CHECK(createfs(vol, "img", 1024, 4096, 32, 0) == 0, "createfs");
+  addFile(vol, "first", 1);
+  CHECK(saveImage(vol) == MSF_OK, "first save");
+  closeImage(vol);
+
+  size_t size;
+  uint8_t* before = readWhole("img", &size);
+
+  CHECK(openImage(vol, "img", 0) == MSF_OK, "open after first save");
+  addFile(vol, "second", 2);
+  CHECK(saveImage(vol) == MSF_OK, "second save");
+  findLog(vol, &place);
+  closeImage(vol);
+
+  uint8_t* after = readWhole("img", &size);
+  if(before == NULL || after == NULL)
+  {
+    printf("FAIL: could not read the image\n");
+    return 1;
+  }
+
+  undoInPlace(after, before, size, &place);
+  writeWhole("img", after, size);
+  CHECK(openImage(vol, "img", 0) == MSF_OK, "open with the commit in the log");
+  CHECK(fileIntact(vol, "first", 1), "first file after replay");
+  CHECK(fileIntact(vol, "second", 2), "second file replayed");
+  CHECK(vol->used_count->inodes == 2, "inode count replayed");
+  closeImage(vol);
+
+  tearCommit(after, &place);
+  writeWhole("img", after, size);
+  CHECK(openImage(vol, "img", 0) == MSF_OK, "open with a torn commit");
+  CHECK(fileIntact(vol, "first", 1), "first file after a torn commit");
+  CHECK(findDirectoryEntry(vol, "second") == -1, "torn transaction not replayed");
+  CHECK(vol->used_count->inodes == 1, "inode count after a torn commit");
+
+  // and the image goes on working from there
+  addFile(vol, "third", 3);
+  CHECK(saveImage(vol) == MSF_OK, "save after a torn commit");
+  closeImage(vol);
+  CHECK(openImage(vol, "img", 0) == MSF_OK, "reopen after a torn commit");
+  CHECK(fileIntact(vol, "third", 3), "file saved after a torn commit");
+  closeImage(vol);
+
+  free(before);
+  free(after);
+
+  // the same crash in a save that writes over part of a saved file,
+  // from inside its first block to inside its last
+  uint8_t changed[FILE_BYTES];
+  uint8_t over[FILE_BYTES];
+  fillPattern(changed, sizeof(changed), 1);
+  fillPattern(over, sizeof(over), 4);
+  memcpy(changed + 1000, over + 1000, 3000);
+
+  before = readWhole("img", &size);
+
+  CHECK(openImage(vol, "img", 0) == MSF_OK, "open before writing over a file");
+  int32_t entry = findDirectoryEntry(vol, "first");
+  CHECK(entry != -1 && writeFileRange(vol, vol->directory[entry].inode, over + 1000, 1000, 3000) == MSF_OK,
+        "write over a file");
+  CHECK(fileHolds(vol, "first", changed), "file after writing over it");
+  CHECK(saveImage(vol) == MSF_OK, "save after writing over a file");
+  findLog(vol, &place);
+  closeImage(vol);
+
+  after = readWhole("img", &size);
+  if(before == NULL || after == NULL)
+  {
+    printf("FAIL: could not read the image\n");
+    return 1;
+  }
+
+  undoInPlace(after, before, size, &place);
+  writeWhole("img", after, size);
+  CHECK(openImage(vol, "img", 0) == MSF_OK, "open with the overwrite in the log");
+  CHECK(fileHolds(vol, "first", changed), "overwrite replayed");
+  CHECK(fileIntact(vol, "third", 3), "other file after replaying an overwrite");
+  closeImage(vol);
+
+  tearCommit(after, &place);
+  writeWhole("img", after, size);
+  CHECK(openImage(vol, "img", 0) == MSF_OK, "open with a torn overwrite");
+  CHECK(fileIntact(vol, "first", 1), "file written over after a torn commit");
+  CHECK(fileIntact(vol, "third", 3), "other file after a torn overwrite");
+  closeImage(vol);
+
+  releaseVolume(vol);
+  free(before);
+  free(after);
+  unlink("img");
+  rmdir(dir);
+
+  printf("journal: %s\n", failures ? "FAILED" : "ok");
+  return failures != 0;
+}
@@ -0,0 +1,153 @@
+// libmsf through msf.h alone, apart from createfs to make the images:
+// open, write, read, truncate and unlink a file, what a handle on a
+// deleted file does, what survives an unmount, and two volumes mounted
+// side by side.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../res/baseCommands.h"
+
+static int failures;
+
+#define CHECK(cond, what) \
+  do { if(!(cond)) { printf("FAIL: %s\n", what); failures++; } } while(0)
+
+#define DATA_BYTES 20000 // more than the inode holds, so it needs blocks
+
+
+static void makeImage(const char* name)
+{
+  struct msf_volume* vol = allocVolume();
+
+  int status = createfs(vol, (char*) name, 1024, 4096, 32, 0);
+  if(status == 0)
+  {
+    status = saveImage(vol);
+  }
+
+  releaseVolume(vol);
+  CHECK(status == 0, "createfs");
+}
+
+
+int main()
+{
+  char dir[] = "/tmp/msf_libmsf.XXXXXX";
+  if(mkdtemp(dir) == NULL || chdir(dir) == -1)
+  {
+    printf("FAIL: could not make a work directory\n");
+    return 1;
+  }
+
+  makeImage("one.img");
+  makeImage("two.img");
+
+  uint8_t* data = (uint8_t*) malloc(DATA_BYTES);
+  uint8_t* got = (uint8_t*) malloc(DATA_BYTES);
+  size_t i;
+  for(i = 0; i < DATA_BYTES; i++)
+  {
+    data[i] = (uint8_t) (i * 7 + i / 251);
+  }
+
+  struct msf_volume* vol;
+  struct msf_volume* other;
+  struct msf_file* file;
+  struct msf_file* again;
+  struct msf_stat st;
+
+  CHECK(msf_mount("missing.img", 0, &vol) == MSF_ENOENT, "mount of a missing image");
+  CHECK(msf_mount("one.img", 0, &vol) == MSF_OK, "mount");
+  CHECK(msf_mount("one.img", 0, &other) == MSF_EBUSY, "second mount of one image");
+
+  // open, write, read
+  CHECK(msf_open(vol, "notes", MSF_RDONLY, &file) == MSF_ENOENT, "open of a missing file");
+  CHECK(msf_open(vol, "notes", MSF_RDWR | MSF_CREAT, &file) == MSF_OK, "create");
+  CHECK(msf_pwrite(file, data, DATA_BYTES, 0) == DATA_BYTES, "pwrite");
+  CHECK(msf_pread(file, got, DATA_BYTES, 0) == DATA_BYTES && memcmp(data, got, DATA_BYTES) == 0, "pread");
+  CHECK(msf_pread(file, got, 100, DATA_BYTES - 40) == 40, "pread across the end");
+  CHECK(msf_pread(file, got, 100, DATA_BYTES) == 0, "pread at the end");
+  CHECK(msf_fstat(file, &st) == MSF_OK && st.size == DATA_BYTES && st.blocks > 0, "fstat");
+
+  CHECK(msf_open(vol, "notes", MSF_RDWR | MSF_CREAT | MSF_EXCL, &again) == MSF_EEXIST, "exclusive create");
+  CHECK(msf_open(vol, "notes", MSF_RDONLY, &again) == MSF_OK, "second handle");
+  CHECK(msf_pwrite(again, data, 1, 0) == MSF_EBADF, "pwrite on a read only handle");
+  CHECK(msf_pread(again, got, DATA_BYTES, 0) == DATA_BYTES && memcmp(data, got, DATA_BYTES) == 0,
+        "pread on the second handle");
+  msf_close(again);
+
+  // a hole reads back as zeros
+  CHECK(msf_truncate(file, 1000) == MSF_OK, "truncate");
+  CHECK(msf_pwrite(file, data, 10, 5000) == 10, "pwrite past the end");
+  CHECK(msf_pread(file, got, 5010, 0) == 5010 && memcmp(data, got, 1000) == 0, "pread after truncate");
+  i = 1000;
+  while(i < 5000 && got[i] == 0)
+  {
+    i++;
+  }
+  CHECK(i == 5000 && memcmp(data, got + 5000, 10) == 0, "hole reads as zeros");
+  CHECK(msf_stat(vol, "notes", &st) == MSF_OK && st.size == 5010, "stat");
+
+  // unlink with the file still open
+  CHECK(msf_unlink(vol, "notes") == MSF_OK, "unlink");
+  CHECK(msf_unlink(vol, "notes") == MSF_ENOENT, "unlink of a deleted file");
+  CHECK(msf_stat(vol, "notes", &st) == MSF_ENOENT, "stat of a deleted file");
+
+  // the next file may well get the same inode, the old handle must not reach it
+  CHECK(msf_open(vol, "fresh", MSF_RDWR | MSF_CREAT, &again) == MSF_OK, "create after unlink");
+  CHECK(msf_pwrite(again, "fresh", 5, 0) == 5, "pwrite after unlink");
+  CHECK(msf_pread(file, got, 10, 0) == MSF_ESTALE, "pread on a deleted file");
+  CHECK(msf_pwrite(file, data, 10, 0) == MSF_ESTALE, "pwrite on a deleted file");
+  CHECK(msf_truncate(file, 0) == MSF_ESTALE, "truncate on a deleted file");
+  CHECK(msf_fstat(file, &st) == MSF_ESTALE, "fstat on a deleted file");
+  CHECK(msf_pread(again, got, 10, 0) == 5 && memcmp(got, "fresh", 5) == 0, "new file untouched");
+  msf_close(file);
+  msf_close(again);
+
+  // a second image at the same time
+  CHECK(msf_mount("two.img", 0, &other) == MSF_OK, "mount a second image");
+  CHECK(msf_open(other, "fresh", MSF_RDONLY, &file) == MSF_ENOENT, "volumes kept apart");
+  CHECK(msf_open(other, "big", MSF_RDWR | MSF_CREAT, &file) == MSF_OK, "create on the second volume");
+  CHECK(msf_pwrite(file, data, DATA_BYTES, 0) == DATA_BYTES, "pwrite on the second volume");
+  msf_close(file);
+  CHECK(msf_unmount(other) == MSF_OK, "unmount the second volume");
+
+  // what was written is there after unmounting
+  CHECK(msf_unmount(vol) == MSF_OK, "unmount");
+  CHECK(msf_mount("one.img", 0, &vol) == MSF_OK, "mount again");
+  CHECK(msf_mount("two.img", MSF_MOUNT_MMAP, &other) == MSF_OK, "mount the second image mapped");
+
+  uint32_t cursor = 0;
+  struct msf_dirent ent;
+  int count = 0;
+  while(msf_readdir(vol, &cursor, &ent) == 1)
+  {
+    CHECK(!strcmp(ent.name, "fresh") && ent.size == 5, "readdir");
+    count++;
+  }
+  CHECK(count == 1, "one file left");
+
+  CHECK(msf_open(other, "big", MSF_RDONLY, &file) == MSF_OK, "open on the mapped volume");
+  CHECK(msf_pread(file, got, DATA_BYTES, 0) == DATA_BYTES && memcmp(data, got, DATA_BYTES) == 0,
+        "pread on the mapped volume");
+  msf_close(file);
+
+  // neither volume changed since it was mounted, so nothing is written
+  uint64_t syncs = stats.host_syncs;
+  CHECK(msf_unmount(other) == MSF_OK && msf_unmount(vol) == MSF_OK, "unmount both");
+  CHECK(stats.host_syncs == syncs, "unmount of unchanged volumes wrote to the image");
+
+  free(data);
+  free(got);
+  unlink("one.img");
+  unlink("two.img");
+  rmdir(dir);
+
+  printf("libmsf: %s\n", failures ? "FAILED" : "ok");
+  return failures != 0;
+}
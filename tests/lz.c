@@ -0,0 +1,162 @@
+// The LZ codec compressed clusters are stored with. Every input has to
+// come back byte for byte, a compressed size that does not fit has to be
+// refused without writing past the buffer, and bad input has to be
+// turned away by lzDecompress instead of overrunning its output.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../res/lz.h"
+
+#define MAX_LEN (256 * 1024)
+#define GUARD 64 // bytes past each buffer that must stay untouched
+
+static int failures;
+
+#define CHECK(cond, what, len) \
+  do { if(!(cond)) { printf("FAIL: %s, %zu bytes\n", what, (size_t) (len)); failures++; } } while(0)
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t nextRandom()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+
+enum { ZEROS, TEXT, RANDOM, MIXED, RUNS, NUM_KINDS };
+
+static void fillKind(uint8_t* buf, size_t len, int kind)
+{
+  static const char text[] = "{\"id\": 1234, \"name\": \"sample record\", \"tags\": [\"a\", \"b\"]}\n";
+  size_t i;
+
+  for(i = 0; i < len; i++)
+  {
+    switch(kind)
+    {
+      case ZEROS:  buf[i] = 0; break;
+      case TEXT:   buf[i] = text[i % (sizeof(text) - 1)]; break;
+      case RANDOM: buf[i] = (uint8_t) nextRandom(); break;
+      case MIXED:  buf[i] = (i / 512) % 2 ? text[i % (sizeof(text) - 1)] : (uint8_t) nextRandom(); break;
+      default:     buf[i] = (uint8_t) ((i / 300) % 7); break;
+    }
+  }
+}
+
+
+static int guardIntact(const uint8_t* p)
+{
+  int i;
+  for(i = 0; i < GUARD; i++)
+  {
+    if(p[i] != 0xa5)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+static void roundTrip(const uint8_t* in, size_t len, uint8_t* packed, uint8_t* out)
+{
+  size_t cap = len + len / 255 + 64;
+
+  memset(packed, 0xa5, cap + GUARD);
+  size_t packed_len = lzCompress(in, len, packed, cap);
+  CHECK(packed_len > 0 || len == 0, "compress with room to spare", len);
+  CHECK(guardIntact(packed + cap), "compress wrote past out_cap", len);
+
+  memset(out, 0xa5, len + GUARD);
+  CHECK(lzDecompress(packed, packed_len, out, len) == 0, "decompress", len);
+  CHECK(memcmp(in, out, len) == 0, "round trip changed the bytes", len);
+  CHECK(guardIntact(out + len), "decompress wrote past out_len", len);
+
+  if(len > 0)
+  {
+    // what does not expand to exactly out_len is refused
+    memset(out, 0xa5, len + GUARD);
+    CHECK(lzDecompress(packed, packed_len, out, len - 1) == -1, "short out_len accepted", len);
+    CHECK(guardIntact(out + len - 1), "short out_len overrun", len);
+
+    // a stream that ends in a match is complete without its last,
+    // empty token. Anything else cut short has to be refused
+    memset(out, 0xa5, len + GUARD);
+    int cut = lzDecompress(packed, packed_len - 1, out, len);
+    CHECK(cut == -1 || memcmp(in, out, len) == 0, "truncated input decoded wrong", len);
+    CHECK(cut == -1 || packed[packed_len - 1] == 0, "truncated input accepted", len);
+
+    // room for less than it compresses to is refused, not overrun
+    if(packed_len > 1)
+    {
+      memset(packed, 0xa5, packed_len - 1 + GUARD);
+      CHECK(lzCompress(in, len, packed, packed_len - 1) == 0, "compress into too little room", len);
+      CHECK(guardIntact(packed + packed_len - 1), "compress overran a small out_cap", len);
+    }
+  }
+}
+
+
+// Flip bytes of good compressed data. The result may or may not still
+// decode, but it must never write past out_len
+static void corrupt(const uint8_t* in, size_t len, uint8_t* packed, uint8_t* out)
+{
+  size_t packed_len = lzCompress(in, len, packed, len + len / 255 + 64);
+  int round;
+
+  for(round = 0; round < 200 && packed_len > 0; round++)
+  {
+    uint8_t* bad = (uint8_t*) malloc(packed_len);
+    memcpy(bad, packed, packed_len);
+    bad[nextRandom() % packed_len] ^= (uint8_t) (1 + nextRandom() % 255);
+
+    memset(out, 0xa5, len + GUARD);
+    lzDecompress(bad, packed_len, out, len);
+    CHECK(guardIntact(out + len), "corrupt input overran out_len", len);
+    free(bad);
+  }
+}
+
+
+int main()
+{
+  static const size_t lengths[] = { 0, 1, 3, 4, 5, 12, 13, 100, 511, 4096, 65535, 65536, 65537, MAX_LEN };
+  uint8_t* in = (uint8_t*) malloc(MAX_LEN);
+  uint8_t* packed = (uint8_t*) malloc(MAX_LEN + MAX_LEN / 255 + 64 + GUARD);
+  uint8_t* out = (uint8_t*) malloc(MAX_LEN + GUARD);
+
+  size_t l;
+  int kind;
+  for(l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+  {
+    for(kind = 0; kind < NUM_KINDS; kind++)
+    {
+      fillKind(in, lengths[l], kind);
+      roundTrip(in, lengths[l], packed, out);
+    }
+  }
+
+  // every length across the short cases the encoder treats specially
+  for(l = 0; l < 300; l++)
+  {
+    fillKind(in, l, MIXED);
+    roundTrip(in, l, packed, out);
+  }
+
+  fillKind(in, 65536, MIXED);
+  corrupt(in, 65536, packed, out);
+  fillKind(in, 4096, TEXT);
+  corrupt(in, 4096, packed, out);
+
+  free(in);
+  free(packed);
+  free(out);
+
+  printf("lz: %s\n", failures ? "FAILED" : "ok");
+  return failures != 0;
+}